@@ -16,20 +16,206 @@ typedef size_t AAIndexType;
  */
 typedef struct AssociativeArray AssociativeArray;
 
-/** creator and destructor for the associative array */
+/**
+ * creator and destructor for the associative array.  A valueSize of 0
+ * stores the void * values given to aaInsert; otherwise valueSize bytes
+ * are copied from each value into the table itself.  A probingStrategy
+ * of "art" keeps the keys in an adaptive radix tree instead of hashing
+ * them, which iterates in key order and grows and shrinks with the keys
+ */
 AssociativeArray *aaCreateAssociativeArray(
 			size_t size,
+			size_t valueSize,
 			char *probingStrategyl,
 			char *primaryHashAlgorithm,
 			char *secondaryHashAlgorithm
 		);
 void aaDeleteAssociativeArray(AssociativeArray *array);
 
+/**
+ * memory callbacks for aaCreateAssociativeArrayEx(), each passed the
+ * context pointer given alongside them.  They behave as malloc(3),
+ * realloc(3) and free(3); free is never passed NULL
+ */
+typedef struct AAAllocator {
+	void *(*allocate)(size_t size, void *context);
+	void *(*reallocate)(void *memory, size_t size, void *context);
+	void (*release)(void *memory, void *context);
+	void *context;
+} AAAllocator;
+
+AssociativeArray *aaCreateAssociativeArrayEx(
+			size_t size,
+			size_t valueSize,
+			char *probingStrategy,
+			char *primaryHashAlgorithm,
+			char *secondaryHashAlgorithm,
+			const AAAllocator *allocator
+		);
+
+/** change the number of slots, keeping all of the entries */
+int aaResize(AssociativeArray *array, size_t newSize);
+
+/**
+ * how the slots of the table are allocated.  Large tables are mapped
+ * with mmap(2), which gives zeroed pages without touching them, unless
+ * the table was created with an allocator of its own; these flags map
+ * a table of any size, backed by (transparent or reserved) huge pages,
+ * and/or with every page faulted in up front
+ */
+#define	AA_MEMORY_DEFAULT	0x00
+#define	AA_MEMORY_HUGEPAGE	0x01
+#define	AA_MEMORY_HUGETLB	0x02
+#define	AA_MEMORY_POPULATE	0x04
+
+int aaSetMemoryFlags(AssociativeArray *array, int memoryFlags);
+
+/**
+ * check a Bloom filter of bitsPerKey bits per slot before looking for
+ * a key, so that most misses end without probing; 0 removes it
+ */
+int aaSetBloomFilter(AssociativeArray *array, int bitsPerKey);
+
+/**
+ * as aaSetBloomFilter, but with a cuckoo filter of fingerprintBits-bit
+ * fingerprints, from which deleted keys are removed; 0 removes it
+ */
+int aaSetCuckooFilter(AssociativeArray *array, int fingerprintBits);
+
+/**
+ * look up keys first in a small direct-mapped cache of nSlots keys lately
+ * found, so that the hottest keys are found without probing; nSlots of
+ * -1 gives a default that fits the L1 cache, and 0 removes it
+ */
+int aaSetFrontCache(AssociativeArray *array, int nSlots);
+
+/**
+ * make the table a cache of at most maxEntries entries and maxBytes
+ * bytes of keys and entries (0 for no limit), which evicts entries by
+ * CLOCK rather than refuse an insert.  evict is given each entry evicted,
+ * with the table locked, so that it can free the value
+ */
+typedef void (*AAEvictFunction)(AAKeyType key, size_t keylen, void *value, void *userdata);
+
+int aaSetCacheMode(AssociativeArray *array, size_t maxEntries, size_t maxBytes,
+		AAEvictFunction evict, void *userdata);
+
+/**
+ * let each key hold any number of values, chosen while the table is
+ * empty.  aaAppend() (or aaInsert()) of a key already present adds to
+ * its values, and aaLookupAll() finds them all with one probe, as an
+ * array of *nValues value pointers, or of valueSize-byte values for a
+ * table which copies them in.  aaLookup() and iteration see the first
+ * value of each key, and aaDelete() removes the key with all of them.
+ * Multimaps cannot be logged, saved, used as caches or given TTLs
+ */
+int aaSetMultimap(AssociativeArray *array, int enable);
+int aaAppend(AssociativeArray *array, AAKeyType key, size_t keylength, void *value);
+void *aaLookupAll(AssociativeArray *array, AAKeyType key, size_t keylength,
+		int *nValues);
+
+/**
+ * ways a table may be shared between threads.  With AA_CONCURRENCY_SEQLOCK
+ * one thread at a time may insert or delete, while any number of threads
+ * call aaLookup() without taking a lock.  With AA_CONCURRENCY_STRIPED,
+ * each key is covered by one of a number of locks, so that operations
+ * on keys under different locks run in parallel
+ */
+#define	AA_CONCURRENCY_NONE		0
+#define	AA_CONCURRENCY_SEQLOCK	1
+#define	AA_CONCURRENCY_STRIPED	2
+
+int aaSetConcurrency(AssociativeArray *array, int mode, int nSegments);
+
 int aaIterateAction(
 		AssociativeArray *array,
 		int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *userdata),
 		void *userdata);
 
+/**
+ * as aaIterateAction, but spreading the work over nThreads threads, each
+ * given its own threaddata[] element; reduce then combines them
+ */
+int aaParallelIterate(
+		AssociativeArray *array,
+		int nThreads,
+		int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *threaddata),
+		void **threaddata,
+		int (*reduce)(void *threaddata, void *userdata),
+		void *userdata);
+
+/**
+ * keep the keys in order as well, in a B+-tree beside the table, so
+ * that aaRangeScan() can visit those from lo to hi (inclusive, NULL for
+ * no limit), and aaPrefixScan() those beginning with prefix, in order
+ * and without looking at the others; enable of 0 removes it
+ */
+int aaSetOrderedIndex(AssociativeArray *array, int enable);
+int aaRangeScan(AssociativeArray *array, AAKeyType lo, size_t lolen,
+		AAKeyType hi, size_t hilen,
+		int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *userdata),
+		void *userdata);
+int aaPrefixScan(AssociativeArray *array, AAKeyType prefix, size_t prefixlen,
+		int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *userdata),
+		void *userdata);
+
+/** one key/value pair handed back by aaScan() */
+typedef struct AAScanEntry {
+	AAKeyType key;
+	size_t keylen;
+	void *value;
+} AAScanEntry;
+
+/**
+ * resumable iteration: fill out[] with up to count entries starting at
+ * cursor (0 to begin), returning the cursor to resume from (0 when done).
+ * A cursor follows the entries through one rebuild of the table; after
+ * more than one it starts again, so some entries come back twice
+ */
+size_t aaScan(AssociativeArray *array, size_t cursor, int count,
+		AAScanEntry *out, int *nFound);
+
+/**
+ * write the table to a file, and create a new table from one.  Values
+ * not copied into the table are saved as NUL-terminated strings, and
+ * are loaded into malloc(3)ed copies which the caller must free
+ */
+int aaSave(AssociativeArray *array, const char *path);
+AssociativeArray *aaLoad(const char *path);
+
+/**
+ * save a snapshot from a forked child while the table carries on being
+ * changed, returning a descriptor which becomes readable once it is
+ * written; aaSnapshotWait() then collects the result
+ */
+int aaSnapshotAsync(AssociativeArray *array, const char *path);
+int aaSnapshotWait(AssociativeArray *array);
+
+/**
+ * log every change to the table, replaying any changes the log already
+ * holds.  Changes are forced to disk groupSize at a time, or at
+ * aaSyncLog(); aaCheckpoint() saves a snapshot and empties the log
+ */
+int aaOpenLog(AssociativeArray *array, const char *path, int groupSize);
+int aaSyncLog(AssociativeArray *array);
+int aaCheckpoint(AssociativeArray *array, const char *snapshotPath);
+
+/**
+ * write the table in a form holding no pointers, which aaOpenMapped()
+ * maps and uses in place, without reading it in.  A mapped table is
+ * read-only, and its values point into the file until it is deleted.
+ * Entries given a time to live are written without it, as they stand
+ */
+int aaSaveMapped(AssociativeArray *array, const char *path);
+AssociativeArray *aaOpenMapped(const char *path);
+
+/**
+ * index the keys now in the table by a minimal perfect hash, so that
+ * every lookup looks at exactly one slot.  The table is read-only
+ * from then on, so entries that expire stay in it, unseen by lookups
+ */
+int aaFreezePerfect(AssociativeArray *array);
+
 /** the interface to do the critical work: insert, delete and lookup */
 int aaInsert(AssociativeArray *array,
 		AAKeyType key, size_t keylength,
@@ -37,6 +223,61 @@ int aaInsert(AssociativeArray *array,
 void *aaDelete(AssociativeArray *aarray, AAKeyType key, size_t keylen);
 void *aaLookup(AssociativeArray *aarray, AAKeyType key, size_t keylength);
 
+/**
+ * insert an entry which expires ttlMs milliseconds from now, and is
+ * then treated as deleted.  Expired entries are reaped as they are come
+ * across, a few at each insert and delete, or by aaExpireSweep() looking
+ * at up to maxEntries entries (0 for all); expire is given each one
+ * reaped, with the table locked, so that it can free the value.
+ * aaSave() and the log keep each deadline as a time of day, so entries
+ * loaded or replayed later still expire when they were due to
+ */
+int aaInsertWithTTL(AssociativeArray *array,
+		AAKeyType key, size_t keylength,
+		void *value, long ttlMs);
+int aaExpireSweep(AssociativeArray *array, int maxEntries);
+void aaSetExpireFunction(AssociativeArray *array, AAEvictFunction expire, void *userdata);
+
+/**
+ * A table split into a number of independent shards, each with its own
+ * lock, growth and statistics; keys are routed to a shard by hash
+ */
+typedef struct AAShardedArray AAShardedArray;
+
+AAShardedArray *aaCreateSharded(
+			int nShards,
+			size_t size,
+			char *probingStrategy,
+			char *primaryHashAlgorithm,
+			char *secondaryHashAlgorithm
+		);
+void aaDeleteSharded(AAShardedArray *sharded);
+int aaShardedInsert(AAShardedArray *sharded,
+		AAKeyType key, size_t keylength,
+		void *value);
+void *aaShardedDelete(AAShardedArray *sharded, AAKeyType key, size_t keylen);
+void *aaShardedLookup(AAShardedArray *sharded, AAKeyType key, size_t keylength);
+int aaShardedIterateAction(
+		AAShardedArray *sharded,
+		int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *userdata),
+		void *userdata);
+void aaShardedPrintSummary(FILE *fp, AAShardedArray *sharded);
+
+/**
+ * A fixed-size table of long keys that any number of threads may use at
+ * once without locks.  AA_LOCKFREE_EMPTY_KEY marks unused slots, so it
+ * cannot itself be stored as a key, and values may not be NULL
+ */
+typedef struct AALockFreeIntTable AALockFreeIntTable;
+
+#define	AA_LOCKFREE_EMPTY_KEY	(-__LONG_MAX__ - 1L)
+
+AALockFreeIntTable *aaCreateLockFreeIntTable(size_t size, char *probingStrategy);
+void aaDeleteLockFreeIntTable(AALockFreeIntTable *table);
+int aaLockFreeInsert(AALockFreeIntTable *table, long key, void *value);
+void *aaLockFreeDelete(AALockFreeIntTable *table, long key);
+void *aaLockFreeLookup(AALockFreeIntTable *table, long key);
+
 /** print out the data, prefixing each line with the lineLeader */
 void aaPrintContents(FILE *fp, AssociativeArray *array, char *lineLeader);
 void aaPrintSummary(FILE *fp, AssociativeArray *array);
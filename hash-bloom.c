@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "hashtools.h"
+
+/**
+ * The Bloom filter is "blocked": each key's bits all lie within one
+ * block of BLOOM_BLOCK_WORDS words, a single cache line, so that asking
+ * the filter about a key costs one memory access however many bits it
+ * checks.  The filter is sized from the number of slots, which bounds
+ * the number of entries, and is made afresh whenever the table is
+ * rebuilt, which also clears out the bits of deleted keys.
+ *
+ * The blocks are allocated as an index is (see hash-memory.c), which
+ * gives zeroed, line-aligned memory, and so are retired in the same
+ * way when lock-free readers may still be looking at them.
+ */
+#define	BLOOM_BLOCK_WORDS	8
+#define	BLOOM_BLOCK_BITS	(BLOOM_BLOCK_WORDS * 64)
+
+/** seed for aaKeyHash64(), so the filter's hash is unlike any other */
+#define	BLOOM_SEED			0x426c6f6f6dULL
+
+#define	BLOOM_MAX_HASHES	16
+
+
+/** bits checked per key, ln(2) times the bits per key being best */
+static int bloomHashesFor(int bitsPerKey)
+{
+	int nHashes = (bitsPerKey * 69 + 50) / 100;
+
+	if (nHashes < 1)
+		return 1;
+	if (nHashes > BLOOM_MAX_HASHES)
+		return BLOOM_MAX_HASHES;
+	return nHashes;
+}
+
+/** the block a hash falls in, by multiply and shift rather than modulus */
+static uint64_t *bloomBlock(const AssociativeArray *aarray, uint64_t hash)
+{
+	uint64_t block = ((hash >> 32) * (uint64_t) aarray->bloomBlocks) >> 32;
+
+	return aarray->bloom + block * BLOOM_BLOCK_WORDS;
+}
+
+/**
+ * The i'th bit of a key within its block.  The bits are spread by
+ * double hashing on the low half of the hash, the high half having
+ * chosen the block.
+ */
+static int bloomBit(uint64_t hash, int i)
+{
+	uint32_t h1 = (uint32_t) hash;
+	uint32_t h2 = (h1 >> 16) | (h1 << 16) | 1;
+
+	return (h1 + (uint32_t) i * h2) % BLOOM_BLOCK_BITS;
+}
+
+static void bloomAddHash(AssociativeArray *aarray, uint64_t hash)
+{
+	uint64_t *block = bloomBlock(aarray, hash);
+	int i, bit;
+
+	for (i = 0; i < aarray->bloomHashes; i++) {
+		bit = bloomBit(hash, i);
+		__atomic_fetch_or(&block[bit / 64], (uint64_t) 1 << (bit % 64),
+				__ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Add a key to the filter, if the table has one.  Called by writers
+ * before they publish the key's entry, so that any reader who can see
+ * the entry will also see its bits.
+ */
+void aaBloomAdd(AssociativeArray *aarray, AAKeyType key, size_t keylen)
+{
+	if (aarray->bloom != NULL)
+		bloomAddHash(aarray, aaKeyHash64(key, keylen, BLOOM_SEED));
+}
+
+/**
+ * Ask the filter whether the key may be in the table
+ *
+ *  @return      0 if the key is certainly not in the table, else 1
+ *				 (including when the table has no filter)
+ */
+int aaBloomMayContain(const AssociativeArray *aarray, AAKeyType key, size_t keylen)
+{
+	uint64_t hash, *block;
+	int i, bit;
+
+	if (aarray->bloom == NULL)
+		return 1;
+
+	hash = aaKeyHash64(key, keylen, BLOOM_SEED);
+	block = bloomBlock(aarray, hash);
+	for (i = 0; i < aarray->bloomHashes; i++) {
+		bit = bloomBit(hash, i);
+		if ((__atomic_load_n(&block[bit / 64], __ATOMIC_RELAXED)
+					& ((uint64_t) 1 << (bit % 64))) == 0)
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Make a new filter for a table, sized for its slots and holding the
+ * keys of its live entries, in place of the one it has.  This is done
+ * on a copy of the table header, off to the side, so the old filter is
+ * left for the caller to swap out and retire.
+ *
+ *  @return      1 on success, or -1 if there was no memory for it, in
+ *				 which case the header keeps the filter it had
+ */
+int aaBloomBuild(AssociativeArray *aarray)
+{
+	AssociativeArray sized = *aarray;
+	size_t bits;
+	int i;
+
+	if (aarray->bloomBitsPerKey <= 0) {
+		aarray->bloom = NULL;
+		return 1;
+	}
+
+	bits = (size_t) aarray->size * aarray->bloomBitsPerKey;
+	sized.bloomBlocks = (bits + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS;
+	sized.bloomHashes = bloomHashesFor(aarray->bloomBitsPerKey);
+	sized.bloom = (uint64_t *) aaAllocIndex(aarray,
+			(size_t) sized.bloomBlocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t));
+	if (sized.bloom == NULL)
+		return -1;
+
+	for (i = 0; i < aarray->nUsed; i++) {
+		KeyDataPair *pair = aaEntry(aarray, i);
+
+		if (pair->validity == HASH_USED)
+			bloomAddHash(&sized,
+					aaKeyHash64(pair->key, pair->keylen, BLOOM_SEED));
+	}
+
+	aarray->bloom = sized.bloom;
+	aarray->bloomBlocks = sized.bloomBlocks;
+	aarray->bloomHashes = sized.bloomHashes;
+	return 1;
+}
+
+/**
+ * Put a Bloom filter in front of the table, so that most lookups (and
+ * deletes) of keys not in it end after reading one cache line of the
+ * filter, rather than walking a probe sequence.  The filter takes
+ * bitsPerKey bits for each slot of the table; 10 bits gives about 1% of
+ * misses getting past it.  A bitsPerKey of 0 removes the filter.
+ *
+ *  @return      1 on success, or -1 if there was no memory for it
+ */
+int aaSetBloomFilter(AssociativeArray *aarray, int bitsPerKey)
+{
+	AssociativeArray built;
+	uint64_t *oldBloom;
+	int result;
+
+	if (aaRefuseReadOnly(aarray) || aaRefuseRadix(aarray))
+		return -1;
+
+	aaLockTable(aarray);
+	built = *aarray;
+	built.bloomBitsPerKey = (bitsPerKey < 0) ? 0 : bitsPerKey;
+	result = aaBloomBuild(&built);
+
+	if (result > 0) {
+		oldBloom = aarray->bloom;
+		aaStructureBegin(aarray);
+		aarray->bloom = built.bloom;
+		aarray->bloomBlocks = built.bloomBlocks;
+		aarray->bloomHashes = built.bloomHashes;
+		aarray->bloomBitsPerKey = built.bloomBitsPerKey;
+		aaStructureEnd(aarray);
+
+		/** lock-free readers may still be checking the old one */
+		aaRetireIndex(aarray, oldBloom);
+	}
+	aaUnlockTable(aarray);
+
+	return result;
+}
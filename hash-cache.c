@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashtools.h"
+
+/**
+ * A table in cache mode evicts entries rather than refuse an insert
+ * once it holds as many entries, or as many bytes, as it is allowed.
+ * The victim is chosen by CLOCK: each entry has a reference bit, set
+ * by every lookup that finds it, and the hand sweeps round the dense
+ * entries clearing the bits it finds set, and evicting the first entry
+ * whose bit was already clear.  A lookup therefore costs at most one
+ * store to the entry it found, and there is no list to keep in order.
+ *
+ * Evicting takes the whole table, so on a shared table each eviction
+ * frees a little more than is needed (CACHE_SLACK of the limit), rather
+ * than every insert taking the table in turn.
+ *
+ * The bytes counted for an entry are those the table itself holds: its
+ * key, and the entry with any value copied into it.  Values held only
+ * by pointer are not seen by the table, so are not counted.
+ */
+#define	CACHE_SLACK(limit)	((limit) / 64)
+
+typedef struct AACache {
+	size_t maxEntries;
+	size_t maxBytes;
+	size_t nBytes;
+	int hand;
+	AAEvictFunction evict;
+	void *userdata;
+} AACache;
+
+
+/** the bytes charged to the cache for one entry */
+static size_t entryBytes(AssociativeArray *aarray, size_t keylen)
+{
+	return aarray->entrySize + keylen;
+}
+
+/** the most entries the cache may hold: its limit, or else the table's */
+static size_t entryLimit(AssociativeArray *aarray)
+{
+	AACache *cache = aarray->cache;
+
+	if (cache->maxEntries == 0 || cache->maxEntries > (size_t) aarray->size)
+		return aarray->size;
+	return cache->maxEntries;
+}
+
+/**
+ * Would the cache be over its limits with slack more entries (and
+ * bytes in proportion) added?
+ */
+static int overBudget(AssociativeArray *aarray, size_t keylen, int slack)
+{
+	AACache *cache = aarray->cache;
+	size_t limit = entryLimit(aarray);
+	size_t nEntries = __atomic_load_n(&aarray->nEntries, __ATOMIC_RELAXED);
+	size_t nBytes = __atomic_load_n(&cache->nBytes, __ATOMIC_RELAXED);
+
+	if (nEntries == 0)
+		return 0;
+	if (nEntries + 1 + (slack ? CACHE_SLACK(limit) : 0) > limit)
+		return 1;
+	return cache->maxBytes != 0
+			&& nBytes + entryBytes(aarray, keylen)
+				+ (slack ? CACHE_SLACK(cache->maxBytes) : 0) > cache->maxBytes;
+}
+
+/**
+ * Move the hand on to the next entry that has not been used since the
+ * hand last passed it, and evict it.  Called with the table locked.
+ */
+static void evictOne(AssociativeArray *aarray)
+{
+	AACache *cache = aarray->cache;
+	KeyDataPair *pair;
+
+	for (;;) {
+		if (cache->hand >= aarray->nUsed)
+			cache->hand = 0;
+		pair = aaEntry(aarray, cache->hand++);
+
+		if (pair->validity != HASH_USED)
+			continue;
+		if (__atomic_load_n(&pair->referenced, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&pair->referenced, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		break;
+	}
+
+	aaRemovePair(aarray, pair);
+
+	/** replaying the log must not bring the entry back */
+	if (aarray->log != NULL)
+		aaLogChange(aarray, 0, pair->key, pair->keylen, NULL, 0);
+
+	if (cache->evict != NULL)
+		(*cache->evict)(pair->key, pair->keylen, aaPairValue(aarray, pair),
+				cache->userdata);
+}
+
+/**
+ * Make room for an entry with a key of keylen bytes, if the table is a
+ * cache and is full; called by aaInsert() before it takes any lock
+ */
+void aaCacheMakeRoom(AssociativeArray *aarray, size_t keylen)
+{
+	int shared = (aarray->concurrency != AA_CONCURRENCY_NONE);
+
+	if ( ! overBudget(aarray, keylen, 0))
+		return;
+
+	aaLockTable(aarray);
+	aaStructureBegin(aarray);
+	while (overBudget(aarray, keylen, shared))
+		evictOne(aarray);
+	aaStructureEnd(aarray);
+	aaUnlockTable(aarray);
+}
+
+/**
+ * Add (direction 1) or take away (direction -1) the bytes of an entry
+ * from the cache's count, if the table is a cache
+ */
+void aaCacheCharge(AssociativeArray *aarray, size_t keylen, int direction)
+{
+	if (aarray->cache == NULL)
+		return;
+
+	if (direction > 0)
+		__atomic_fetch_add(&aarray->cache->nBytes, entryBytes(aarray, keylen),
+				__ATOMIC_RELAXED);
+	else
+		__atomic_fetch_sub(&aarray->cache->nBytes, entryBytes(aarray, keylen),
+				__ATOMIC_RELAXED);
+}
+
+/**
+ * Keep the hand on the same entry when a rebuild squeezes out the
+ * deleted ones, so that the sweep carries on where it was
+ */
+void aaCacheRebuilt(AssociativeArray *aarray, char *oldTable, int oldUsed)
+{
+	AACache *cache = aarray->cache;
+	int i, hand = 0;
+
+	if (cache == NULL)
+		return;
+
+	for (i = 0; i < cache->hand && i < oldUsed; i++) {
+		KeyDataPair *pair = (KeyDataPair *) (oldTable + i * aarray->entrySize);
+
+		if (pair->validity == HASH_USED)
+			hand++;
+	}
+	cache->hand = hand;
+}
+
+/**
+ * Make the table a cache: once it holds maxEntries entries, or its keys
+ * and entries take maxBytes bytes, each insert first evicts entries
+ * chosen by CLOCK.  A limit of 0 is no limit, though the table never
+ * holds more entries than it has slots.  Each entry evicted is passed
+ * to evict (if not NULL) along with userdata, so that its value can be
+ * freed; the table is locked meanwhile, so evict must not use it.
+ * Calling this again changes the limits.
+ *
+ *  @return      1 on success, or -1 if the table cannot be a cache
+ */
+int aaSetCacheMode(AssociativeArray *aarray, size_t maxEntries, size_t maxBytes,
+		AAEvictFunction evict, void *userdata)
+{
+	AACache *cache;
+	int i;
+
+	if (aaRefuseReadOnly(aarray) || aaRefuseRadix(aarray) || aaRefuseMultimap(aarray))
+		return -1;
+
+	aaLockTable(aarray);
+	cache = aarray->cache;
+	if (cache == NULL) {
+		cache = (AACache *) aaMalloc(aarray, sizeof(AACache));
+		if (cache == NULL) {
+			aaUnlockTable(aarray);
+			return -1;
+		}
+		memset(cache, 0, sizeof(AACache));
+
+		/** entries already in the table count against the limits */
+		for (i = 0; i < aarray->nUsed; i++) {
+			KeyDataPair *pair = aaEntry(aarray, i);
+
+			if (pair->validity == HASH_USED)
+				cache->nBytes += entryBytes(aarray, pair->keylen);
+		}
+	}
+	cache->maxEntries = maxEntries;
+	cache->maxBytes = maxBytes;
+	cache->evict = evict;
+	cache->userdata = userdata;
+	aarray->cache = cache;
+	aaUnlockTable(aarray);
+
+	return 1;
+}
+
+/**
+ * Free the cache settings of a table; called when it is deleted
+ */
+void aaFreeCache(AssociativeArray *aarray)
+{
+	aaFree(aarray, aarray->cache);
+	aarray->cache = NULL;
+}
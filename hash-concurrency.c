@@ -0,0 +1,526 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "hashtools.h"
+
+/** number of sequence counters or locks used if the caller does not choose */
+#define	DEFAULT_SEGMENTS	64
+
+/** number of retired blocks a table holds before trying to free them */
+#define	RECLAIM_THRESHOLD	32
+
+/**
+ * Memory that a writer has finished with, but which a lock-free reader
+ * might still be looking at.  It is held until every reader has moved
+ * past the epoch in which it was retired.
+ */
+typedef struct RetiredMemory {
+	void *memory;
+	void (*release)(AssociativeArray *aarray, void *memory);
+	unsigned long epoch;
+	struct RetiredMemory *next;
+} RetiredMemory;
+
+/**
+ * Epoch-based reclamation.  Each thread that reads without a lock owns
+ * an EpochRecord, in which it announces the global epoch it saw on the
+ * way in to a lookup, and 0 once it is out again.  Memory retired in
+ * epoch r may be freed once every announced epoch is later than r, as
+ * any reader that started since cannot have found it.
+ *
+ * Records are shared by all tables, are never freed, and are handed on
+ * to a new thread once their owner exits.  Each fills a cache line, so
+ * a reader's announcement touches no line another reader is writing.
+ */
+typedef struct EpochRecord {
+	unsigned long epoch;
+	int depth;
+	int inUse;
+	struct EpochRecord *next;
+} __attribute__((aligned(64))) EpochRecord;
+
+static unsigned long sGlobalEpoch = 1;
+static EpochRecord *sEpochRecords = NULL;
+static pthread_key_t sEpochKey;
+static pthread_once_t sEpochOnce = PTHREAD_ONCE_INIT;
+static __thread EpochRecord *tEpochRecord = NULL;
+
+
+/**
+ * Sequence counters: a writer makes the counter odd while it changes
+ * what the counter protects, and even again once done.  A reader notes
+ * an even value before it starts, and if the counter is not the same
+ * once it has finished, what it read may be torn and it must try again.
+ */
+static void seqWriteBegin(unsigned int *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void seqWriteEnd(unsigned int *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static unsigned int seqReadBegin(unsigned int *seq)
+{
+	unsigned int value;
+
+	while ((value = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1)
+		sched_yield();
+	return value;
+}
+
+static int seqReadRetry(unsigned int *seq, unsigned int value)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(seq, __ATOMIC_RELAXED) != value;
+}
+
+/** give a thread's record back when the thread exits */
+static void releaseEpochRecord(void *arg)
+{
+	EpochRecord *record = (EpochRecord *) arg;
+
+	__atomic_store_n(&record->epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&record->inUse, 0, __ATOMIC_RELEASE);
+}
+
+static void createEpochKey(void)
+{
+	pthread_key_create(&sEpochKey, releaseEpochRecord);
+}
+
+/**
+ * Find this thread's record, taking over an abandoned one or adding a
+ * new one to the list the first time it is needed.  Returns NULL only
+ * if there is no memory for a new record.
+ */
+static EpochRecord *threadEpochRecord(void)
+{
+	EpochRecord *record;
+	int unused;
+
+	if (tEpochRecord != NULL)
+		return tEpochRecord;
+
+	pthread_once(&sEpochOnce, createEpochKey);
+
+	for (record = __atomic_load_n(&sEpochRecords, __ATOMIC_ACQUIRE);
+			record != NULL; record = record->next) {
+		unused = 0;
+		if (__atomic_compare_exchange_n(&record->inUse, &unused, 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+
+	if (record == NULL) {
+		if (posix_memalign((void **) &record, sizeof(EpochRecord),
+					sizeof(EpochRecord)) != 0)
+			return NULL;
+		record->epoch = 0;
+		record->inUse = 1;
+		record->next = __atomic_load_n(&sEpochRecords, __ATOMIC_RELAXED);
+		while ( ! __atomic_compare_exchange_n(&sEpochRecords,
+					&record->next, record, 0,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+
+	record->depth = 0;
+	pthread_setspecific(sEpochKey, record);
+	tEpochRecord = record;
+	return record;
+}
+
+/**
+ * Announce that this thread is about to read shared memory without a
+ * lock.  The fence orders the announcement before any of the reads, so
+ * a writer scanning the records either sees us, or freed its memory
+ * before we could have found it.  Calls may nest.
+ */
+static EpochRecord *epochEnter(void)
+{
+	EpochRecord *record = threadEpochRecord();
+
+	if (record == NULL)
+		return NULL;
+
+	if (record->depth++ == 0) {
+		__atomic_store_n(&record->epoch,
+				__atomic_load_n(&sGlobalEpoch, __ATOMIC_SEQ_CST),
+				__ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+	return record;
+}
+
+static void epochExit(EpochRecord *record)
+{
+	if (record != NULL && --record->depth == 0)
+		__atomic_store_n(&record->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * The earliest epoch announced by any reader still inside a lookup,
+ * after moving the global epoch on so that new readers announce a
+ * later one.  Returns 0 if no reader is inside a lookup.
+ */
+static unsigned long oldestReaderEpoch(void)
+{
+	EpochRecord *record;
+	unsigned long oldest = 0, epoch;
+
+	__atomic_fetch_add(&sGlobalEpoch, 1, __ATOMIC_SEQ_CST);
+
+	for (record = __atomic_load_n(&sEpochRecords, __ATOMIC_ACQUIRE);
+			record != NULL; record = record->next) {
+		epoch = __atomic_load_n(&record->epoch, __ATOMIC_SEQ_CST);
+		if (epoch != 0 && (oldest == 0 || epoch < oldest))
+			oldest = epoch;
+	}
+	return oldest;
+}
+
+/**
+ * Free whatever retired memory no reader can still be looking at
+ */
+static void reclaimRetired(AssociativeArray *aarray)
+{
+	RetiredMemory **link, *node;
+	unsigned long oldest = oldestReaderEpoch();
+
+	link = &aarray->retired;
+	while ((node = *link) != NULL) {
+		if (oldest == 0 || node->epoch < oldest) {
+			*link = node->next;
+			(*node->release)(aarray, node->memory);
+			aaFree(aarray, node);
+			aarray->nRetired--;
+		} else {
+			link = &node->next;
+		}
+	}
+}
+
+/**
+ * The segment a key belongs to.  This does not depend on the table
+ * size, so a key stays in the same segment however the table changes.
+ */
+static int segmentForKey(AssociativeArray *aarray, AAKeyType key, size_t keylen)
+{
+	return (int) aarray->hashAlgorithmPrimary(key, keylen, aarray->nSegments);
+}
+
+
+/**
+ * Take a lock on the table, helping with any rebuild in progress while
+ * the lock is unavailable.  Once there is nothing left to help with we
+ * simply block, so a rebuild begun after that goes on without us.
+ */
+static void lockHelpingMigration(AssociativeArray *aarray, pthread_mutex_t *lock)
+{
+	while (pthread_mutex_trylock(lock) != 0) {
+		if ( ! aaHelpMigration(aarray)) {
+			pthread_mutex_lock(lock);
+			return;
+		}
+	}
+}
+
+
+/**
+ * Prepare a table to be shared between threads.  This must be called
+ * before the table is handed to any other thread.
+ *
+ *  @param  mode  AA_CONCURRENCY_SEQLOCK: inserts and deletes are
+ *				serialized by a writer lock, and aaLookup() takes
+ *				no lock, validating what it read against the
+ *				sequence counter of the key's segment instead.
+ *				AA_CONCURRENCY_STRIPED: every operation takes the
+ *				lock of the key's segment (its stripe), and writers
+ *				on different stripes claim entries and slots with
+ *				compare-and-swap; anything which moves the entries
+ *				takes every stripe
+ *  @param  nSegments  number of sequence counters or stripe locks,
+ *				or 0 for a default
+ *
+ * The probe costs reported by aaPrintSummary() are not locked, and are
+ * only approximate once several threads are at work.
+ *  @return      1 on success, or -1 if the mode cannot be used
+ */
+int aaSetConcurrency(AssociativeArray *aarray, int mode, int nSegments)
+{
+	int i;
+
+	if (aarray->concurrency != AA_CONCURRENCY_NONE) {
+		fprintf(stderr, "Concurrency mode has already been chosen\n");
+		return -1;
+	}
+
+	/** a mapped table never changes, so any number may read it already */
+	if (aaRefuseReadOnly(aarray))
+		return -1;
+
+	if (mode == AA_CONCURRENCY_NONE)
+		return 1;
+	if (aaRefuseRadix(aarray))
+		return -1;
+
+	if (mode != AA_CONCURRENCY_SEQLOCK && mode != AA_CONCURRENCY_STRIPED) {
+		fprintf(stderr, "Invalid concurrency mode %d\n", mode);
+		return -1;
+	}
+
+	/** lock-free readers could not keep up with lists of values moving */
+	if (mode == AA_CONCURRENCY_SEQLOCK && aarray->multimap) {
+		fprintf(stderr, "Multimap tables cannot be read without locks\n");
+		return -1;
+	}
+
+	/** lookups would hand out pointers into a table that may move */
+	if (aarray->valueSize != 0) {
+		fprintf(stderr, "Tables with inline values cannot be shared\n");
+		return -1;
+	}
+
+	if (nSegments < 1)
+		nSegments = DEFAULT_SEGMENTS;
+
+	if (mode == AA_CONCURRENCY_STRIPED) {
+		aarray->stripeLocks = (pthread_mutex_t *)
+				aaMalloc(aarray, nSegments * sizeof(pthread_mutex_t));
+		if (aarray->stripeLocks == NULL)
+			return -1;
+		for (i = 0; i < nSegments; i++)
+			pthread_mutex_init(&aarray->stripeLocks[i], NULL);
+	} else {
+		aarray->segmentSeq = (unsigned int *)
+				aaMalloc(aarray, nSegments * sizeof(unsigned int));
+		if (aarray->segmentSeq == NULL)
+			return -1;
+		memset(aarray->segmentSeq, 0, nSegments * sizeof(unsigned int));
+		pthread_mutex_init(&aarray->writerLock, NULL);
+	}
+
+	aarray->nSegments = nSegments;
+	aarray->concurrency = mode;
+	return 1;
+}
+
+/**
+ * Take whatever lock a writer needs before changing the given key,
+ * returning the segment to be passed to aaUnlockKey()
+ */
+int aaLockKey(AssociativeArray *aarray, AAKeyType key, size_t keylen)
+{
+	int segment;
+
+	if (aarray->concurrency == AA_CONCURRENCY_NONE)
+		return 0;
+
+	segment = segmentForKey(aarray, key, keylen);
+	if (aarray->concurrency == AA_CONCURRENCY_STRIPED) {
+		lockHelpingMigration(aarray, &aarray->stripeLocks[segment]);
+	} else {
+		lockHelpingMigration(aarray, &aarray->writerLock);
+		seqWriteBegin(&aarray->segmentSeq[segment]);
+	}
+	return segment;
+}
+
+void aaUnlockKey(AssociativeArray *aarray, int segment)
+{
+	if (aarray->concurrency == AA_CONCURRENCY_NONE)
+		return;
+
+	if (aarray->concurrency == AA_CONCURRENCY_STRIPED) {
+		pthread_mutex_unlock(&aarray->stripeLocks[segment]);
+	} else {
+		seqWriteEnd(&aarray->segmentSeq[segment]);
+		pthread_mutex_unlock(&aarray->writerLock);
+	}
+}
+
+/**
+ * Hold off all writers, for the walks over the whole table and for
+ * anything which moves the entries.  Stripes are always taken in the
+ * same order, so two threads doing this cannot deadlock.
+ */
+void aaLockTable(AssociativeArray *aarray)
+{
+	int i;
+
+	if (aarray->concurrency == AA_CONCURRENCY_STRIPED) {
+		for (i = 0; i < aarray->nSegments; i++)
+			lockHelpingMigration(aarray, &aarray->stripeLocks[i]);
+	} else if (aarray->concurrency == AA_CONCURRENCY_SEQLOCK) {
+		lockHelpingMigration(aarray, &aarray->writerLock);
+	}
+}
+
+void aaUnlockTable(AssociativeArray *aarray)
+{
+	int i;
+
+	if (aarray->concurrency == AA_CONCURRENCY_STRIPED) {
+		for (i = aarray->nSegments - 1; i >= 0; i--)
+			pthread_mutex_unlock(&aarray->stripeLocks[i]);
+	} else if (aarray->concurrency == AA_CONCURRENCY_SEQLOCK) {
+		pthread_mutex_unlock(&aarray->writerLock);
+	}
+}
+
+/**
+ * Bracket a change to the shape of the table -- the entries or index
+ * being replaced -- which every reader must notice, whatever its segment
+ */
+void aaStructureBegin(AssociativeArray *aarray)
+{
+	if (aarray->concurrency == AA_CONCURRENCY_SEQLOCK)
+		seqWriteBegin(&aarray->structureSeq);
+}
+
+void aaStructureEnd(AssociativeArray *aarray)
+{
+	if (aarray->concurrency == AA_CONCURRENCY_SEQLOCK)
+		seqWriteEnd(&aarray->structureSeq);
+}
+
+/**
+ * Free memory the table no longer refers to, unless a lock-free reader
+ * could still be using it, in which case it is stamped with the current
+ * epoch and freed by a later call, once the readers have moved on.
+ * Every reader of a striped table holds a lock, so nothing waits there.
+ *
+ * This is only called by a writer, with the writer lock held.
+ */
+static void retire(AssociativeArray *aarray, void *memory,
+		void (*release)(AssociativeArray *aarray, void *memory))
+{
+	RetiredMemory *node;
+
+	if (memory == NULL)
+		return;
+
+	if (aarray->concurrency != AA_CONCURRENCY_SEQLOCK) {
+		(*release)(aarray, memory);
+		return;
+	}
+
+	/** if we cannot keep track of it, leaking is the safe choice */
+	node = (RetiredMemory *) aaMalloc(aarray, sizeof(RetiredMemory));
+	if (node == NULL)
+		return;
+
+	/** the caller has already unlinked the memory, so stamp it after */
+	node->memory = memory;
+	node->release = release;
+	node->epoch = __atomic_load_n(&sGlobalEpoch, __ATOMIC_SEQ_CST);
+	node->next = aarray->retired;
+	aarray->retired = node;
+
+	if (++aarray->nRetired >= RECLAIM_THRESHOLD)
+		reclaimRetired(aarray);
+}
+
+/** free memory from aaMalloc(), such as the entries or a key */
+static void releaseMemory(AssociativeArray *aarray, void *memory)
+{
+	aaFree(aarray, memory);
+}
+
+/** retire memory from aaMalloc(), such as the entries or a key */
+void aaRetireMemory(AssociativeArray *aarray, void *memory)
+{
+	retire(aarray, memory, releaseMemory);
+}
+
+/** retire an index from aaAllocIndex() */
+void aaRetireIndex(AssociativeArray *aarray, void *index)
+{
+	retire(aarray, index, aaFreeIndex);
+}
+
+/**
+ * aaLookup() for AA_CONCURRENCY_SEQLOCK tables.
+ *
+ * The table header is copied while the structure counter is steady, so
+ * the probe sees one consistent set of arrays, and anything the writer
+ * replaces meanwhile has only been retired, not freed.  The result is
+ * only trusted if neither the key's segment nor the structure changed
+ * while we looked.  The epoch announced for the whole lookup keeps what
+ * was retired from being freed under us.  Probe costs are not tallied
+ * here, as a counter shared by every reader would stop lookups from
+ * scaling.
+ */
+void *aaSeqlockLookup(AssociativeArray *aarray, AAKeyType key, size_t keylen)
+{
+	AssociativeArray snapshot;
+	unsigned int segmentValue, structureValue;
+	EpochRecord *record;
+	KeyDataPair *pair;
+	void *value;
+	int segment;
+
+	segment = segmentForKey(aarray, key, keylen);
+
+	/** with no record we cannot be protected, so take the writer lock */
+	record = epochEnter();
+	if (record == NULL) {
+		pthread_mutex_lock(&aarray->writerLock);
+		pair = aaFindPair(aarray, key, keylen);
+		value = (pair == NULL || aaPairExpired(aarray, pair)) ? NULL : pair->value;
+		pthread_mutex_unlock(&aarray->writerLock);
+		return value;
+	}
+
+	for (;;) {
+		segmentValue = seqReadBegin(&aarray->segmentSeq[segment]);
+		structureValue = seqReadBegin(&aarray->structureSeq);
+		memcpy(&snapshot, aarray, sizeof(AssociativeArray));
+		if (seqReadRetry(&aarray->structureSeq, structureValue))
+			continue;
+
+		pair = aaFindPair(&snapshot, key, keylen);
+		value = (pair == NULL || aaPairExpired(&snapshot, pair)) ? NULL : pair->value;
+
+		if ( ! seqReadRetry(&aarray->segmentSeq[segment], segmentValue)
+				&& ! seqReadRetry(&aarray->structureSeq, structureValue))
+			break;
+	}
+
+	epochExit(record);
+	return value;
+}
+
+/**
+ * Release everything aaSetConcurrency() set up, along with any memory
+ * retired and not yet freed.  No other thread may be using the table.
+ */
+void aaFreeConcurrency(AssociativeArray *aarray)
+{
+	RetiredMemory *node, *next;
+	int i;
+
+	for (node = aarray->retired; node != NULL; node = next) {
+		next = node->next;
+		(*node->release)(aarray, node->memory);
+		aaFree(aarray, node);
+	}
+	aarray->retired = NULL;
+	aarray->nRetired = 0;
+
+	if (aarray->concurrency == AA_CONCURRENCY_STRIPED) {
+		for (i = 0; i < aarray->nSegments; i++)
+			pthread_mutex_destroy(&aarray->stripeLocks[i]);
+		aaFree(aarray, aarray->stripeLocks);
+	} else if (aarray->concurrency == AA_CONCURRENCY_SEQLOCK) {
+		pthread_mutex_destroy(&aarray->writerLock);
+		aaFree(aarray, aarray->segmentSeq);
+	}
+}
@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "hashtools.h"
+
+/**
+ * The cuckoo filter keeps a short fingerprint of each key in one of two
+ * buckets of CUCKOO_SLOTS fingerprints, the second bucket being found
+ * from the first and the fingerprint alone.  Unlike the Bloom filter's
+ * bits, a fingerprint can be taken out again, so aaDelete() keeps the
+ * filter exact (up to fingerprint collisions) however much the keys
+ * churn, and misses keep being pruned without waiting for a rebuild.
+ *
+ * A key going into two full buckets displaces fingerprints along a
+ * path to a free slot.  The path is found first, and then walked from
+ * its far end, each fingerprint being copied forward before it is
+ * overwritten, so that every fingerprint is always in the filter
+ * somewhere.  A reader could still look in the two buckets at just the
+ * wrong moments to miss one, so moving fingerprints bumps "moves" and
+ * readers retry, as for a seqlock.
+ *
+ * Should no path be found, the filter is marked overflowed and lets
+ * every key through until the table is next rebuilt.
+ */
+#define	CUCKOO_SLOTS		4
+#define	CUCKOO_MAX_PATH		500
+#define	CUCKOO_SEED			0x43756b6f6fULL
+
+/** each fingerprint takes a 16-bit slot, however few bits it uses */
+#define	CUCKOO_MIN_BITS		4
+#define	CUCKOO_MAX_BITS		16
+
+typedef struct CuckooFilter {
+	unsigned int moves;
+	int writing;
+	uint64_t nBuckets;
+	int fingerprintBits;
+	int overflowed;
+	unsigned int random;
+	uint16_t slots[];
+} CuckooFilter;
+
+/** one step of a displacement path: the slot, and what it held */
+typedef struct CuckooStep {
+	int bucket;
+	int slot;
+	uint16_t fingerprint;
+} CuckooStep;
+
+
+/** the next power of two at or above n */
+static uint64_t powerOfTwoAbove(uint64_t n)
+{
+	uint64_t power = 1;
+
+	while (power < n)
+		power <<= 1;
+	return power;
+}
+
+static uint16_t *cuckooBucket(CuckooFilter *filter, int bucket)
+{
+	return filter->slots + (size_t) bucket * CUCKOO_SLOTS;
+}
+
+/** a key's fingerprint, never 0 as that marks a free slot */
+static uint16_t cuckooFingerprint(CuckooFilter *filter, uint64_t hash)
+{
+	uint16_t fingerprint = (uint16_t) ((hash >> 32)
+			& ((1u << filter->fingerprintBits) - 1));
+
+	return (fingerprint == 0) ? 1 : fingerprint;
+}
+
+/** the other bucket a fingerprint may be in; applying it twice is a no-op */
+static int cuckooAltBucket(CuckooFilter *filter, int bucket, uint16_t fingerprint)
+{
+	return (int) ((bucket ^ aaMix64(fingerprint)) & (filter->nBuckets - 1));
+}
+
+static int cuckooFindSlot(CuckooFilter *filter, int bucket, uint16_t fingerprint)
+{
+	uint16_t *slots = cuckooBucket(filter, bucket);
+	int i;
+
+	for (i = 0; i < CUCKOO_SLOTS; i++) {
+		if (__atomic_load_n(&slots[i], __ATOMIC_RELAXED) == fingerprint)
+			return i;
+	}
+	return -1;
+}
+
+/** writers take turns; in all but striped tables they are already alone */
+static void cuckooLock(AssociativeArray *aarray, CuckooFilter *filter)
+{
+	if (aarray->concurrency != AA_CONCURRENCY_STRIPED)
+		return;
+	while (__atomic_exchange_n(&filter->writing, 1, __ATOMIC_ACQUIRE))
+		;
+}
+
+static void cuckooUnlock(AssociativeArray *aarray, CuckooFilter *filter)
+{
+	if (aarray->concurrency == AA_CONCURRENCY_STRIPED)
+		__atomic_store_n(&filter->writing, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Find a path from one of the key's buckets to a free slot, without
+ * changing anything.  No slot may appear twice, as then the path's
+ * record of what each slot holds would be wrong.
+ *
+ *  @return      the number of steps, the last of which names the free
+ *				 slot, or -1 if no path was found
+ */
+static int cuckooFindPath(CuckooFilter *filter, int bucket, uint16_t fingerprint,
+		CuckooStep *path)
+{
+	int length, slot, i;
+
+	for (length = 0; length < CUCKOO_MAX_PATH; length++) {
+		slot = cuckooFindSlot(filter, bucket, 0);
+		if (slot >= 0) {
+			path[length].bucket = bucket;
+			path[length].slot = slot;
+			path[length].fingerprint = 0;
+			return length + 1;
+		}
+
+		/** a cheap random choice of which fingerprint to move on */
+		filter->random = filter->random * 1103515245u + 12345u;
+		slot = (filter->random >> 16) % CUCKOO_SLOTS;
+		for (i = 0; i < length; i++) {
+			if (path[i].bucket == bucket && path[i].slot == slot)
+				return -1;
+		}
+
+		path[length].bucket = bucket;
+		path[length].slot = slot;
+		path[length].fingerprint = cuckooBucket(filter, bucket)[slot];
+		fingerprint = path[length].fingerprint;
+		bucket = cuckooAltBucket(filter, bucket, fingerprint);
+	}
+	return -1;
+}
+
+/** add a fingerprint, with the filter's writer lock held */
+static int cuckooAddFingerprint(CuckooFilter *filter, int bucket, uint16_t fingerprint)
+{
+	CuckooStep path[CUCKOO_MAX_PATH];
+	int attempt, length, i, slot;
+
+	slot = cuckooFindSlot(filter, bucket, 0);
+	if (slot < 0) {
+		bucket = cuckooAltBucket(filter, bucket, fingerprint);
+		slot = cuckooFindSlot(filter, bucket, 0);
+	}
+	if (slot >= 0) {
+		__atomic_store_n(&cuckooBucket(filter, bucket)[slot], fingerprint,
+				__ATOMIC_RELEASE);
+		return 1;
+	}
+
+	for (attempt = 0; attempt < 4; attempt++) {
+		length = cuckooFindPath(filter, bucket, fingerprint, path);
+		if (length < 0)
+			continue;
+
+		/** walk back from the free slot, copying before overwriting */
+		__atomic_fetch_add(&filter->moves, 1, __ATOMIC_SEQ_CST);
+		for (i = length - 1; i > 0; i--) {
+			__atomic_store_n(&cuckooBucket(filter, path[i].bucket)[path[i].slot],
+					path[i - 1].fingerprint, __ATOMIC_RELEASE);
+		}
+		__atomic_store_n(&cuckooBucket(filter, path[0].bucket)[path[0].slot],
+				fingerprint, __ATOMIC_RELEASE);
+		__atomic_fetch_add(&filter->moves, 1, __ATOMIC_SEQ_CST);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Add a key to the filter, if the table has one.  Called by aaInsert()
+ * once the key's entry is in place.
+ */
+void aaCuckooAdd(AssociativeArray *aarray, AAKeyType key, size_t keylen)
+{
+	CuckooFilter *filter = aarray->cuckoo;
+	uint64_t hash;
+
+	if (filter == NULL || filter->overflowed)
+		return;
+
+	hash = aaKeyHash64(key, keylen, CUCKOO_SEED);
+	cuckooLock(aarray, filter);
+	if ( ! cuckooAddFingerprint(filter,
+				(int) (hash & (filter->nBuckets - 1)),
+				cuckooFingerprint(filter, hash)))
+		__atomic_store_n(&filter->overflowed, 1, __ATOMIC_RELAXED);
+	cuckooUnlock(aarray, filter);
+}
+
+/**
+ * Take a deleted key out of the filter.  Another key sharing both its
+ * buckets and its fingerprint has a copy of its own, so taking out
+ * either copy leaves the other key still found.
+ */
+void aaCuckooRemove(AssociativeArray *aarray, AAKeyType key, size_t keylen)
+{
+	CuckooFilter *filter = aarray->cuckoo;
+	uint64_t hash;
+	uint16_t fingerprint;
+	int bucket, slot;
+
+	if (filter == NULL || filter->overflowed)
+		return;
+
+	hash = aaKeyHash64(key, keylen, CUCKOO_SEED);
+	fingerprint = cuckooFingerprint(filter, hash);
+	bucket = (int) (hash & (filter->nBuckets - 1));
+
+	cuckooLock(aarray, filter);
+	slot = cuckooFindSlot(filter, bucket, fingerprint);
+	if (slot < 0) {
+		bucket = cuckooAltBucket(filter, bucket, fingerprint);
+		slot = cuckooFindSlot(filter, bucket, fingerprint);
+	}
+	if (slot >= 0)
+		__atomic_store_n(&cuckooBucket(filter, bucket)[slot], 0, __ATOMIC_RELEASE);
+	cuckooUnlock(aarray, filter);
+}
+
+/**
+ * Ask the filter whether the key may be in the table
+ *
+ *  @return      0 if the key is certainly not in the table, else 1
+ *				 (including when the table has no usable filter)
+ */
+int aaCuckooMayContain(const AssociativeArray *aarray, AAKeyType key, size_t keylen)
+{
+	CuckooFilter *filter = aarray->cuckoo;
+	unsigned int moves;
+	uint64_t hash;
+	uint16_t fingerprint;
+	int bucket, found;
+
+	if (filter == NULL || __atomic_load_n(&filter->overflowed, __ATOMIC_RELAXED))
+		return 1;
+
+	hash = aaKeyHash64(key, keylen, CUCKOO_SEED);
+	fingerprint = cuckooFingerprint(filter, hash);
+	bucket = (int) (hash & (filter->nBuckets - 1));
+
+	do {
+		while ((moves = __atomic_load_n(&filter->moves, __ATOMIC_ACQUIRE)) & 1)
+			;
+		found = cuckooFindSlot(filter, bucket, fingerprint) >= 0
+				|| cuckooFindSlot(filter,
+						cuckooAltBucket(filter, bucket, fingerprint),
+						fingerprint) >= 0;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ( ! found && __atomic_load_n(&filter->moves, __ATOMIC_RELAXED) != moves);
+
+	return found;
+}
+
+/**
+ * Make a new filter for a table, sized for its slots and holding the
+ * keys of its live entries, as aaBloomBuild() does for the Bloom filter
+ *
+ *  @return      1 on success, or -1 if there was no memory for it, in
+ *				 which case the header keeps the filter it had
+ */
+int aaCuckooBuild(AssociativeArray *aarray)
+{
+	CuckooFilter *filter;
+	uint64_t hash, nBuckets;
+	int i;
+
+	if (aarray->cuckooBits <= 0) {
+		aarray->cuckoo = NULL;
+		return 1;
+	}
+
+	/** room for every slot's key, with the buckets at most 95% full */
+	nBuckets = powerOfTwoAbove(((uint64_t) aarray->size * 100 / 95) / CUCKOO_SLOTS + 1);
+	filter = (CuckooFilter *) aaAllocIndex(aarray, sizeof(CuckooFilter)
+			+ (size_t) nBuckets * CUCKOO_SLOTS * sizeof(uint16_t));
+	if (filter == NULL)
+		return -1;
+
+	filter->nBuckets = nBuckets;
+	filter->fingerprintBits = aarray->cuckooBits;
+	filter->random = 1;
+
+	for (i = 0; i < aarray->nUsed && ! filter->overflowed; i++) {
+		KeyDataPair *pair = aaEntry(aarray, i);
+
+		if (pair->validity != HASH_USED)
+			continue;
+		hash = aaKeyHash64(pair->key, pair->keylen, CUCKOO_SEED);
+		if ( ! cuckooAddFingerprint(filter,
+					(int) (hash & (filter->nBuckets - 1)),
+					cuckooFingerprint(filter, hash)))
+			filter->overflowed = 1;
+	}
+
+	aarray->cuckoo = filter;
+	return 1;
+}
+
+/**
+ * Put a cuckoo filter in front of the table: like aaSetBloomFilter(),
+ * but keys are taken out of the filter as they are deleted, so it stays
+ * useful on a table whose keys come and go.  Each key's fingerprint
+ * has fingerprintBits bits (4 to 16); about 2 * 4 / 2^bits of misses
+ * get past it.  A fingerprintBits of 0 removes the filter.
+ *
+ *  @return      1 on success, or -1 if there was no memory for it
+ */
+int aaSetCuckooFilter(AssociativeArray *aarray, int fingerprintBits)
+{
+	AssociativeArray built;
+	CuckooFilter *oldFilter;
+	int result;
+
+	if (aaRefuseReadOnly(aarray) || aaRefuseRadix(aarray))
+		return -1;
+
+	if (fingerprintBits > 0 && fingerprintBits < CUCKOO_MIN_BITS)
+		fingerprintBits = CUCKOO_MIN_BITS;
+	if (fingerprintBits > CUCKOO_MAX_BITS)
+		fingerprintBits = CUCKOO_MAX_BITS;
+
+	aaLockTable(aarray);
+	built = *aarray;
+	built.cuckooBits = (fingerprintBits < 0) ? 0 : fingerprintBits;
+	result = aaCuckooBuild(&built);
+
+	if (result > 0) {
+		oldFilter = aarray->cuckoo;
+		aaStructureBegin(aarray);
+		aarray->cuckoo = built.cuckoo;
+		aarray->cuckooBits = built.cuckooBits;
+		aaStructureEnd(aarray);
+
+		/** lock-free readers may still be checking the old one */
+		aaRetireIndex(aarray, oldFilter);
+	}
+	aaUnlockTable(aarray);
+
+	return result;
+}
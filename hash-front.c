@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "hashtools.h"
+
+/**
+ * The front cache is a small direct-mapped array, looked at before the
+ * table proper, remembering where the keys lately found were.  Each
+ * slot is one 64-bit word holding the dense offset of an entry, the
+ * generation it was found in, and a tag of the key's hash.  A hit reads
+ * the one slot and the one entry it names, so a hot key is found
+ * without its primary hash, without the index, and without probing.
+ *
+ * A slot is only ever a hint: the entry it names is checked to be in
+ * use and to hold the key before it is believed.  Entries never move
+ * within a generation, so a slot of the present generation names an
+ * entry that was filled in; a rebuild moves them, and so empties every
+ * slot, while a lookup from a stale copy of the header just fails to
+ * match.  Deleting a key empties its slot, and since an insert always
+ * appends a new entry, no slot ever names one that an insert changed.
+ *
+ * Lookups fill the slots as they find keys, storing only when the slot
+ * holds something else, so that hits on a shared table stay reads.
+ *
+ * The default of FRONT_DEFAULT_SLOTS takes 8 KB, to stay in the L1
+ * cache; FRONT_MAX_SLOTS (512 KB) is about as much as the L2 will keep.
+ */
+#define	FRONT_DEFAULT_SLOTS	1024
+#define	FRONT_MAX_SLOTS		65536
+#define	FRONT_SEED			0x46726f6e74ULL
+
+#define	FRONT_OFFSET_MASK	0xffffffffULL
+#define	FRONT_GENERATION(word)	(((word) >> 32) & 0xff)
+#define	FRONT_TAG(word)		((word) >> 40)
+
+typedef struct FrontCache {
+	uint64_t mask;
+	uint64_t slots[];
+} FrontCache;
+
+
+/** the word naming the entry at offset, for a key of the given hash */
+static uint64_t frontWord(const AssociativeArray *aarray, uint64_t hash, int offset)
+{
+	return ((hash >> 40) << 40)
+			| ((uint64_t) (aarray->generation & 0xff) << 32)
+			| (uint64_t) (offset + 1);
+}
+
+/** the offset of a pair among the dense entries */
+static int frontOffset(const AssociativeArray *aarray, const KeyDataPair *pair)
+{
+	return (int) (((const char *) pair - (const char *) aarray->table)
+			/ aarray->entrySize);
+}
+
+/**
+ * Look for the key in the front cache.  The key's hash is handed back
+ * through hash either way, for aaFrontRemember() to use on a miss.
+ *
+ *  @return      the pair holding the key, or NULL if the cache does not
+ *				 know where it is
+ */
+KeyDataPair *aaFrontFind(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+		uint64_t *hash)
+{
+	FrontCache *front = aarray->front;
+	KeyDataPair *pair;
+	uint64_t word;
+	int offset;
+
+	*hash = aaKeyHash64(key, keylen, FRONT_SEED);
+	word = __atomic_load_n(&front->slots[*hash & front->mask], __ATOMIC_RELAXED);
+
+	if (word == 0 || FRONT_TAG(word) != (*hash >> 40)
+			|| FRONT_GENERATION(word) != (uint64_t) (aarray->generation & 0xff))
+		return NULL;
+
+	offset = (int) (word & FRONT_OFFSET_MASK) - 1;
+	if (offset >= __atomic_load_n(&aarray->nUsed, __ATOMIC_RELAXED))
+		return NULL;
+
+	pair = aaEntry(aarray, offset);
+	if (__atomic_load_n(&pair->validity, __ATOMIC_ACQUIRE) != HASH_USED
+			|| ! doKeysMatch(pair->key, pair->keylen, key, keylen))
+		return NULL;
+
+	aarray->searchCost++;
+	return pair;
+}
+
+/**
+ * Remember where a lookup found a key, given its hash from aaFrontFind()
+ */
+void aaFrontRemember(AssociativeArray *aarray, uint64_t hash, KeyDataPair *pair)
+{
+	FrontCache *front = aarray->front;
+	uint64_t word = frontWord(aarray, hash, frontOffset(aarray, pair));
+	uint64_t *slot = &front->slots[hash & front->mask];
+
+	if (__atomic_load_n(slot, __ATOMIC_RELAXED) != word)
+		__atomic_store_n(slot, word, __ATOMIC_RELAXED);
+}
+
+/**
+ * Empty the slot naming a pair about to be deleted, if one does
+ */
+void aaFrontForget(AssociativeArray *aarray, KeyDataPair *pair)
+{
+	FrontCache *front = aarray->front;
+	uint64_t hash, word;
+
+	if (front == NULL)
+		return;
+
+	hash = aaKeyHash64(pair->key, pair->keylen, FRONT_SEED);
+	word = frontWord(aarray, hash, frontOffset(aarray, pair));
+	__atomic_compare_exchange_n(&front->slots[hash & front->mask], &word, 0,
+			0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/**
+ * Empty every slot, as the entries they name are about to move; called
+ * by a rebuild, with the table locked
+ */
+void aaFrontClear(AssociativeArray *aarray)
+{
+	FrontCache *front = aarray->front;
+	uint64_t i;
+
+	if (front == NULL)
+		return;
+
+	for (i = 0; i <= front->mask; i++)
+		__atomic_store_n(&front->slots[i], 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Put a front cache of nSlots slots (rounded up to a power of two, at
+ * most FRONT_MAX_SLOTS) ahead of the table, so that the keys looked up
+ * most often are found without probing.  It pays on skewed lookups,
+ * where a few keys take most of them; on uniform ones it mostly misses,
+ * costing a hash and a load.  An nSlots below 0 gives the default size,
+ * while 0 removes the cache.
+ *
+ *  @return      1 on success, or -1 if there was no memory for it
+ */
+int aaSetFrontCache(AssociativeArray *aarray, int nSlots)
+{
+	FrontCache *front = NULL, *oldFront;
+	uint64_t size = 1;
+
+	if (aaRefuseReadOnly(aarray) || aaRefuseRadix(aarray))
+		return -1;
+
+	if (nSlots < 0)
+		nSlots = FRONT_DEFAULT_SLOTS;
+	if (nSlots > FRONT_MAX_SLOTS)
+		nSlots = FRONT_MAX_SLOTS;
+
+	if (nSlots > 0) {
+		while (size < (uint64_t) nSlots)
+			size <<= 1;
+		front = (FrontCache *) aaAllocIndex(aarray, sizeof(FrontCache)
+				+ size * sizeof(uint64_t));
+		if (front == NULL)
+			return -1;
+		front->mask = size - 1;
+	}
+
+	aaLockTable(aarray);
+	oldFront = aarray->front;
+	aaStructureBegin(aarray);
+	aarray->front = front;
+	aaStructureEnd(aarray);
+
+	/** lock-free readers may still be looking in the old one */
+	aaRetireIndex(aarray, oldFront);
+	aaUnlockTable(aarray);
+
+	return 1;
+}
@@ -15,6 +15,17 @@ doKeysMatch(AAKeyType key1, size_t key1len, AAKeyType key2, size_t key2len)
 	return memcmp(key1, key2, key1len) == 0;
 }
 
+/** order two keys bytewise, a key coming before any longer one it begins */
+int
+aaCompareKeys(AAKeyType key1, size_t key1len, AAKeyType key2, size_t key2len)
+{
+	int order = memcmp(key1, key2, (key1len < key2len) ? key1len : key2len);
+
+	if (order != 0)
+		return order;
+	return (key1len > key2len) - (key1len < key2len);
+}
+
 /* provide the hex representation of a value */
 static char toHex(int val)
 {
@@ -119,6 +130,71 @@ HashIndex hashByWeightSum(AAKeyType key, size_t keyLength, HashIndex size)
 }
 
 
+/** the finishing step of SplitMix64, to spread every bit of x */
+uint64_t aaMix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/**
+ * A 64 bit hash of the key, for the structures which need more than a
+ * slot number out of it (Bloom filters, perfect hashes).  Unlike the
+ * strategies above every bit depends on every byte, and different
+ * seeds give unrelated hashes.
+ */
+uint64_t aaKeyHash64(AAKeyType key, size_t keyLength, uint64_t seed)
+{
+    uint64_t hash = 14695981039346656037ULL ^ seed;
+
+    // FNV-1a over the bytes, then mixed so the high bits are as good
+    for (size_t i = 0; i < keyLength; i++) {
+        hash ^= key[i];
+        hash *= 1099511628211ULL;
+    }
+    return aaMix64(hash);
+}
+
+
+/**
+ * The slot visited on a given attempt of a probe sequence that starts
+ * at index, in a table of the given size.  Attempt 0 is index itself.
+ * These are shared by the probing strategies below and by the
+ * lock-free table, which has no AssociativeArray to probe.
+ */
+HashIndex linearProbeStep(HashIndex index, int attempt, HashIndex size)
+{
+    return (index + (HashIndex) attempt) % size;
+}
+
+HashIndex quadraticProbeStep(HashIndex index, int attempt, HashIndex size)
+{
+    return (index + (HashIndex) attempt * (HashIndex) attempt) % size;
+}
+
+
+/**
+ * Does a probe stop at this slot?  It does at an empty slot or at the
+ * key being looked for.  A deleted slot may still lie in the path of
+ * keys inserted after it, so only an insertion, which may reuse it,
+ * stops there; a search carries on past it.
+ */
+static int probeEndsAt(AssociativeArray *aarray, AAKeyType key, size_t keyLength,
+        HashIndex slot, int stopOnInvalid)
+{
+    int validity = aaSlotValidity(aarray, slot);
+
+    if (validity == HASH_USED) {
+        return doKeysMatch(aaSlotPair(aarray, slot)->key, aaSlotPair(aarray, slot)->keylen, key, keyLength);
+    }
+    return validity == HASH_EMPTY || stopOnInvalid;
+}
+
+
 /**
  * Locate an empty position in the given array, starting the
  * search at the indicated index, and restricting the search
@@ -130,8 +206,8 @@ HashIndex hashByWeightSum(AAKeyType key, size_t keyLength, HashIndex size)
  *				KeyDataPair marked invalid end our search?
  *				This is true if we are looking for a location
  *				to insert new data
- *  @return index of location where search stopped, or -1 if
- *				search failed
+ *  @return index of location where search stopped, or index
+ *				itself if the search came back round to it
  *
  *  @see    HashProbe
  */
@@ -140,26 +216,21 @@ HashIndex linearProbe(AssociativeArray *aarray, AAKeyType key, size_t keyLength,
     int probeCost = 0;
 
     while (probeCost < aarray->size) {
-        currentIndex = (currentIndex + 1) % aarray->size;
         probeCost++;
+        currentIndex = linearProbeStep(index, probeCost, aarray->size);
 
-        if (aarray->table[currentIndex].validity != HASH_USED || doKeysMatch(key, keyLength, aarray->table[currentIndex].key, aarray->table[currentIndex].keylen)) {
+        if (probeEndsAt(aarray, key, keyLength, currentIndex, stopOnInvalid)) {
             // If the slot is empty or has a matching key, return the index
-            if (aarray->table[currentIndex].validity != HASH_USED) {
+            if (aaSlotValidity(aarray, currentIndex) != HASH_USED) {
                 // Increment the insert cost if an empty slot is found
                 aarray->insertCost++;
             }
             return currentIndex;
         }
-
-        if (stopOnInvalid && aarray->table[currentIndex].validity == HASH_DELETED) {
-            // Stop probing if we encounter a deleted slot.
-            return -1;
-        }
     }
 
-    // If we reach here, the table is full, and we couldn't find a matching key.
-    return -1;
+    // If we reach here, we have come back round to where we began
+    return index;
 }
 
 
@@ -175,18 +246,18 @@ HashIndex linearProbe(AssociativeArray *aarray, AAKeyType key, size_t keyLength,
  *				KeyDataPair marked invalid end our search?
  *				This is true if we are looking for a location
  *				to insert new data
- *  @return index of location where search stopped, or -1 if
- *				search failed
+ *  @return index of location where search stopped, or index
+ *				itself if the search came back round to it
  *
  *  @see    HashProbe
  */
 HashIndex quadraticProbe(AssociativeArray *table, AAKeyType key, size_t keyLength, int index, int stopOnInvalid, int *cost) {
 
-    for (int attempt = 1; /*no value needed here as stopOnInavlid is used later*/; attempt++) {
+    for (int attempt = 1; attempt < table->size; attempt++) {
         // Calculate the quadratic probing index
-        HashIndex newIndex = (index + attempt * attempt) % table->size;
+        HashIndex newIndex = quadraticProbeStep(index, attempt, table->size);
 
-        if (table->table[newIndex].validity != HASH_USED || doKeysMatch(table->table[newIndex].key, table->table[newIndex].keylen, key, keyLength)) {
+        if (probeEndsAt(table, key, keyLength, newIndex, stopOnInvalid)) {
             // If the slot is empty or has a matching key, return the index
             if (cost != NULL) {
                 // Increment the cost counter if cost pointer is provided
@@ -196,12 +267,11 @@ HashIndex quadraticProbe(AssociativeArray *table, AAKeyType key, size_t keyLengt
         }
 
         table->insertCost++;
-
-        if (stopOnInvalid && table->table[newIndex].validity == HASH_DELETED) {
-            // If we encounter a deleted slot and 'stopOnInvalid' is enabled, stop probing
-            return -1;
-        }
     }
+
+    // The squares reach only half of the slots, so give up after as
+    // many attempts as there are slots, as though back where we began
+    return index;
 }
 
 
@@ -218,8 +288,8 @@ HashIndex quadraticProbe(AssociativeArray *table, AAKeyType key, size_t keyLengt
  *				KeyDataPair marked invalid end our search?
  *				This is true if we are looking for a location
  *				to insert new data
- *  @return index of location where search stopped, or -1 if
- *				search failed
+ *  @return index of location where search stopped, or index
+ *				itself if the search came back round to it
  *
  *  @see    HashProbe
  */
@@ -227,24 +297,23 @@ HashIndex doubleHashProbe(AssociativeArray *aarray, AAKeyType key, size_t keyLen
     // Calculate the step size using the secondary hash function
     HashIndex stepSize = aarray->hashAlgorithmSecondary(key, keyLength, aarray->size);
 
-    for (int attempt = 0; ; attempt++) {
+    for (int attempt = 0; attempt < aarray->size; attempt++) {
         // Calculate the next index based on the current index and step size
         HashIndex newIndex = (index + attempt * stepSize) % aarray->size;
 
-        if (aarray->table[newIndex].validity != HASH_USED || doKeysMatch(aarray->table[newIndex].key, aarray->table[newIndex].keylen, key, keyLength)) {
+        if (probeEndsAt(aarray, key, keyLength, newIndex, stopOnInvalid)) {
             // If the slot is empty or has a matching key, return the index
-            if (aarray->table[newIndex].validity != HASH_USED) {
+            if (aaSlotValidity(aarray, newIndex) != HASH_USED) {
                 // Increment the insert cost if an empty slot is found
                 aarray->insertCost++;
             }
             return newIndex;
         }
         aarray -> insertCost++;
-        if (stopOnInvalid && aarray->table[newIndex].validity == HASH_DELETED) {
-            // If we encounter a deleted slot and 'stopOnInvalid' is enabled, stop probing
-            return -1;
-        }
     }
+
+    // If we reach here, we have come back round to where we began
+    return index;
 }
 
 
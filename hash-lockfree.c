@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "hashtools.h"
+
+/**
+ * One slot of the lock-free table.  The key word is written once, by the
+ * compare-and-swap that claims the slot, and never changes after that;
+ * all later changes (insert, delete, re-insert) are made to the value.
+ */
+typedef struct AALockFreeSlot {
+	long key;
+	void *value;
+} AALockFreeSlot;
+
+struct AALockFreeIntTable {
+	HashIndex size;
+	HashProbeStep probeStep;
+	char *probeName;
+	AALockFreeSlot *slots;
+};
+
+/** the value of a slot whose key has been deleted */
+static char sTombstone;
+#define	LOCKFREE_TOMBSTONE	((void *) &sTombstone)
+
+
+/**
+ * Spread the bits of an integer key over the whole word before taking
+ * it modulo the table size.  The string hashes in hash-functions.c
+ * add up the bytes of the key, which would send every int to one of a
+ * few hundred slots.
+ */
+static HashIndex hashIntKey(long key, HashIndex size)
+{
+	uint64_t x = (uint64_t) key;
+
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return (HashIndex) (x % size);
+}
+
+static HashProbeStep lookupNamedProbeStep(const char *name)
+{
+	if (strncmp(name, "lin", 3) == 0) {
+		return linearProbeStep;
+	} else if (strncmp(name, "qua", 3) == 0) {
+		return quadraticProbeStep;
+	}
+
+	fprintf(stderr, "Invalid hash probe strategy '%s' - using 'linear'\n", name);
+	return linearProbeStep;
+}
+
+/**
+ * Create a lock-free table of long keys.  Any number of threads may
+ * insert, delete and look up at once without taking a lock: inserts
+ * claim a slot with a compare-and-swap on its key, deletes replace the
+ * value with a tombstone, and lookups never write at all, finishing in
+ * at most size probes.
+ *
+ * The table does not grow, and a slot once claimed by a key stays with
+ * that key (deleting and re-inserting it reuses the slot), so size
+ * should allow for every distinct key the table will ever see.  Only
+ * the "linear" and "quadratic" probe sequences are offered; a
+ * quadratic table should be kept under half full.
+ *
+ *  @param  size  the number of slots (rounded up to a prime)
+ *  @param  probingStrategy  "linear" or "quadratic"
+ *  @return      the new table, or NULL if it cannot be created
+ */
+AALockFreeIntTable *
+aaCreateLockFreeIntTable(size_t size, char *probingStrategy)
+{
+	AALockFreeIntTable *table;
+	HashIndex i;
+	int primeSize;
+
+	primeSize = (size > INT_MAX) ? -1 : getLargerPrime((int) size);
+	if (primeSize < 1) {
+		fprintf(stderr, "Cannot create table of size %ld\n", size);
+		return NULL;
+	}
+
+	table = (AALockFreeIntTable *) malloc(sizeof(AALockFreeIntTable));
+	if (table == NULL)
+		return NULL;
+
+	table->size = primeSize;
+	table->probeStep = lookupNamedProbeStep(probingStrategy);
+	table->probeName = strdup(probingStrategy);
+
+	/** keep slots from straddling cache lines */
+	if (posix_memalign((void **) &table->slots, 64,
+				table->size * sizeof(AALockFreeSlot)) != 0) {
+		free(table->probeName);
+		free(table);
+		return NULL;
+	}
+	for (i = 0; i < table->size; i++) {
+		table->slots[i].key = AA_LOCKFREE_EMPTY_KEY;
+		table->slots[i].value = NULL;
+	}
+
+	return table;
+}
+
+/**
+ * Free the table.  No other thread may be using it.
+ */
+void aaDeleteLockFreeIntTable(AALockFreeIntTable *table)
+{
+	free(table->slots);
+	free(table->probeName);
+	free(table);
+}
+
+/**
+ * Add a key and its (non-NULL) value.
+ *
+ *  @return      the slot holding the key, or -1 if the key is already
+ *				 present, is AA_LOCKFREE_EMPTY_KEY, or no slot is left
+ */
+int aaLockFreeInsert(AALockFreeIntTable *table, long key, void *value)
+{
+	HashIndex start, slot;
+	long found;
+	void *current;
+	int attempt;
+
+	if (key == AA_LOCKFREE_EMPTY_KEY || value == NULL)
+		return -1;
+
+	start = hashIntKey(key, table->size);
+	for (attempt = 0; attempt < table->size; attempt++) {
+		slot = table->probeStep(start, attempt, table->size);
+
+		found = __atomic_load_n(&table->slots[slot].key, __ATOMIC_ACQUIRE);
+		if (found == AA_LOCKFREE_EMPTY_KEY) {
+			/** on failure, found is updated to the key that beat us */
+			if (__atomic_compare_exchange_n(&table->slots[slot].key,
+					&found, key, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				found = key;
+		}
+		if (found != key)
+			continue;
+
+		/**
+		 * the slot belongs to this key; the value is NULL until its
+		 * first insert publishes, or a tombstone after a delete
+		 */
+		current = __atomic_load_n(&table->slots[slot].value, __ATOMIC_ACQUIRE);
+		do {
+			if (current != NULL && current != LOCKFREE_TOMBSTONE)
+				return -1;
+		} while ( ! __atomic_compare_exchange_n(&table->slots[slot].value,
+					&current, value, 0,
+					__ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+		return (int) slot;
+	}
+
+	return -1;
+}
+
+/**
+ * Find the slot claimed by key, or return -1.  Wait-free: at most size
+ * slots are examined, whatever other threads are doing.
+ */
+static long findSlot(AALockFreeIntTable *table, long key)
+{
+	HashIndex start, slot;
+	long found;
+	int attempt;
+
+	start = hashIntKey(key, table->size);
+	for (attempt = 0; attempt < table->size; attempt++) {
+		slot = table->probeStep(start, attempt, table->size);
+
+		found = __atomic_load_n(&table->slots[slot].key, __ATOMIC_ACQUIRE);
+		if (found == key)
+			return (long) slot;
+
+		/** keys are never removed, so an empty slot ends the chain */
+		if (found == AA_LOCKFREE_EMPTY_KEY)
+			return -1;
+	}
+
+	return -1;
+}
+
+/**
+ * Return the value stored with key, or NULL if it is not present.
+ */
+void *aaLockFreeLookup(AALockFreeIntTable *table, long key)
+{
+	void *value;
+	long slot;
+
+	if (key == AA_LOCKFREE_EMPTY_KEY)
+		return NULL;
+
+	slot = findSlot(table, key);
+	if (slot < 0)
+		return NULL;
+
+	value = __atomic_load_n(&table->slots[slot].value, __ATOMIC_ACQUIRE);
+	return (value == LOCKFREE_TOMBSTONE) ? NULL : value;
+}
+
+/**
+ * Remove key, returning the value it had, or NULL if it was not present.
+ * Of several threads deleting the same key, exactly one gets the value.
+ */
+void *aaLockFreeDelete(AALockFreeIntTable *table, long key)
+{
+	void *current;
+	long slot;
+
+	if (key == AA_LOCKFREE_EMPTY_KEY)
+		return NULL;
+
+	slot = findSlot(table, key);
+	if (slot < 0)
+		return NULL;
+
+	current = __atomic_load_n(&table->slots[slot].value, __ATOMIC_ACQUIRE);
+	do {
+		if (current == NULL || current == LOCKFREE_TOMBSTONE)
+			return NULL;
+	} while ( ! __atomic_compare_exchange_n(&table->slots[slot].value,
+				&current, LOCKFREE_TOMBSTONE, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	return current;
+}
@@ -0,0 +1,460 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "hashtools.h"
+
+/**
+ * A log file starts with a LogHeader, and then holds one LogRecord for
+ * each change made to the table, each followed by the key and then the
+ * value.  An insert of an entry with a time to live is a LOG_INSERT_TTL
+ * record, with its deadline (see aaDeadlineToFile()) between the record
+ * and the key.  Records are only ever appended, so a crash can at worst leave
+ * the last of them cut short; that record is dropped when the log is
+ * next opened.  As with snapshots, the byte order and word size are
+ * those of the machine that wrote the file.
+ */
+#define	LOG_MAGIC		"AALOG001"
+
+#define	LOG_INSERT		1
+#define	LOG_DELETE		2
+#define	LOG_INSERT_TTL	3
+
+/** stdio buffer collecting records between flushes */
+#define	LOG_BUFFER		(1 << 16)
+
+/** length recorded for a NULL value pointer */
+#define	LOG_NULL_VALUE	UINT64_MAX
+
+typedef struct LogHeader {
+	char magic[8];
+	uint64_t valueSize;
+} LogHeader;
+
+typedef struct LogRecord {
+	uint32_t op;
+	uint32_t keylen;
+	uint64_t valuelen;
+	uint32_t checksum;
+	uint32_t unused;
+} LogRecord;
+
+/** the log attached to a table by aaOpenLog() */
+typedef struct AALog {
+	FILE *fp;
+	int fd;
+	char *path;
+	pthread_mutex_t lock;
+	int groupSize;
+	int nPending;
+	int failed;
+} AALog;
+
+
+/** FNV-1a, over the bytes of a record and then its key and value */
+static uint32_t checksum(uint32_t hash, const void *data, size_t length)
+{
+	const unsigned char *bytes = (const unsigned char *) data;
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static uint32_t recordChecksum(LogRecord *record, uint64_t deadline,
+		const void *key, const void *value)
+{
+	uint32_t hash = 2166136261u;
+
+	hash = checksum(hash, &record->op, sizeof(record->op));
+	hash = checksum(hash, &record->keylen, sizeof(record->keylen));
+	hash = checksum(hash, &record->valuelen, sizeof(record->valuelen));
+	if (record->op == LOG_INSERT_TTL)
+		hash = checksum(hash, &deadline, sizeof(deadline));
+	hash = checksum(hash, key, record->keylen);
+	if (record->valuelen != LOG_NULL_VALUE)
+		hash = checksum(hash, value, record->valuelen);
+	return hash;
+}
+
+/** the bytes logged for a value: inline bytes, or a string's characters */
+static uint64_t loggedValueLength(AssociativeArray *aarray, void *value)
+{
+	if (aarray->valueSize != 0)
+		return aarray->valueSize;
+	if (value == NULL)
+		return LOG_NULL_VALUE;
+	return strlen((char *) value) + 1;
+}
+
+/** push everything written so far to the kernel, and on to the disk */
+static int syncLog(AALog *log)
+{
+	if (fflush(log->fp) != 0 || fdatasync(log->fd) != 0)
+		return -1;
+	return 1;
+}
+
+/** say once that the log can no longer be trusted */
+static void logFailed(AALog *log)
+{
+	if ( ! log->failed)
+		fprintf(stderr, "Failed writing log '%s' : %s\n",
+				log->path, strerror(errno));
+	log->failed = 1;
+}
+
+
+/**
+ * Read one record, with its key and value, into buffers that are grown
+ * as needed.
+ *
+ *  @return      1 for a whole record, or 0 at the end of the log or at
+ *				 a record cut short or damaged by a crash
+ */
+static int readRecord(FILE *fp, LogRecord *record, uint64_t *deadline,
+		char **buffer, size_t *bufferSize)
+{
+	size_t need;
+	char *grown;
+
+	if (fread(record, sizeof(LogRecord), 1, fp) != 1)
+		return 0;
+	if (record->op != LOG_INSERT && record->op != LOG_DELETE
+			&& record->op != LOG_INSERT_TTL)
+		return 0;
+
+	*deadline = 0;
+	if (record->op == LOG_INSERT_TTL
+			&& fread(deadline, sizeof(*deadline), 1, fp) != 1)
+		return 0;
+
+	need = record->keylen;
+	if (record->valuelen != LOG_NULL_VALUE)
+		need += record->valuelen;
+	if (need > *bufferSize) {
+		grown = (char *) realloc(*buffer, need);
+		if (grown == NULL)
+			return 0;
+		*buffer = grown;
+		*bufferSize = need;
+	}
+
+	if (fread(*buffer, 1, need, fp) != need)
+		return 0;
+	return recordChecksum(record, *deadline, *buffer, *buffer + record->keylen)
+			== record->checksum;
+}
+
+/**
+ * Apply one logged change to the table.  Inserting a key already there
+ * is skipped rather than reported, as a log written before a crash in
+ * the middle of aaCheckpoint() repeats changes the snapshot holds, and
+ * so is inserting an entry whose time to live has run out since.
+ */
+static void replayRecord(AssociativeArray *aarray, LogRecord *record,
+		uint64_t stored, char *data)
+{
+	AAKeyType key = (AAKeyType) data;
+	uint64_t deadline = aaDeadlineFromFile(stored);
+	void *value = NULL;
+
+	if (record->op == LOG_DELETE) {
+		value = aaDelete(aarray, key, record->keylen);
+		if (aarray->valueSize == 0)
+			free(value);
+		return;
+	}
+
+	if (aaLookup(aarray, key, record->keylen) != NULL
+			|| aaDeadlinePassed(deadline))
+		return;
+	if (deadline != 0 && aaEnableExpiry(aarray) < 0)
+		return;
+
+	if (record->valuelen != LOG_NULL_VALUE) {
+		if (aarray->valueSize != 0) {
+			value = data + record->keylen;
+		} else {
+			/** the caller owns the values, as for aaLoad() */
+			value = malloc(record->valuelen);
+			if (value == NULL)
+				return;
+			memcpy(value, data + record->keylen, record->valuelen);
+		}
+	}
+
+	if (aaInsertExpiring(aarray, key, record->keylen, value, deadline) < 0
+			&& aarray->valueSize == 0)
+		free(value);
+}
+
+/**
+ * Apply every whole record of the log to the table
+ *
+ *  @return      the offset just past the last whole record
+ */
+static long replayLog(AssociativeArray *aarray, FILE *fp)
+{
+	LogRecord record;
+	uint64_t deadline;
+	char *buffer = NULL;
+	size_t bufferSize = 0;
+	long good = ftell(fp);
+
+	while (readRecord(fp, &record, &deadline, &buffer, &bufferSize)) {
+		replayRecord(aarray, &record, deadline, buffer);
+		good = ftell(fp);
+	}
+
+	free(buffer);
+	return good;
+}
+
+
+/**
+ * Make the table durable by logging every change made to it from now
+ * on to the named file.  If the file already holds a log, its changes
+ * are first replayed into the table, so that starting up is a matter of
+ * aaLoad()ing the last snapshot and then opening its log.
+ *
+ * A change is written to the log when it is made, but only forced to
+ * disk once every groupSize changes (or at aaSyncLog()), so that many
+ * changes share the cost of each fsync.  A groupSize of 1 forces every
+ * change to disk before aaInsert() or aaDelete() returns.
+ *
+ * As for aaSave(), values not copied into the table are logged as the
+ * NUL-terminated strings they point to; replayed ones are malloc(3)ed
+ * copies, which a replayed delete frees.
+ *
+ *  @return      1 on success, or -1 if the log could not be opened
+ */
+int aaOpenLog(AssociativeArray *aarray, const char *path, int groupSize)
+{
+	LogHeader header;
+	AALog *log;
+	long good;
+	int fd;
+
+	if (aaRefuseReadOnly(aarray) || aaRefuseRadix(aarray) || aaRefuseMultimap(aarray))
+		return -1;
+	if (aarray->log != NULL) {
+		fprintf(stderr, "Table already has a log\n");
+		return -1;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot open log '%s' : %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	log = (AALog *) aaMalloc(aarray, sizeof(AALog));
+	if (log == NULL || (log->fp = fdopen(fd, "r+")) == NULL) {
+		fprintf(stderr, "Cannot open log '%s' : %s\n", path, strerror(errno));
+		aaFree(aarray, log);
+		close(fd);
+		return -1;
+	}
+	log->fd = fd;
+	log->path = aaStrdup(aarray, path);
+	log->groupSize = (groupSize < 1) ? 1 : groupSize;
+	log->nPending = 0;
+	log->failed = 0;
+	pthread_mutex_init(&log->lock, NULL);
+	setvbuf(log->fp, NULL, _IOFBF, LOG_BUFFER);
+
+	if (fread(&header, sizeof(header), 1, log->fp) == 1) {
+		if (memcmp(header.magic, LOG_MAGIC, sizeof(header.magic)) != 0
+				|| header.valueSize != aarray->valueSize) {
+			fprintf(stderr, "'%s' is not a log for this table\n", path);
+			aarray->log = log;
+			aaCloseLog(aarray);
+			return -1;
+		}
+		good = replayLog(aarray, log->fp);
+	} else {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+		header.valueSize = aarray->valueSize;
+		good = 0;
+	}
+
+	/** drop any record cut short, and append from there */
+	if (fseek(log->fp, good, SEEK_SET) != 0 || ftruncate(fd, good) != 0
+			|| (good == 0 && fwrite(&header, sizeof(header), 1, log->fp) != 1)
+			|| syncLog(log) < 0) {
+		fprintf(stderr, "Cannot prepare log '%s' : %s\n", path, strerror(errno));
+		aarray->log = log;
+		aaCloseLog(aarray);
+		return -1;
+	}
+
+	aarray->log = log;
+	return 1;
+}
+
+/**
+ * Append a change to the log; called by aaInsert() and aaDelete() once
+ * the change is made, while they still hold the key's lock, so that
+ * changes to any one key are logged in the order they were made.  An
+ * insert is given the entry's deadline, or 0 if it has none.
+ */
+void aaLogChange(AssociativeArray *aarray, int insert,
+		AAKeyType key, size_t keylen, void *value, uint64_t deadline)
+{
+	AALog *log = aarray->log;
+	LogRecord record;
+	uint64_t stored = aaDeadlineToFile(deadline);
+	int ok, mustSync = 0;
+
+	memset(&record, 0, sizeof(record));
+	record.op = ! insert ? LOG_DELETE : (stored != 0) ? LOG_INSERT_TTL : LOG_INSERT;
+	record.keylen = keylen;
+	record.valuelen = insert ? loggedValueLength(aarray, value) : LOG_NULL_VALUE;
+	record.checksum = recordChecksum(&record, stored, key, value);
+
+	pthread_mutex_lock(&log->lock);
+	ok = fwrite(&record, sizeof(record), 1, log->fp) == 1
+			&& (record.op != LOG_INSERT_TTL
+				|| fwrite(&stored, sizeof(stored), 1, log->fp) == 1)
+			&& fwrite(key, 1, keylen, log->fp) == keylen;
+	if (ok && record.valuelen != LOG_NULL_VALUE)
+		ok = fwrite(value, 1, record.valuelen, log->fp) == record.valuelen;
+	if (ok && ++log->nPending >= log->groupSize) {
+		ok = fflush(log->fp) == 0;
+		log->nPending = 0;
+		mustSync = 1;
+	}
+	if ( ! ok)
+		logFailed(log);
+	pthread_mutex_unlock(&log->lock);
+
+	/**
+	 * the records are with the kernel now, so other writers may go on
+	 * appending while this one waits for the disk
+	 */
+	if (mustSync && fdatasync(log->fd) != 0) {
+		pthread_mutex_lock(&log->lock);
+		logFailed(log);
+		pthread_mutex_unlock(&log->lock);
+	}
+}
+
+/**
+ * Force every change logged so far to disk
+ *
+ *  @return      1 on success, or -1 if the log could not be written
+ */
+int aaSyncLog(AssociativeArray *aarray)
+{
+	AALog *log = aarray->log;
+	int result;
+
+	if (log == NULL)
+		return 1;
+
+	pthread_mutex_lock(&log->lock);
+	result = syncLog(log);
+	if (result < 0 || log->failed) {
+		logFailed(log);
+		result = -1;
+	} else {
+		log->nPending = 0;
+	}
+	pthread_mutex_unlock(&log->lock);
+
+	return result;
+}
+
+/**
+ * Write a snapshot of the table, and empty its log, which the snapshot
+ * now covers.  The snapshot is written beside its final name and then
+ * renamed into place, so a crash leaves either the old snapshot and the
+ * whole log, or the new snapshot and a log that at most repeats it.
+ *
+ *  @return      1 on success, or -1 if the snapshot could not be written
+ */
+int aaCheckpoint(AssociativeArray *aarray, const char *snapshotPath)
+{
+	AALog *log = aarray->log;
+	char *partial;
+	FILE *fp;
+	int ok;
+
+	if (log == NULL) {
+		fprintf(stderr, "Table has no log to checkpoint\n");
+		return -1;
+	}
+
+	partial = (char *) malloc(strlen(snapshotPath) + sizeof(".partial"));
+	if (partial == NULL)
+		return -1;
+	sprintf(partial, "%s.partial", snapshotPath);
+
+	fp = fopen(partial, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "Cannot open snapshot '%s' : %s\n",
+				partial, strerror(errno));
+		free(partial);
+		return -1;
+	}
+
+	/** with the table locked, nothing can be logged until we are done */
+	aaLockTable(aarray);
+	ok = aaWriteSnapshot(aarray, fp)
+			&& fflush(fp) == 0
+			&& fsync(fileno(fp)) == 0;
+	if (fclose(fp) != 0)
+		ok = 0;
+	if (ok)
+		ok = rename(partial, snapshotPath) == 0;
+
+	if (ok) {
+		pthread_mutex_lock(&log->lock);
+		ok = fflush(log->fp) == 0
+				&& ftruncate(log->fd, sizeof(LogHeader)) == 0
+				&& fseek(log->fp, sizeof(LogHeader), SEEK_SET) == 0
+				&& fdatasync(log->fd) == 0;
+		if ( ! ok)
+			logFailed(log);
+		log->nPending = 0;
+		pthread_mutex_unlock(&log->lock);
+	} else {
+		fprintf(stderr, "Failed writing snapshot '%s' : %s\n",
+				partial, strerror(errno));
+		unlink(partial);
+	}
+	aaUnlockTable(aarray);
+
+	free(partial);
+	return ok ? 1 : -1;
+}
+
+/**
+ * Force the log to disk and detach it from the table; called when the
+ * table is deleted
+ */
+void aaCloseLog(AssociativeArray *aarray)
+{
+	AALog *log = aarray->log;
+
+	if (log == NULL)
+		return;
+
+	if (syncLog(log) < 0)
+		logFailed(log);
+	fclose(log->fp);
+	pthread_mutex_destroy(&log->lock);
+	aaFree(aarray, log->path);
+	aaFree(aarray, log);
+	aarray->log = NULL;
+}
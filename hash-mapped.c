@@ -0,0 +1,440 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hashtools.h"
+
+/**
+ * A mapped image holds no pointers, so it can be mapped at any address
+ * and used where it lies.  Every position within it is an offset from
+ * the start of the file, and each section is padded to 8 bytes.  The
+ * layout is:
+ *
+ *   MappedHeader
+ *   the three strategy names
+ *   the index, exactly as it is in memory
+ *   one MappedEntry for each dense entry, deleted ones included
+ *   the keys, end to end
+ *   the values, each padded to 8 bytes
+ *
+ * As with snapshots, the byte order and word size are those of the
+ * machine that wrote the file.
+ */
+#define	MAPPED_MAGIC	"AAMAP001"
+
+typedef struct MappedHeader {
+	char magic[8];
+	uint64_t fileLength;
+	uint64_t size;
+	uint64_t valueSize;
+	uint64_t indexWidth;
+	uint64_t nUsed;
+	uint64_t nEntries;
+	uint64_t indexOffset;
+	uint64_t entriesOffset;
+	uint32_t nameLength[3];
+	uint32_t unused;
+} MappedHeader;
+
+typedef struct MappedEntry {
+	uint32_t validity;
+	uint32_t keylen;
+	uint64_t keyOffset;
+	uint64_t valueOffset;
+} MappedEntry;
+
+/** the mapping behind a table opened with aaOpenMapped() */
+typedef struct MappedImage {
+	const char *base;
+	size_t length;
+	const MappedEntry *entries;
+} MappedImage;
+
+static uint64_t padTo8(uint64_t length)
+{
+	return (length + 7) & ~((uint64_t) 7);
+}
+
+/** the bytes stored for a value, or 0 for a NULL value pointer */
+static uint64_t valueLength(AssociativeArray *aarray, KeyDataPair *pair)
+{
+	if (aarray->valueSize != 0)
+		return aarray->valueSize;
+	if (pair->value == NULL || ! aaPairLive(aarray, pair))
+		return 0;
+	return strlen((char *) pair->value) + 1;
+}
+
+static int writePadding(FILE *fp, uint64_t length)
+{
+	static const char zeros[8];
+	uint64_t padding = padTo8(length) - length;
+
+	return fwrite(zeros, 1, padding, fp) == padding;
+}
+
+/**
+ * Write the table in the pointer-free form read by aaOpenMapped().
+ * Values are written as for aaSave(): copied-in values as they are,
+ * and value pointers as the NUL-terminated strings they point to.
+ *
+ *  @return      1 on success, or -1 if the file could not be written
+ */
+int aaSaveMapped(AssociativeArray *aarray, const char *path)
+{
+	char *names[3];
+	MappedHeader header;
+	MappedEntry record;
+	uint64_t keyOffset, valueOffset, length;
+	FILE *fp;
+	int i, ok;
+
+	if (aarray->mapped != NULL) {
+		fprintf(stderr, "Table is already mapped from a file\n");
+		return -1;
+	}
+	/** a frozen table's index is a perfect hash, which cannot be probed */
+	if (aaRefuseReadOnly(aarray) || aaRefuseRadix(aarray) || aaRefuseMultimap(aarray))
+		return -1;
+
+	fp = fopen(path, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "Cannot open mapped table '%s' : %s\n",
+				path, strerror(errno));
+		return -1;
+	}
+
+	aaLockTable(aarray);
+
+	names[0] = aarray->probeName;
+	names[1] = aarray->hashNamePrimary;
+	names[2] = aarray->hashNameSecondary;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MAPPED_MAGIC, sizeof(header.magic));
+	header.size = aarray->size;
+	header.valueSize = aarray->valueSize;
+	header.indexWidth = aarray->indexWidth;
+	header.nUsed = aarray->nUsed;
+	header.nEntries = 0;
+	for (i = 0; i < aarray->nUsed; i++)
+		header.nEntries += aaPairLive(aarray, aaEntry(aarray, i));
+	length = 0;
+	for (i = 0; i < 3; i++) {
+		header.nameLength[i] = strlen(names[i]);
+		length += header.nameLength[i];
+	}
+	header.indexOffset = sizeof(header) + padTo8(length);
+	header.entriesOffset = header.indexOffset
+			+ padTo8((uint64_t) aarray->size * aarray->indexWidth);
+
+	/** the keys follow the entries, and the values follow the keys */
+	keyOffset = header.entriesOffset + (uint64_t) aarray->nUsed * sizeof(MappedEntry);
+	valueOffset = keyOffset;
+	for (i = 0; i < aarray->nUsed; i++)
+		valueOffset += aaEntry(aarray, i)->keylen;
+	valueOffset = padTo8(valueOffset);
+
+	header.fileLength = valueOffset;
+	for (i = 0; i < aarray->nUsed; i++)
+		header.fileLength += padTo8(valueLength(aarray, aaEntry(aarray, i)));
+
+	ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	for (i = 0; ok && i < 3; i++)
+		ok = fwrite(names[i], 1, header.nameLength[i], fp) == header.nameLength[i];
+	if (ok)
+		ok = writePadding(fp, length);
+
+	if (ok)
+		ok = fwrite(aarray->index, aarray->indexWidth, aarray->size, fp)
+				== (size_t) aarray->size
+			&& writePadding(fp, (uint64_t) aarray->size * aarray->indexWidth);
+
+	for (i = 0; ok && i < aarray->nUsed; i++) {
+		KeyDataPair *pair = aaEntry(aarray, i);
+
+		length = valueLength(aarray, pair);
+		record.validity = aaPairLive(aarray, pair) ? HASH_USED : HASH_DELETED;
+		record.keylen = pair->keylen;
+		record.keyOffset = keyOffset;
+		record.valueOffset = (length == 0) ? 0 : valueOffset;
+		keyOffset += pair->keylen;
+		valueOffset += padTo8(length);
+		ok = fwrite(&record, sizeof(record), 1, fp) == 1;
+	}
+
+	for (i = 0; ok && i < aarray->nUsed; i++) {
+		KeyDataPair *pair = aaEntry(aarray, i);
+
+		ok = fwrite(pair->key, 1, pair->keylen, fp) == pair->keylen;
+	}
+	if (ok)
+		ok = writePadding(fp, keyOffset);
+
+	for (i = 0; ok && i < aarray->nUsed; i++) {
+		KeyDataPair *pair = aaEntry(aarray, i);
+
+		length = valueLength(aarray, pair);
+		ok = fwrite(aaPairValue(aarray, pair), 1, length, fp) == length
+				&& writePadding(fp, length);
+	}
+
+	aaUnlockTable(aarray);
+
+	if (fclose(fp) != 0)
+		ok = 0;
+	if ( ! ok) {
+		fprintf(stderr, "Failed writing mapped table '%s' : %s\n",
+				path, strerror(errno));
+		return -1;
+	}
+	return 1;
+}
+
+/**
+ * Map a file written by aaSaveMapped() and return a table that reads
+ * from it where it lies.  Nothing is read up front, so opening takes
+ * the same time however large the table, and every process mapping
+ * the same file shares one copy of it in the page cache.
+ *
+ * The table is read-only: aaLookup() and aaIterateAction() work as
+ * usual, and return values that point into the mapping, while calls
+ * which would change the table fail.  aaScan() and aaPrintContents()
+ * do not look into the mapping, and show no entries.  aaDeleteAssociativeArray()
+ * unmaps the file, after which those values are gone; they must not
+ * be freed by the caller.
+ *
+ *  @return      the table, or NULL if the file cannot be used
+ */
+AssociativeArray *aaOpenMapped(const char *path)
+{
+	AssociativeArray *aarray;
+	const MappedHeader *header;
+	MappedImage *image;
+	struct stat status;
+	char *names[3];
+	const char *name;
+	void *base;
+	int fd, i;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot open mapped table '%s' : %s\n",
+				path, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &status) < 0 || status.st_size < (off_t) sizeof(MappedHeader)) {
+		fprintf(stderr, "Mapped table '%s' is too short\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	base = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "Cannot map table '%s' : %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	header = (const MappedHeader *) base;
+	if (memcmp(header->magic, MAPPED_MAGIC, sizeof(header->magic)) != 0
+			|| header->fileLength != (uint64_t) status.st_size
+			|| sizeof(MappedHeader) + (uint64_t) header->nameLength[0]
+					+ header->nameLength[1] + header->nameLength[2]
+					> header->indexOffset
+			|| header->nUsed > header->size
+			|| (header->indexWidth != 1 && header->indexWidth != 2
+					&& header->indexWidth != 4)
+			|| header->indexOffset + header->size * header->indexWidth
+					> header->entriesOffset
+			|| header->entriesOffset + header->nUsed * sizeof(MappedEntry)
+					> header->fileLength) {
+		fprintf(stderr, "'%s' is not a mapped table\n", path);
+		munmap(base, status.st_size);
+		return NULL;
+	}
+
+	/** the names are not terminated in the file, so copy them out */
+	name = (const char *) (header + 1);
+	for (i = 0; i < 3; i++) {
+		names[i] = strndup(name, header->nameLength[i]);
+		name += header->nameLength[i];
+	}
+	if (names[0] == NULL || names[1] == NULL || names[2] == NULL) {
+		for (i = 0; i < 3; i++)
+			free(names[i]);
+		munmap(base, status.st_size);
+		return NULL;
+	}
+
+	/**
+	 * create the smallest table, for its strategies, and then trade
+	 * its index and entries for those in the file
+	 */
+	aarray = aaCreateAssociativeArray(1, header->valueSize,
+			names[0], names[1], names[2]);
+	for (i = 0; i < 3; i++)
+		free(names[i]);
+	image = NULL;
+	if (aarray != NULL)
+		image = (MappedImage *) aaMalloc(aarray, sizeof(MappedImage));
+	if (image == NULL) {
+		aaDeleteAssociativeArray(aarray);
+		munmap(base, status.st_size);
+		return NULL;
+	}
+
+	image->base = (const char *) base;
+	image->length = status.st_size;
+	image->entries = (const MappedEntry *) (image->base + header->entriesOffset);
+
+	aaFreeIndex(aarray, aarray->index);
+	aaFree(aarray, aarray->table);
+	aarray->index = (void *) (image->base + header->indexOffset);
+	aarray->table = NULL;
+	aarray->nAllocated = 0;
+	aarray->nUsed = 0;
+	aarray->size = header->size;
+	aarray->indexWidth = header->indexWidth;
+	aarray->nEntries = header->nEntries;
+	aarray->mapped = image;
+
+	return aarray;
+}
+
+/** the entry a slot of a mapped table refers to, or NULL if it is empty */
+static const MappedEntry *mappedSlotEntry(AssociativeArray *aarray, HashIndex slot)
+{
+	const MappedHeader *header = (const MappedHeader *) aarray->mapped->base;
+	int offset = aaIndexGet(aarray, slot);
+
+	if (offset < 0 || offset >= header->nUsed)
+		return NULL;
+	return &aarray->mapped->entries[offset];
+}
+
+/** the key of a mapped entry, if it lies within the file */
+static AAKeyType mappedKey(AssociativeArray *aarray, const MappedEntry *entry)
+{
+	if (entry->keyOffset > aarray->mapped->length
+			|| entry->keylen > aarray->mapped->length - entry->keyOffset)
+		return NULL;
+	return (AAKeyType) (aarray->mapped->base + entry->keyOffset);
+}
+
+/**
+ * the value of a mapped entry, if the whole of it lies within the file:
+ * its valueSize bytes, or for a string, up to and including its NUL
+ */
+static void *mappedValue(AssociativeArray *aarray, const MappedEntry *entry)
+{
+	const char *value;
+	size_t room;
+
+	if (entry->valueOffset == 0 || entry->valueOffset >= aarray->mapped->length)
+		return NULL;
+	value = aarray->mapped->base + entry->valueOffset;
+	room = aarray->mapped->length - entry->valueOffset;
+	if (aarray->valueSize != 0 ? aarray->valueSize > room
+			: memchr(value, 0, room) == NULL)
+		return NULL;
+	return (void *) value;
+}
+
+/**
+ * The slot visited on a given attempt of the table's probe sequence.
+ * This follows the same slots as the probing strategies in
+ * hash-functions.c, which cannot be used here as they look at the
+ * KeyDataPairs of an ordinary table.
+ */
+static HashIndex mappedProbeSlot(AssociativeArray *aarray,
+		AAKeyType key, size_t keylen, HashIndex start, int attempt)
+{
+	HashIndex step;
+
+	if (aarray->hashProbe == quadraticProbe)
+		return quadraticProbeStep(start, attempt, aarray->size);
+
+	if (aarray->hashProbe == doubleHashProbe) {
+		step = aarray->hashAlgorithmSecondary(key, keylen, aarray->size);
+		return (start + attempt * step) % aarray->size;
+	}
+
+	return linearProbeStep(start, attempt, aarray->size);
+}
+
+/**
+ * aaLookup() for a mapped table: probe the slots as aaFindPair() does,
+ * stopping at the matching key or at the first empty slot
+ */
+void *aaMappedLookup(AssociativeArray *aarray, AAKeyType key, size_t keylen)
+{
+	const MappedEntry *entry;
+	AAKeyType entryKey;
+	HashIndex start, slot;
+	int attempt;
+
+	start = aarray->hashAlgorithmPrimary(key, keylen, aarray->size);
+	for (attempt = 0; attempt < aarray->size; attempt++) {
+		slot = mappedProbeSlot(aarray, key, keylen, start, attempt);
+		entry = mappedSlotEntry(aarray, slot);
+		if (entry == NULL)
+			return NULL;
+		if (entry->validity != HASH_USED)
+			continue;
+
+		entryKey = mappedKey(aarray, entry);
+		if (entryKey != NULL && doKeysMatch(entryKey, entry->keylen, key, keylen))
+			return mappedValue(aarray, entry);
+	}
+	return NULL;
+}
+
+/**
+ * aaIterateAction() for a mapped table, visiting the entries in the
+ * order in which they were inserted
+ */
+int aaMappedIterate(
+		AssociativeArray *aarray,
+		int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *userdata),
+		void *userdata
+	)
+{
+	const MappedHeader *header = (const MappedHeader *) aarray->mapped->base;
+	const MappedEntry *entry;
+	AAKeyType key;
+	int i;
+
+	for (i = 0; i < header->nUsed; i++) {
+		entry = &aarray->mapped->entries[i];
+		if (entry->validity != HASH_USED)
+			continue;
+
+		key = mappedKey(aarray, entry);
+		if (key == NULL)
+			continue;
+		if ((*userfunction)(key, entry->keylen,
+					mappedValue(aarray, entry), userdata) < 0)
+			return -1;
+	}
+	return 1;
+}
+
+/**
+ * Unmap the file behind a mapped table; called when the table is deleted
+ */
+void aaCloseMapped(AssociativeArray *aarray)
+{
+	munmap((void *) aarray->mapped->base, aarray->mapped->length);
+	aaFree(aarray, aarray->mapped);
+	aarray->mapped = NULL;
+	aarray->index = NULL;
+	aarray->size = 0;
+}
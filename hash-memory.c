@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "hashtools.h"
+
+/** indexes at least this large are mapped, rather than taken from the allocator */
+#define	LARGE_INDEX_BYTES	(1 << 20)
+
+/** the size of a huge page, to which MAP_HUGETLB mappings are rounded */
+#define	HUGE_PAGE_BYTES		(2 << 20)
+
+/**
+ * Every index is preceded by a header saying how it was allocated, so
+ * that it can be freed (or retired) given only its address.  The header
+ * is a cache line long, so the index itself stays line-aligned.
+ */
+typedef struct IndexHeader {
+	size_t mappedBytes;
+	char padding[64 - sizeof(size_t)];
+} IndexHeader;
+
+
+/** the C library's allocator, for tables not given one of their own */
+static void *defaultAllocate(size_t size, void *context)
+{
+	return malloc(size);
+}
+
+static void *defaultReallocate(void *memory, size_t size, void *context)
+{
+	return realloc(memory, size);
+}
+
+static void defaultRelease(void *memory, void *context)
+{
+	free(memory);
+}
+
+const AAAllocator aaDefaultAllocator = {
+	defaultAllocate,
+	defaultReallocate,
+	defaultRelease,
+	NULL
+};
+
+/** strdup(3), using the table's allocator */
+char *aaStrdup(const AssociativeArray *aarray, const char *string)
+{
+	size_t length = strlen(string) + 1;
+	char *copy = (char *) aaMalloc(aarray, length);
+
+	if (copy != NULL)
+		memcpy(copy, string, length);
+	return copy;
+}
+
+
+/**
+ * Allocate an index of the given number of bytes, all zero, so that
+ * every slot is empty.  Small indexes come from the table's allocator,
+ * as do large ones when the table was given an allocator of its own
+ * and no memoryFlags.
+ *
+ * Large indexes are mapped with mmap(2): the kernel hands these out as
+ * zero pages, so there is no memset over the whole index, and a page is
+ * only faulted in once a slot on it is used.  The table's memoryFlags
+ * can ask for any index to be mapped, backed by huge pages (through
+ * transparent huge pages, or hugetlbfs if there are pages reserved),
+ * and faulted in up front.
+ *
+ *  @return      the index, or NULL if no memory could be found
+ */
+void *aaAllocIndex(AssociativeArray *aarray, size_t bytes)
+{
+	IndexHeader *header;
+	size_t mappedBytes = bytes + sizeof(IndexHeader);
+	int memoryFlags = aarray->memoryFlags;
+	int mmapFlags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+	if (memoryFlags == AA_MEMORY_DEFAULT && (bytes < LARGE_INDEX_BYTES
+			|| aarray->allocator.allocate != aaDefaultAllocator.allocate)) {
+		header = (IndexHeader *) aaMalloc(aarray, mappedBytes);
+		if (header == NULL)
+			return NULL;
+		memset(header, 0, mappedBytes);
+		return header + 1;
+	}
+
+#ifdef MAP_POPULATE
+	if (memoryFlags & AA_MEMORY_POPULATE)
+		mmapFlags |= MAP_POPULATE;
+#endif
+
+	header = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (memoryFlags & AA_MEMORY_HUGETLB) {
+		mappedBytes = (mappedBytes + HUGE_PAGE_BYTES - 1)
+				& ~((size_t) HUGE_PAGE_BYTES - 1);
+		header = (IndexHeader *) mmap(NULL, mappedBytes,
+				PROT_READ | PROT_WRITE, mmapFlags | MAP_HUGETLB, -1, 0);
+	}
+#endif
+
+	/** no huge pages reserved, so fall back to ordinary ones */
+	if (header == MAP_FAILED) {
+		mappedBytes = bytes + sizeof(IndexHeader);
+		header = (IndexHeader *) mmap(NULL, mappedBytes,
+				PROT_READ | PROT_WRITE, mmapFlags, -1, 0);
+		if (header == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		if (memoryFlags & (AA_MEMORY_HUGEPAGE | AA_MEMORY_HUGETLB))
+			madvise(header, mappedBytes, MADV_HUGEPAGE);
+#endif
+	}
+
+	header->mappedBytes = mappedBytes;
+	return header + 1;
+}
+
+/**
+ * Free an index from aaAllocIndex()
+ */
+void aaFreeIndex(AssociativeArray *aarray, void *index)
+{
+	IndexHeader *header;
+
+	if (index == NULL)
+		return;
+
+	header = ((IndexHeader *) index) - 1;
+	if (header->mappedBytes == 0)
+		aaFree(aarray, header);
+	else
+		munmap(header, header->mappedBytes);
+}
+
+/**
+ * Choose how the index of the table is allocated from now on; see
+ * aaAllocIndex().  If nothing has been inserted yet, the index is
+ * replaced straight away, so flags set just after creating the table
+ * apply to it from the start; otherwise they take effect the next time
+ * the table is rebuilt.
+ *
+ *  @return      1 on success, or -1 if the new index could not be made
+ */
+int aaSetMemoryFlags(AssociativeArray *aarray, int memoryFlags)
+{
+	void *index, *oldIndex;
+	int result = 1;
+
+	if (aaRefuseReadOnly(aarray) || aaRefuseRadix(aarray))
+		return -1;
+
+	aaLockTable(aarray);
+	aarray->memoryFlags = memoryFlags;
+	if (aarray->nUsed == 0) {
+		index = aaAllocIndex(aarray, (size_t) aarray->size * aarray->indexWidth);
+		if (index == NULL) {
+			result = -1;
+		} else {
+			oldIndex = aarray->index;
+			aaStructureBegin(aarray);
+			aarray->index = index;
+			aaStructureEnd(aarray);
+			aaRetireIndex(aarray, oldIndex);
+		}
+	}
+	aaUnlockTable(aarray);
+
+	return result;
+}
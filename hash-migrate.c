@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "hashtools.h"
+
+/** number of old entries making up one chunk of a migration */
+#define	MIGRATE_CHUNK	4096
+
+/**
+ * A migration is done in two rounds over the same chunks: the first
+ * counts the live entries in each chunk, so that the second knows
+ * where in the new dense entries each chunk's survivors belong, and
+ * insertion order is kept however the chunks are shared out.
+ */
+#define	ROUND_NONE	0
+#define	ROUND_COUNT	1
+#define	ROUND_PLACE	2
+
+
+static KeyDataPair *oldPair(AssociativeArray *aarray, AAMigration *migration, int i)
+{
+	return (KeyDataPair *) (migration->oldTable + (size_t) i * aarray->entrySize);
+}
+
+static int chunkEnd(AAMigration *migration, int chunk)
+{
+	int end = (chunk + 1) * MIGRATE_CHUNK;
+
+	if (end > migration->oldUsed)
+		end = migration->oldUsed;
+	return end;
+}
+
+/** first round: note how many live entries a chunk holds */
+static void countChunk(AssociativeArray *aarray, AAMigration *migration, int chunk)
+{
+	int i, end = chunkEnd(migration, chunk), nLive = 0;
+
+	for (i = chunk * MIGRATE_CHUNK; i < end; i++) {
+		if (oldPair(aarray, migration, i)->validity == HASH_USED)
+			nLive++;
+	}
+	migration->chunkStart[chunk + 1] = nLive;
+}
+
+/**
+ * second round: copy a chunk's live entries to their place in the new
+ * dense entries, and point a slot of the new index at each.  Other
+ * threads are filling in the same index, so a slot is claimed with a
+ * compare-and-swap, and on losing the race we probe on from the start
+ * of the key's sequence, past the slot just taken.  Each lost race
+ * means another entry placed, so there can be no more than size of
+ * them; a probe that comes back round with nowhere left to go fails
+ * the whole migration.
+ */
+static void placeChunk(AssociativeArray *aarray, AAMigration *migration, int chunk)
+{
+	/** a private header, so the probes' cost tallies are not shared */
+	AssociativeArray rebuilt = *migration->rebuilt;
+	int i, end = chunkEnd(migration, chunk);
+	int offset = migration->chunkStart[chunk];
+	HashIndex start, slot;
+	int attempt;
+
+	for (i = chunk * MIGRATE_CHUNK; i < end; i++) {
+		KeyDataPair *pair = oldPair(aarray, migration, i);
+
+		if (__atomic_load_n(&migration->failed, __ATOMIC_RELAXED))
+			return;
+
+		if (pair->validity != HASH_USED)
+			continue;
+
+		memcpy(aaEntry(&rebuilt, offset), pair, aarray->entrySize);
+
+		start = slot = rebuilt.hashAlgorithmPrimary(pair->key, pair->keylen, rebuilt.size);
+		for (attempt = 0; ! aaIndexReplace(&rebuilt, slot, HASH_INDEX_EMPTY, offset);
+				attempt++) {
+			slot = rebuilt.hashProbe(&rebuilt, pair->key, pair->keylen,
+					start, 0, NULL);
+			if (attempt >= rebuilt.size
+					|| aaSlotValidity(&rebuilt, slot) == HASH_USED) {
+				__atomic_store_n(&migration->failed, 1, __ATOMIC_RELAXED);
+				return;
+			}
+		}
+		offset++;
+	}
+}
+
+/**
+ * Claim chunks of the current round until none are left, returning
+ * how many we did
+ */
+static int workOnRound(AssociativeArray *aarray, AAMigration *migration, int round)
+{
+	int chunk, nDone = 0;
+
+	while ((chunk = __atomic_fetch_add(&migration->nextChunk, 1, __ATOMIC_RELAXED))
+			< migration->nChunks) {
+		if (round == ROUND_COUNT)
+			countChunk(aarray, migration, chunk);
+		else
+			placeChunk(aarray, migration, chunk);
+		__atomic_fetch_add(&migration->doneChunks, 1, __ATOMIC_RELEASE);
+		nDone++;
+	}
+	return nDone;
+}
+
+/**
+ * Post a round for helpers to join, work on it ourselves, and wait
+ * until every chunk is done.  The round is only taken down once the
+ * last helper has left it, so none can stray into the next one.
+ */
+static void runRound(AssociativeArray *aarray, AAMigration *migration, int round)
+{
+	migration->nextChunk = 0;
+	migration->doneChunks = 0;
+	__atomic_store_n(&migration->round, round, __ATOMIC_SEQ_CST);
+
+	workOnRound(aarray, migration, round);
+	while (__atomic_load_n(&migration->doneChunks, __ATOMIC_ACQUIRE)
+			< migration->nChunks)
+		sched_yield();
+
+	__atomic_store_n(&migration->round, ROUND_NONE, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&migration->helpers, __ATOMIC_SEQ_CST) != 0)
+		sched_yield();
+}
+
+/**
+ * Move the live entries of a shared table into the arrays of rebuilt,
+ * chunk by chunk, with the help of any other thread that arrives at
+ * the table while we do so (see aaHelpMigration()).  The caller holds
+ * the table locked against writers, so the old entries stand still.
+ *
+ * Unshared and small tables are not worth the trouble, and are left to
+ * the caller to move on its own.
+ *
+ *  @return      the number of entries moved, -1 if the caller is
+ *				 to move them itself, or -2 if some entry could not
+ *				 be placed in rebuilt, which must then be thrown away
+ */
+int aaMigrateEntries(AssociativeArray *aarray, AssociativeArray *rebuilt,
+		char *oldTable, int oldUsed)
+{
+	AAMigration *migration = &aarray->migration;
+	int i;
+
+	if (aarray->concurrency == AA_CONCURRENCY_NONE
+			|| oldUsed < 2 * MIGRATE_CHUNK)
+		return -1;
+
+	migration->nChunks = (oldUsed + MIGRATE_CHUNK - 1) / MIGRATE_CHUNK;
+	migration->chunkStart = (int *) aaMalloc(aarray,
+			(migration->nChunks + 1) * sizeof(int));
+	if (migration->chunkStart == NULL)
+		return -1;
+	migration->chunkStart[0] = 0;
+	migration->oldTable = oldTable;
+	migration->oldUsed = oldUsed;
+	migration->rebuilt = rebuilt;
+	migration->failed = 0;
+
+	runRound(aarray, migration, ROUND_COUNT);
+
+	/** turn the counts into the offset at which each chunk starts */
+	for (i = 0; i < migration->nChunks; i++)
+		migration->chunkStart[i + 1] += migration->chunkStart[i];
+
+	runRound(aarray, migration, ROUND_PLACE);
+
+	rebuilt->nUsed = migration->chunkStart[migration->nChunks];
+	aaFree(aarray, migration->chunkStart);
+	migration->chunkStart = NULL;
+	migration->rebuilt = NULL;
+	if (migration->failed)
+		return -2;
+	return rebuilt->nUsed;
+}
+
+/**
+ * Called by a thread about to wait for a lock on the table: if the
+ * table is being rebuilt, help with the round in progress rather than
+ * sit idle.
+ *
+ *  @return      1 if we moved any of the entries, else 0
+ */
+int aaHelpMigration(AssociativeArray *aarray)
+{
+	AAMigration *migration = &aarray->migration;
+	int round, helped = 0;
+
+	/** announce ourselves before looking, so the round cannot end unseen */
+	__atomic_fetch_add(&migration->helpers, 1, __ATOMIC_SEQ_CST);
+	round = __atomic_load_n(&migration->round, __ATOMIC_SEQ_CST);
+	if (round != ROUND_NONE && workOnRound(aarray, migration, round) > 0)
+		helped = 1;
+	__atomic_fetch_sub(&migration->helpers, 1, __ATOMIC_RELEASE);
+
+	return helped;
+}
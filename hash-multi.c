@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashtools.h"
+
+/**
+ * A multimap table lets a key hold any number of values.  The values
+ * of each key are kept together in a ValueList of their own, hung from
+ * the value pointer of the key's one entry, so aaLookupAll() finds all
+ * of them with a single probe and hands them back as one array: of the
+ * void * values given, or of the valueSize-byte values copied in,
+ * packed end to end.  Inserting a key already present appends to its
+ * list, which doubles in size as it fills.
+ *
+ * aaLookup() and iteration see the first value of a key, and aaDelete()
+ * takes the key along with all of its values.  Eviction, expiry and the
+ * log each deal in one value per key, so are not used with a multimap.  A
+ * deleted key's list is kept, as its key is, until the entry is
+ * squeezed out, so the value aaDelete() returns stays good as long as
+ * it does for any other table.
+ */
+#define	MULTI_INITIAL_VALUES	2
+
+typedef struct ValueList {
+	int nValues;
+	int nAllocated;
+	void *values[];
+} ValueList;
+
+
+/** the bytes each value takes up in a list */
+static size_t valueBytes(const AssociativeArray *aarray)
+{
+	if (aarray->valueSize == 0)
+		return sizeof(void *);
+	return aarray->valueSize;
+}
+
+/** copy a value onto the end of a list with room for it */
+static void storeValue(const AssociativeArray *aarray, ValueList *list, void *value)
+{
+	char *place = (char *) list->values + (size_t) list->nValues * valueBytes(aarray);
+
+	if (aarray->valueSize == 0)
+		memcpy(place, &value, sizeof(void *));
+	else
+		memcpy(place, value, aarray->valueSize);
+	list->nValues++;
+}
+
+/**
+ * Create the list of values for a key new to the table, holding the
+ * one value given
+ *
+ *  @return      the list, or NULL if there was no memory for it
+ */
+void *aaMultiCreate(AssociativeArray *aarray, void *value)
+{
+	ValueList *list;
+
+	list = (ValueList *) aaMalloc(aarray, sizeof(ValueList)
+			+ MULTI_INITIAL_VALUES * valueBytes(aarray));
+	if (list == NULL)
+		return NULL;
+
+	list->nValues = 0;
+	list->nAllocated = MULTI_INITIAL_VALUES;
+	storeValue(aarray, list, value);
+	return list;
+}
+
+/**
+ * Append a value to the list of the key held in pair; the caller holds
+ * the key's lock
+ *
+ *  @return      1 on success, or -1 if the list could not be grown
+ */
+int aaMultiAppend(AssociativeArray *aarray, KeyDataPair *pair, void *value)
+{
+	ValueList *list = (ValueList *) pair->value, *grown;
+	int nAllocated;
+
+	if (list->nValues == list->nAllocated) {
+		nAllocated = list->nAllocated * 2;
+		grown = (ValueList *) aaRealloc(aarray, list, sizeof(ValueList)
+				+ (size_t) nAllocated * valueBytes(aarray));
+		if (grown == NULL)
+			return -1;
+		grown->nAllocated = nAllocated;
+		pair->value = list = grown;
+	}
+
+	storeValue(aarray, list, value);
+	return 1;
+}
+
+/**
+ * the first value of the key held in pair, as aaPairValue() gives it
+ */
+void *aaMultiFirst(const AssociativeArray *aarray, const KeyDataPair *pair)
+{
+	ValueList *list = (ValueList *) pair->value;
+
+	if (aarray->valueSize == 0)
+		return list->values[0];
+	return (void *) list->values;
+}
+
+/**
+ * Check, for a call which would keep a single value for each key, that
+ * the table is not a multimap
+ *
+ *  @return      1 (having said so) if the table is a multimap, else 0
+ */
+int aaRefuseMultimap(AssociativeArray *aarray)
+{
+	if (aarray->multimap) {
+		fprintf(stderr, "Multimap tables hold lists of values, which this cannot keep\n");
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Let keys of the table hold any number of values, each insert of a key
+ * already present adding to its values rather than being refused.  This
+ * must be chosen before anything is inserted.  The inline copy of a
+ * value moves out of the entry into the key's list, so the entries of a
+ * multimap hold only the pair.
+ *
+ *  @return      1 on success, or -1 if the table cannot be a multimap
+ */
+int aaSetMultimap(AssociativeArray *aarray, int enable)
+{
+	KeyDataPair *resized;
+	size_t entrySize;
+
+	if (aaRefuseReadOnly(aarray) || aaRefuseRadix(aarray))
+		return -1;
+	if (aarray->concurrency == AA_CONCURRENCY_SEQLOCK) {
+		fprintf(stderr, "Multimap tables cannot be read without locks\n");
+		return -1;
+	}
+
+	aaLockTable(aarray);
+	if (aarray->nUsed != 0) {
+		aaUnlockTable(aarray);
+		fprintf(stderr, "Multimap mode must be chosen while the table is empty\n");
+		return -1;
+	}
+	if (enable != 0 && (aarray->log != NULL || aarray->cache != NULL
+			|| aarray->expiry != NULL)) {
+		aaUnlockTable(aarray);
+		fprintf(stderr, "Logged, cache mode and expiring tables cannot be multimaps\n");
+		return -1;
+	}
+
+	entrySize = sizeof(KeyDataPair);
+	if (enable == 0)
+		entrySize += (aarray->valueSize + sizeof(void *) - 1)
+				& ~(sizeof(void *) - 1);
+
+	/** the dense entries were allocated for the old entry size */
+	if (entrySize != aarray->entrySize) {
+		resized = (KeyDataPair *) aaRealloc(aarray, aarray->table,
+				aarray->nAllocated * entrySize);
+		if (resized == NULL) {
+			aaUnlockTable(aarray);
+			return -1;
+		}
+		aarray->table = resized;
+		aarray->entrySize = entrySize;
+	}
+	aarray->multimap = (enable != 0);
+	aaUnlockTable(aarray);
+
+	return 1;
+}
+
+/**
+ * Add a value to those of the key, which need not be in the table yet
+ *
+ *  @return      the location of the key within the hash table, or a
+ *				 negative number if the value could not be added
+ */
+int aaAppend(AssociativeArray *aarray, AAKeyType key, size_t keylen, void *value)
+{
+	if ( ! aarray->multimap) {
+		fprintf(stderr, "Only multimap tables can hold more than one value for a key\n");
+		return -1;
+	}
+	return aaInsert(aarray, key, keylen, value);
+}
+
+/**
+ * Find every value of the key with one probe.  The values are handed
+ * back as an array of *nValues elements: the value pointers inserted
+ * for a table of valueSize 0, else the valueSize-byte values one after
+ * another.  The array belongs to the table, and is only good until the
+ * key's values are next changed.
+ *
+ *  @return      the array of values, or NULL (and *nValues of 0) if the
+ *				 key is not in the table
+ */
+void *aaLookupAll(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+		int *nValues)
+{
+	KeyDataPair *pair;
+	ValueList *list;
+	void *values = NULL;
+	int segment;
+
+	*nValues = 0;
+	if ( ! aarray->multimap) {
+		fprintf(stderr, "Only multimap tables can hold more than one value for a key\n");
+		return NULL;
+	}
+
+	/** a frozen table finds the key's slot without probing */
+	if (aarray->perfect != NULL) {
+		pair = aaPerfectFindPair(aarray, key, keylen);
+		if (pair == NULL)
+			return NULL;
+		list = (ValueList *) pair->value;
+		*nValues = list->nValues;
+		return list->values;
+	}
+
+	segment = aaLockKey(aarray, key, keylen);
+	pair = aaFindPair(aarray, key, keylen);
+	if (pair != NULL) {
+		list = (ValueList *) pair->value;
+		*nValues = list->nValues;
+		values = list->values;
+	}
+	aaUnlockKey(aarray, segment);
+
+	return values;
+}
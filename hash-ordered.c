@@ -0,0 +1,666 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "hashtools.h"
+
+/**
+ * The ordered index is a B+-tree over the live keys, kept alongside the
+ * table so that keys can be visited in order, from any starting point,
+ * without looking at the rest.  Keys are ordered byte by byte, with a
+ * key coming before any longer key it begins.
+ *
+ * Each node holds, for each of its keys, the dense offset of the entry
+ * with that key and the key's first 8 bytes packed into an integer, in
+ * an array of their own.  Searching a node compares those integers,
+ * and follows the offset to compare whole keys only when two begin
+ * alike, so most of the search stays within the node's cache lines.
+ * The leaves are chained in key order, which is all a scan walks once
+ * it has found where to start.
+ *
+ * Deleting a key takes it out of its leaf, but never merges nodes: the
+ * separators left in the inner nodes still route correctly, as the keys
+ * they name are not freed until the table is rebuilt.  The rebuild
+ * moves every entry, so the tree is then packed anew from its own
+ * leaves, which are already in order, to ORDERED_FILL keys per node.
+ *
+ * On a striped table, writers on different stripes may change the tree
+ * together, so they take its lock; scans hold the whole table.
+ */
+#define	ORDERED_FANOUT		32
+#define	ORDERED_FILL		(ORDERED_FANOUT * 3 / 4)
+
+typedef struct OrderedNode {
+	int leaf;
+	int nKeys;
+	struct OrderedNode *next;	/* leaves only: the next in key order */
+	uint64_t prefix[ORDERED_FANOUT];
+	int offset[ORDERED_FANOUT];
+	struct OrderedNode *child[];	/* inner nodes only: nKeys + 1 */
+} OrderedNode;
+
+typedef struct OrderedIndex {
+	pthread_mutex_t lock;
+	OrderedNode *root;
+	int incomplete;
+} OrderedIndex;
+
+/** a key on its way into the tree, or being moved to a new one */
+typedef struct OrderedKey {
+	uint64_t prefix;
+	int offset;
+} OrderedKey;
+
+
+/** the first 8 bytes of a key, zero padded, compared as an integer */
+static uint64_t keyPrefix(AAKeyType key, size_t keylen)
+{
+	uint64_t prefix = 0;
+	size_t i;
+
+	for (i = 0; i < 8; i++)
+		prefix = (prefix << 8) | ((i < keylen) ? key[i] : 0);
+	return prefix;
+}
+
+/** order a key against the i'th key of a node */
+static int compareAt(AssociativeArray *aarray, OrderedNode *node, int i,
+		uint64_t prefix, AAKeyType key, size_t keylen)
+{
+	KeyDataPair *pair;
+
+	if (prefix != node->prefix[i])
+		return (prefix < node->prefix[i]) ? -1 : 1;
+	pair = aaEntry(aarray, node->offset[i]);
+	return aaCompareKeys(key, keylen, pair->key, pair->keylen);
+}
+
+/** in an inner node, the child whose keys include this one */
+static int childIndex(AssociativeArray *aarray, OrderedNode *node,
+		uint64_t prefix, AAKeyType key, size_t keylen)
+{
+	int low = 0, high = node->nKeys;
+
+	while (low < high) {
+		int middle = (low + high) / 2;
+
+		if (compareAt(aarray, node, middle, prefix, key, keylen) >= 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+/** in a leaf, the first key at or after this one */
+static int lowerBound(AssociativeArray *aarray, OrderedNode *node,
+		uint64_t prefix, AAKeyType key, size_t keylen)
+{
+	int low = 0, high = node->nKeys;
+
+	while (low < high) {
+		int middle = (low + high) / 2;
+
+		if (compareAt(aarray, node, middle, prefix, key, keylen) > 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+static OrderedNode *newNode(AssociativeArray *aarray, int leaf)
+{
+	size_t size = sizeof(OrderedNode);
+	OrderedNode *node;
+
+	if ( ! leaf)
+		size += (ORDERED_FANOUT + 1) * sizeof(OrderedNode *);
+	node = (OrderedNode *) aaMalloc(aarray, size);
+	if (node != NULL) {
+		node->leaf = leaf;
+		node->nKeys = 0;
+		node->next = NULL;
+	}
+	return node;
+}
+
+static void freeNodes(AssociativeArray *aarray, OrderedNode *node)
+{
+	int i;
+
+	if (node == NULL)
+		return;
+	if ( ! node->leaf) {
+		for (i = 0; i <= node->nKeys; i++)
+			freeNodes(aarray, node->child[i]);
+	}
+	aaFree(aarray, node);
+}
+
+/**
+ * Put a key into the subtree under node.  Should node split, the new
+ * node to its right, and the key separating them, are handed back.
+ *
+ *  @return      1 if node split, 0 if not, or -1 if there was no memory
+ */
+static int insertBelow(AssociativeArray *aarray, OrderedNode *node,
+		OrderedKey *adding, AAKeyType key, size_t keylen,
+		OrderedKey *separator, OrderedNode **right)
+{
+	uint64_t prefixes[ORDERED_FANOUT + 1];
+	int offsets[ORDERED_FANOUT + 1];
+	OrderedNode *children[ORDERED_FANOUT + 2];
+	OrderedNode *childRight = NULL;
+	OrderedKey childSeparator;
+	int position, nKeys, nLeft, i;
+
+	if (node->leaf) {
+		position = lowerBound(aarray, node, adding->prefix, key, keylen);
+		childSeparator = *adding;
+	} else {
+		position = childIndex(aarray, node, adding->prefix, key, keylen);
+		switch (insertBelow(aarray, node->child[position], adding, key, keylen,
+					&childSeparator, &childRight)) {
+		case 0:		return 0;
+		case -1:	return -1;
+		}
+	}
+
+	/** the keys (and children) as they would be with the new one added */
+	nKeys = node->nKeys + 1;
+	for (i = 0; i < nKeys; i++) {
+		int from = (i < position) ? i : i - 1;
+
+		prefixes[i] = (i == position) ? childSeparator.prefix : node->prefix[from];
+		offsets[i] = (i == position) ? childSeparator.offset : node->offset[from];
+	}
+	if ( ! node->leaf) {
+		for (i = 0; i <= nKeys; i++) {
+			int from = (i <= position) ? i : i - 1;
+
+			children[i] = (i == position + 1) ? childRight : node->child[from];
+		}
+	}
+
+	if (nKeys <= ORDERED_FANOUT) {
+		memcpy(node->prefix, prefixes, nKeys * sizeof(uint64_t));
+		memcpy(node->offset, offsets, nKeys * sizeof(int));
+		if ( ! node->leaf)
+			memcpy(node->child, children, (nKeys + 1) * sizeof(OrderedNode *));
+		node->nKeys = nKeys;
+		return 0;
+	}
+
+	/** full: split it in two */
+	*right = newNode(aarray, node->leaf);
+	if (*right == NULL)
+		return -1;
+	nLeft = nKeys / 2;
+
+	if (node->leaf) {
+		/** the right leaf's first key is copied up as the separator */
+		(*right)->nKeys = nKeys - nLeft;
+		memcpy((*right)->prefix, prefixes + nLeft, (*right)->nKeys * sizeof(uint64_t));
+		memcpy((*right)->offset, offsets + nLeft, (*right)->nKeys * sizeof(int));
+		(*right)->next = node->next;
+		node->next = *right;
+	} else {
+		/** the middle key moves up, and is kept in neither half */
+		(*right)->nKeys = nKeys - nLeft - 1;
+		memcpy((*right)->prefix, prefixes + nLeft + 1, (*right)->nKeys * sizeof(uint64_t));
+		memcpy((*right)->offset, offsets + nLeft + 1, (*right)->nKeys * sizeof(int));
+		memcpy((*right)->child, children + nLeft + 1,
+				((*right)->nKeys + 1) * sizeof(OrderedNode *));
+		memcpy(node->child, children, (nLeft + 1) * sizeof(OrderedNode *));
+	}
+	memcpy(node->prefix, prefixes, nLeft * sizeof(uint64_t));
+	memcpy(node->offset, offsets, nLeft * sizeof(int));
+	node->nKeys = nLeft;
+
+	separator->prefix = prefixes[nLeft];
+	separator->offset = offsets[nLeft];
+	return 1;
+}
+
+/** the leaf in which a key is, or would be */
+static OrderedNode *findLeaf(AssociativeArray *aarray, OrderedNode *node,
+		uint64_t prefix, AAKeyType key, size_t keylen)
+{
+	while ( ! node->leaf)
+		node = node->child[childIndex(aarray, node, prefix, key, keylen)];
+	return node;
+}
+
+/** the leaf holding the smallest keys */
+static OrderedNode *firstLeaf(OrderedNode *node)
+{
+	while ( ! node->leaf)
+		node = node->child[0];
+	return node;
+}
+
+/**
+ * Build a tree, ORDERED_FILL keys to a node, from keys already in order
+ *
+ *  @return      the root, or NULL if there was no memory
+ */
+static OrderedNode *buildTree(AssociativeArray *aarray, OrderedKey *keys, int nKeys)
+{
+	OrderedNode **level, *node, *previous = NULL;
+	OrderedKey *firsts;
+	int nNodes, i, j, n;
+
+	nNodes = (nKeys + ORDERED_FILL - 1) / ORDERED_FILL;
+	if (nNodes == 0)
+		return newNode(aarray, 1);
+
+	level = (OrderedNode **) aaMalloc(aarray, nNodes * sizeof(OrderedNode *));
+	firsts = (OrderedKey *) aaMalloc(aarray, nNodes * sizeof(OrderedKey));
+	if (level == NULL || firsts == NULL)
+		goto fail;
+
+	/** the leaves */
+	for (i = 0; i < nNodes; i++) {
+		node = level[i] = newNode(aarray, 1);
+		if (node == NULL) {
+			nNodes = i;
+			goto fail;
+		}
+		for (j = i * ORDERED_FILL; j < nKeys && node->nKeys < ORDERED_FILL; j++) {
+			node->prefix[node->nKeys] = keys[j].prefix;
+			node->offset[node->nKeys++] = keys[j].offset;
+		}
+		firsts[i] = keys[i * ORDERED_FILL];
+		if (previous != NULL)
+			previous->next = node;
+		previous = node;
+	}
+
+	/** then each level of inner nodes over the one below */
+	while (nNodes > 1) {
+		for (i = 0, n = 0; i < nNodes; n++) {
+			node = newNode(aarray, 0);
+			if (node == NULL) {
+				while (i < nNodes)
+					freeNodes(aarray, level[i++]);
+				nNodes = n;
+				goto fail;
+			}
+			node->child[0] = level[i];
+			firsts[n] = firsts[i];
+			for (i++; i < nNodes && node->nKeys < ORDERED_FILL; i++) {
+				node->prefix[node->nKeys] = firsts[i].prefix;
+				node->offset[node->nKeys++] = firsts[i].offset;
+				node->child[node->nKeys] = level[i];
+			}
+			level[n] = node;
+		}
+		nNodes = n;
+	}
+
+	node = level[0];
+	aaFree(aarray, level);
+	aaFree(aarray, firsts);
+	return node;
+
+fail:
+	if (level != NULL) {
+		for (i = 0; i < nNodes; i++)
+			freeNodes(aarray, level[i]);
+	}
+	aaFree(aarray, level);
+	aaFree(aarray, firsts);
+	return NULL;
+}
+
+/** qsort(3) order for the entries of a table, by key */
+static int compareEntries(const void *a, const void *b)
+{
+	const KeyDataPair *left = *(const KeyDataPair * const *) a;
+	const KeyDataPair *right = *(const KeyDataPair * const *) b;
+
+	return aaCompareKeys(left->key, left->keylen, right->key, right->keylen);
+}
+
+/**
+ * Build the tree over the live entries of a table, by sorting them
+ *
+ *  @return      the root, or NULL if there was no memory
+ */
+static OrderedNode *buildFromEntries(AssociativeArray *aarray)
+{
+	KeyDataPair **sorted;
+	OrderedKey *keys;
+	OrderedNode *root = NULL;
+	int i, nKeys = 0;
+
+	sorted = (KeyDataPair **) aaMalloc(aarray, (aarray->nUsed + 1) * sizeof(KeyDataPair *));
+	keys = (OrderedKey *) aaMalloc(aarray, (aarray->nUsed + 1) * sizeof(OrderedKey));
+	if (sorted != NULL && keys != NULL) {
+		for (i = 0; i < aarray->nUsed; i++) {
+			if (aaEntry(aarray, i)->validity == HASH_USED)
+				sorted[nKeys++] = aaEntry(aarray, i);
+		}
+		qsort(sorted, nKeys, sizeof(KeyDataPair *), compareEntries);
+
+		for (i = 0; i < nKeys; i++) {
+			keys[i].prefix = keyPrefix(sorted[i]->key, sorted[i]->keylen);
+			keys[i].offset = (int) (((char *) sorted[i] - (char *) aarray->table)
+					/ aarray->entrySize);
+		}
+		root = buildTree(aarray, keys, nKeys);
+	}
+	aaFree(aarray, sorted);
+	aaFree(aarray, keys);
+	return root;
+}
+
+/**
+ * Add the entry at offset to the ordered index, if the table has one;
+ * called by an insert, with the key's lock held
+ */
+void aaOrderedAdd(AssociativeArray *aarray, AAKeyType key, size_t keylen, int offset)
+{
+	OrderedIndex *index = aarray->ordered;
+	OrderedNode *right, *root;
+	OrderedKey adding, separator;
+	int split;
+
+	if (index == NULL)
+		return;
+
+	adding.prefix = keyPrefix(key, keylen);
+	adding.offset = offset;
+
+	if (aarray->concurrency == AA_CONCURRENCY_STRIPED)
+		pthread_mutex_lock(&index->lock);
+
+	split = insertBelow(aarray, index->root, &adding, key, keylen, &separator, &right);
+	if (split > 0) {
+		root = newNode(aarray, 0);
+		if (root == NULL) {
+			split = -1;
+		} else {
+			root->nKeys = 1;
+			root->prefix[0] = separator.prefix;
+			root->offset[0] = separator.offset;
+			root->child[0] = index->root;
+			root->child[1] = right;
+			index->root = root;
+		}
+	}
+
+	/** a key left out must not be missed: the tree is built afresh before use */
+	if (split < 0 && ! index->incomplete) {
+		fprintf(stderr, "No memory to add a key to the ordered index\n");
+		index->incomplete = 1;
+	}
+
+	if (aarray->concurrency == AA_CONCURRENCY_STRIPED)
+		pthread_mutex_unlock(&index->lock);
+}
+
+/**
+ * Take a pair about to be deleted out of the ordered index, if the table
+ * has one; called with the key's lock, or the table's, held
+ */
+void aaOrderedRemove(AssociativeArray *aarray, KeyDataPair *pair)
+{
+	OrderedIndex *index = aarray->ordered;
+	OrderedNode *leaf;
+	uint64_t prefix;
+	int offset, i;
+
+	if (index == NULL)
+		return;
+
+	prefix = keyPrefix(pair->key, pair->keylen);
+	offset = (int) (((char *) pair - (char *) aarray->table) / aarray->entrySize);
+
+	if (aarray->concurrency == AA_CONCURRENCY_STRIPED)
+		pthread_mutex_lock(&index->lock);
+
+	leaf = findLeaf(aarray, index->root, prefix, pair->key, pair->keylen);
+	for (i = lowerBound(aarray, leaf, prefix, pair->key, pair->keylen);
+			i < leaf->nKeys; i++) {
+		if (leaf->offset[i] == offset) {
+			memmove(leaf->prefix + i, leaf->prefix + i + 1,
+					(leaf->nKeys - i - 1) * sizeof(uint64_t));
+			memmove(leaf->offset + i, leaf->offset + i + 1,
+					(leaf->nKeys - i - 1) * sizeof(int));
+			leaf->nKeys--;
+			break;
+		}
+		if (compareAt(aarray, leaf, i, prefix, pair->key, pair->keylen) != 0)
+			break;
+	}
+
+	if (aarray->concurrency == AA_CONCURRENCY_STRIPED)
+		pthread_mutex_unlock(&index->lock);
+}
+
+/**
+ * Make the tree for a table being rebuilt, whose live entries keep their
+ * order but are squeezed together.  Called with the table locked, once
+ * the entries have been moved, and before the new header is swapped in.
+ *
+ *  @param  rebuilt  the new header; its ordered index is set on success
+ *  @return      1 on success, or -1 if there was no memory for it
+ */
+int aaOrderedRebuilt(AssociativeArray *aarray, AssociativeArray *rebuilt,
+		char *oldTable, int oldUsed)
+{
+	OrderedIndex *index = aarray->ordered;
+	OrderedNode *leaf, *root;
+	OrderedKey *keys = NULL;
+	int *moved;
+	int i, nKeys = 0;
+
+	if (index == NULL)
+		return 1;
+
+	if (index->incomplete) {
+		root = buildFromEntries(rebuilt);
+	} else {
+		/** where each old entry went: after every live one before it */
+		moved = (int *) aaMalloc(aarray, (oldUsed + 1) * sizeof(int));
+		keys = (OrderedKey *) aaMalloc(aarray, (rebuilt->nUsed + 1) * sizeof(OrderedKey));
+		if (moved == NULL || keys == NULL) {
+			aaFree(aarray, moved);
+			aaFree(aarray, keys);
+			return -1;
+		}
+		for (i = 0; i < oldUsed; i++) {
+			KeyDataPair *pair = (KeyDataPair *) (oldTable + i * aarray->entrySize);
+
+			moved[i] = (pair->validity == HASH_USED) ? nKeys++ : -1;
+		}
+
+		nKeys = 0;
+		for (leaf = firstLeaf(index->root); leaf != NULL;
+				leaf = leaf->next) {
+			for (i = 0; i < leaf->nKeys; i++) {
+				if (moved[leaf->offset[i]] < 0)
+					continue;
+				keys[nKeys].prefix = leaf->prefix[i];
+				keys[nKeys++].offset = moved[leaf->offset[i]];
+			}
+		}
+		root = buildTree(aarray, keys, nKeys);
+		aaFree(aarray, moved);
+		aaFree(aarray, keys);
+	}
+
+	if (root == NULL)
+		return -1;
+
+	freeNodes(aarray, index->root);
+	index->root = root;
+	index->incomplete = 0;
+	return 1;
+}
+
+/**
+ * Visit the live keys in order from the first at or after from (or the
+ * very first, if from is NULL), for as long as inRange says they are
+ */
+static int scanFrom(AssociativeArray *aarray, AAKeyType from, size_t fromlen,
+		int (*inRange)(AAKeyType key, size_t keylen, AAKeyType bound, size_t boundlen),
+		AAKeyType bound, size_t boundlen,
+		int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *userdata),
+		void *userdata)
+{
+	OrderedIndex *index = aarray->ordered;
+	OrderedNode *leaf, *root;
+	uint64_t prefix;
+	int i, result = 1;
+
+	/** a radix tree keeps its keys in order already */
+	if (aarray->radix != NULL)
+		return aaRadixScan(aarray, from, fromlen, inRange, bound, boundlen,
+				userfunction, userdata);
+
+	if (index == NULL) {
+		fprintf(stderr, "Table has no ordered index\n");
+		return -1;
+	}
+
+	aaLockTable(aarray);
+
+	/** keys left out for want of memory must not be missed */
+	if (index->incomplete) {
+		root = buildFromEntries(aarray);
+		if (root == NULL) {
+			aaUnlockTable(aarray);
+			fprintf(stderr, "No memory to complete the ordered index\n");
+			return -1;
+		}
+		freeNodes(aarray, index->root);
+		index->root = root;
+		index->incomplete = 0;
+	}
+
+	if (from == NULL) {
+		from = (AAKeyType) "";
+		fromlen = 0;
+	}
+	prefix = keyPrefix(from, fromlen);
+	leaf = findLeaf(aarray, index->root, prefix, from, fromlen);
+	i = lowerBound(aarray, leaf, prefix, from, fromlen);
+
+	for (; leaf != NULL; leaf = leaf->next, i = 0) {
+		for (; i < leaf->nKeys; i++) {
+			KeyDataPair *pair = aaEntry(aarray, leaf->offset[i]);
+
+			if ( ! (*inRange)(pair->key, pair->keylen, bound, boundlen))
+				goto done;
+			if ( ! aaPairLive(aarray, pair))
+				continue;
+			if ((*userfunction)(pair->key, pair->keylen,
+					aaPairValue(aarray, pair), userdata) < 0) {
+				result = -1;
+				goto done;
+			}
+		}
+	}
+
+done:
+	aaUnlockTable(aarray);
+	return result;
+}
+
+static int atOrBefore(AAKeyType key, size_t keylen, AAKeyType bound, size_t boundlen)
+{
+	return bound == NULL || aaCompareKeys(key, keylen, bound, boundlen) <= 0;
+}
+
+static int beginsWith(AAKeyType key, size_t keylen, AAKeyType bound, size_t boundlen)
+{
+	return keylen >= boundlen && memcmp(key, bound, boundlen) == 0;
+}
+
+/**
+ * Call userfunction, in key order, on each key from lo to hi inclusive;
+ * a NULL lo or hi leaves that end open.  As with aaIterateAction(),
+ * writers are held off meanwhile, and userfunction returning less than
+ * 0 ends the scan.
+ *
+ *  @return      1 on success, or -1 if the scan was ended early or the
+ *				 table has no ordered index
+ */
+int aaRangeScan(AssociativeArray *aarray, AAKeyType lo, size_t lolen,
+		AAKeyType hi, size_t hilen,
+		int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *userdata),
+		void *userdata)
+{
+	return scanFrom(aarray, lo, lolen, atOrBefore, hi, hilen, userfunction, userdata);
+}
+
+/**
+ * As aaRangeScan(), for the keys beginning with prefix
+ */
+int aaPrefixScan(AssociativeArray *aarray, AAKeyType prefix, size_t prefixlen,
+		int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *userdata),
+		void *userdata)
+{
+	return scanFrom(aarray, prefix, prefixlen, beginsWith, prefix, prefixlen,
+			userfunction, userdata);
+}
+
+/**
+ * Keep (if enable) an ordered index of the keys alongside the table,
+ * for aaRangeScan() and aaPrefixScan() to use; it is built from the keys
+ * already there.  Each insert and delete then also updates the index,
+ * in O(log n).  An enable of 0 removes it.
+ *
+ *  @return      1 on success, or -1 if there was no memory for it
+ */
+int aaSetOrderedIndex(AssociativeArray *aarray, int enable)
+{
+	OrderedIndex *index = NULL, *oldIndex;
+
+	if (aaRefuseReadOnly(aarray))
+		return -1;
+	if (aarray->radix != NULL)
+		return 1;
+
+	aaLockTable(aarray);
+	oldIndex = aarray->ordered;
+	if (enable && oldIndex != NULL) {
+		aaUnlockTable(aarray);
+		return 1;
+	}
+
+	if (enable) {
+		index = (OrderedIndex *) aaMalloc(aarray, sizeof(OrderedIndex));
+		if (index == NULL || (index->root = buildFromEntries(aarray)) == NULL) {
+			aaFree(aarray, index);
+			aaUnlockTable(aarray);
+			return -1;
+		}
+		pthread_mutex_init(&index->lock, NULL);
+		index->incomplete = 0;
+	}
+	aarray->ordered = index;
+	aaUnlockTable(aarray);
+
+	if (oldIndex != NULL)
+		aaFreeOrdered(aarray, oldIndex);
+	return 1;
+}
+
+/**
+ * Free an ordered index; called when the table is deleted
+ */
+void aaFreeOrdered(AssociativeArray *aarray, struct OrderedIndex *index)
+{
+	if (index == NULL)
+		return;
+
+	freeNodes(aarray, index->root);
+	pthread_mutex_destroy(&index->lock);
+	aaFree(aarray, index);
+}
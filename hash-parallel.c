@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "hashtools.h"
+
+/** number of dense entries a thread claims at a time */
+#define	PARALLEL_CHUNK	4096
+
+/**
+ * State shared by all of the threads working through one call to
+ * aaParallelIterate().  Each worker claims the next chunk of the dense
+ * entries by bumping nextChunk, so fast threads simply do more chunks.
+ */
+typedef struct ParallelIteration {
+	AssociativeArray *aarray;
+	int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *threaddata);
+	int nChunks;
+	int nextChunk;
+	int failed;
+} ParallelIteration;
+
+typedef struct ParallelWorker {
+	ParallelIteration *shared;
+	void *threaddata;
+	pthread_t thread;
+	int started;
+} ParallelWorker;
+
+/**
+ * Body of each worker: claim chunks until there are none left, or
+ * until some thread's user function has asked us to stop
+ */
+static void *
+parallelWorker(void *arg)
+{
+	ParallelWorker *worker = (ParallelWorker *) arg;
+	ParallelIteration *shared = worker->shared;
+	AssociativeArray *aarray = shared->aarray;
+	int chunk, i, end;
+
+	while ( ! __atomic_load_n(&shared->failed, __ATOMIC_RELAXED)) {
+		chunk = __atomic_fetch_add(&shared->nextChunk, 1, __ATOMIC_RELAXED);
+		if (chunk >= shared->nChunks)
+			break;
+
+		end = (chunk + 1) * PARALLEL_CHUNK;
+		if (end > aarray->nUsed)
+			end = aarray->nUsed;
+
+		for (i = chunk * PARALLEL_CHUNK; i < end; i++) {
+			KeyDataPair *pair = aaEntry(aarray, i);
+
+			if ( ! aaPairLive(aarray, pair))
+				continue;
+			if ((*shared->userfunction)(
+					pair->key,
+					pair->keylen,
+					aaPairValue(aarray, pair),
+					worker->threaddata) < 0) {
+				__atomic_store_n(&shared->failed, 1, __ATOMIC_RELAXED);
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Iterate over the array using nThreads threads (the calling thread
+ * being one of them), calling the user function on each valid value.
+ *
+ * The user function is passed threaddata[t] when run by thread t, so
+ * each thread can accumulate into its own state without locking; if
+ * threaddata is NULL, userdata is passed to every call instead and must
+ * be safe to share.  Once all threads have finished, reduce (if given)
+ * is called from the calling thread on each threaddata[t] in turn.
+ *
+ * Writers are held off on a shared table until the iteration is done.
+ *
+ *  @return      1 on success, or -1 if any call to the user function
+ *				 or to reduce returned a negative value
+ */
+int aaParallelIterate(
+		AssociativeArray *aarray,
+		int nThreads,
+		int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *threaddata),
+		void **threaddata,
+		int (*reduce)(void *threaddata, void *userdata),
+		void *userdata
+	)
+{
+	ParallelIteration shared;
+	ParallelWorker *workers;
+	int nWorkers, i, result = 1;
+
+	if (nThreads < 1)
+		nThreads = 1;
+
+	/**
+	 * a table mapped from a file, or kept as a radix tree, is walked by
+	 * the calling thread alone
+	 */
+	if (aarray->mapped != NULL || aarray->radix != NULL) {
+		result = aaIterateAction(aarray, userfunction,
+				(threaddata != NULL) ? threaddata[0] : userdata);
+		for (i = 0; reduce != NULL && threaddata != NULL && i < nThreads; i++) {
+			if ((*reduce)(threaddata[i], userdata) < 0)
+				result = -1;
+		}
+		return result;
+	}
+
+	aaLockTable(aarray);
+
+	shared.aarray = aarray;
+	shared.userfunction = userfunction;
+	shared.nChunks = (aarray->nUsed + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK;
+	shared.nextChunk = 0;
+	shared.failed = 0;
+
+	/**
+	 * no point starting more threads than there are chunks, though
+	 * every one of the caller's threaddata is still reduced
+	 */
+	nWorkers = nThreads;
+	if (nWorkers > shared.nChunks && shared.nChunks > 0)
+		nWorkers = shared.nChunks;
+
+	workers = (ParallelWorker *) aaMalloc(aarray, nWorkers * sizeof(ParallelWorker));
+	if (workers == NULL) {
+		aaUnlockTable(aarray);
+		return -1;
+	}
+
+	for (i = 0; i < nWorkers; i++) {
+		workers[i].shared = &shared;
+		workers[i].threaddata = (threaddata != NULL) ? threaddata[i] : userdata;
+		workers[i].started = 0;
+	}
+
+	/**
+	 * worker 0 is the calling thread; if a thread cannot be started
+	 * the remaining workers just pick up its share of the chunks
+	 */
+	for (i = 1; i < nWorkers; i++) {
+		if (pthread_create(&workers[i].thread, NULL,
+					parallelWorker, &workers[i]) == 0) {
+			workers[i].started = 1;
+		}
+	}
+	parallelWorker(&workers[0]);
+
+	for (i = 1; i < nWorkers; i++) {
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+	}
+	aaUnlockTable(aarray);
+
+	if (shared.failed)
+		result = -1;
+
+	if (reduce != NULL && threaddata != NULL) {
+		for (i = 0; i < nThreads; i++) {
+			if ((*reduce)(threaddata[i], userdata) < 0)
+				result = -1;
+		}
+	}
+
+	aaFree(aarray, workers);
+	return result;
+}
@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "hashtools.h"
+
+/**
+ * A frozen table is indexed by a minimal perfect hash, built in the
+ * style of PTHash: the keys are split into buckets of about
+ * PERFECT_BUCKET_KEYS each, and every bucket is given the first seed
+ * that sends all of its keys to slots no other key has taken.  Buckets
+ * are placed largest first, while there are still plenty of free slots.
+ *
+ * So that the last buckets placed are not left hunting for the last few
+ * free slots, the keys are placed among PERFECT_SPARE more slots than
+ * there are keys.  Any key landing beyond the end of the index is then
+ * sent, by the remap array, to one of the slots left free within it.
+ * The index has exactly one slot per key, each holding the offset of
+ * its entry just as for an ordinary table.
+ *
+ * The seeds take 16 bits per bucket, so about 3 bits per key, and the
+ * remap array about 1 more.
+ */
+#define	PERFECT_BUCKET_KEYS	5
+#define	PERFECT_SPARE(n)	((n) / 32 + 1)
+#define	PERFECT_MAX_SEED	0xffff
+
+/** salts tried before giving up on building the hash at all */
+#define	PERFECT_ATTEMPTS	8
+
+typedef struct PerfectHash {
+	uint64_t salt;
+	int nKeys;
+	int nBuckets;
+	int nPlaces;
+	uint16_t *seeds;
+	int *remap;
+} PerfectHash;
+
+/** the order in which the buckets are placed */
+typedef struct PerfectBucket {
+	int bucket;
+	int nKeys;
+	int first;
+} PerfectBucket;
+
+
+static int bucketOf(PerfectHash *perfect, uint64_t hash)
+{
+	return (int) ((hash >> 32) % perfect->nBuckets);
+}
+
+/** where a key lands among the nPlaces slots, given its bucket's seed */
+static int placeOf(PerfectHash *perfect, uint64_t hash, int seed)
+{
+	return (int) (aaMix64(hash ^ ((uint64_t) seed * 0x9e3779b97f4a7c15ULL))
+			% perfect->nPlaces);
+}
+
+static int compareBuckets(const void *a, const void *b)
+{
+	const PerfectBucket *left = (const PerfectBucket *) a;
+	const PerfectBucket *right = (const PerfectBucket *) b;
+
+	if (left->nKeys != right->nKeys)
+		return right->nKeys - left->nKeys;
+	return left->bucket - right->bucket;
+}
+
+/**
+ * Find a seed for one bucket whose keys all land on untaken places,
+ * and take them
+ *
+ *  @return      1 on success, or 0 if no seed will do
+ */
+static int placeBucket(PerfectHash *perfect, PerfectBucket *bucket,
+		uint64_t *hashes, int *members, char *taken, int *places)
+{
+	int seed, i, j;
+
+	for (seed = 0; seed <= PERFECT_MAX_SEED; seed++) {
+		for (i = 0; i < bucket->nKeys; i++) {
+			places[i] = placeOf(perfect, hashes[members[bucket->first + i]], seed);
+			if (taken[places[i]])
+				break;
+			for (j = 0; j < i; j++) {
+				if (places[j] == places[i])
+					break;
+			}
+			if (j < i)
+				break;
+		}
+		if (i == bucket->nKeys) {
+			for (i = 0; i < bucket->nKeys; i++)
+				taken[places[i]] = 1;
+			perfect->seeds[bucket->bucket] = (uint16_t) seed;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/** zeroed memory from the table's allocator, as calloc(3) gives */
+static void *allocZeroed(AssociativeArray *aarray, size_t bytes)
+{
+	void *memory = aaMalloc(aarray, bytes);
+
+	if (memory != NULL)
+		memset(memory, 0, bytes);
+	return memory;
+}
+
+/**
+ * Try to find seeds for every bucket, under the salt already set
+ *
+ *  @return      1 on success, 0 if some bucket could not be placed, or
+ *				 -1 if memory ran out
+ */
+static int buildSeeds(PerfectHash *perfect, AssociativeArray *aarray,
+		uint64_t *hashes, char *taken)
+{
+	PerfectBucket *order;
+	int *members, *fill, places[64];
+	int i, b, result = 1;
+
+	order = (PerfectBucket *) allocZeroed(aarray, perfect->nBuckets * sizeof(PerfectBucket));
+	members = (int *) aaMalloc(aarray, perfect->nKeys * sizeof(int));
+	fill = (int *) allocZeroed(aarray, perfect->nBuckets * sizeof(int));
+	if (order == NULL || members == NULL || fill == NULL) {
+		result = -1;
+		goto done;
+	}
+
+	for (i = 0; i < perfect->nKeys; i++) {
+		KeyDataPair *pair = aaEntry(aarray, i);
+
+		hashes[i] = aaKeyHash64(pair->key, pair->keylen, perfect->salt);
+		order[bucketOf(perfect, hashes[i])].nKeys++;
+	}
+
+	/** lay out the members of each bucket side by side */
+	for (b = 0, i = 0; b < perfect->nBuckets; b++) {
+		order[b].bucket = b;
+		order[b].first = i;
+		fill[b] = i;
+		i += order[b].nKeys;
+		if (order[b].nKeys > (int) (sizeof(places) / sizeof(places[0])))
+			result = 0;
+	}
+	for (i = 0; i < perfect->nKeys; i++)
+		members[fill[bucketOf(perfect, hashes[i])]++] = i;
+
+	qsort(order, perfect->nBuckets, sizeof(PerfectBucket), compareBuckets);
+
+	memset(taken, 0, perfect->nPlaces);
+	for (b = 0; result > 0 && b < perfect->nBuckets && order[b].nKeys > 0; b++)
+		result = placeBucket(perfect, &order[b], hashes, members, taken, places);
+
+done:
+	aaFree(aarray, order);
+	aaFree(aarray, members);
+	aaFree(aarray, fill);
+	return result;
+}
+
+/**
+ * Point every key beyond the end of the index at one of the slots
+ * left free within it; there are exactly as many of one as the other
+ */
+static void buildRemap(PerfectHash *perfect, char *taken)
+{
+	int place, hole = 0;
+
+	for (place = perfect->nKeys; place < perfect->nPlaces; place++) {
+		if ( ! taken[place])
+			continue;
+		while (taken[hole])
+			hole++;
+		perfect->remap[place - perfect->nKeys] = hole++;
+	}
+}
+
+/** the index slot of a key, from its hash */
+static int perfectSlot(PerfectHash *perfect, uint64_t hash)
+{
+	int place = placeOf(perfect, hash, perfect->seeds[bucketOf(perfect, hash)]);
+
+	if (place >= perfect->nKeys)
+		place = perfect->remap[place - perfect->nKeys];
+	return place;
+}
+
+
+/**
+ * Freeze the table: squeeze out its deleted entries, and replace its
+ * index with one of exactly one slot per key, addressed by a minimal
+ * perfect hash of the keys.  Each aaLookup() then hashes the key once,
+ * looks at the one slot, and compares the one key found there.
+ *
+ * A frozen table is read-only, as no key can be added to the hash
+ * without building it again, and cannot be shared between threads.
+ *
+ *  @return      1 on success, or -1 if the hash could not be built, in
+ *				 which case the table is left unfrozen
+ */
+int aaFreezePerfect(AssociativeArray *aarray)
+{
+	AssociativeArray frozen;
+	PerfectHash *perfect;
+	uint64_t *hashes = NULL;
+	char *taken = NULL;
+	void *oldIndex;
+	int i, attempt, built = 0;
+
+	if (aaRefuseReadOnly(aarray) || aaRefuseRadix(aarray))
+		return -1;
+	if (aarray->concurrency != AA_CONCURRENCY_NONE) {
+		fprintf(stderr, "Shared tables cannot be frozen\n");
+		return -1;
+	}
+
+	/** rebuilding at the same size drops the deleted entries */
+	if (aarray->nUsed != aarray->nEntries
+			&& aaResize(aarray, aarray->size) < 0)
+		return -1;
+
+	perfect = (PerfectHash *) allocZeroed(aarray, sizeof(PerfectHash));
+	if (perfect == NULL)
+		return -1;
+	perfect->nKeys = aarray->nUsed;
+	perfect->nBuckets = perfect->nKeys / PERFECT_BUCKET_KEYS + 1;
+	perfect->nPlaces = perfect->nKeys + PERFECT_SPARE(perfect->nKeys);
+	perfect->seeds = (uint16_t *) allocZeroed(aarray, perfect->nBuckets * sizeof(uint16_t));
+	perfect->remap = (int *) allocZeroed(aarray, PERFECT_SPARE(perfect->nKeys) * sizeof(int));
+	hashes = (uint64_t *) aaMalloc(aarray, (perfect->nKeys + 1) * sizeof(uint64_t));
+	taken = (char *) aaMalloc(aarray, perfect->nPlaces);
+
+	for (attempt = 0; attempt < PERFECT_ATTEMPTS && built == 0; attempt++) {
+		if (perfect->seeds == NULL || perfect->remap == NULL
+				|| hashes == NULL || taken == NULL)
+			break;
+		perfect->salt = aaMix64(attempt + 1);
+		built = buildSeeds(perfect, aarray, hashes, taken);
+	}
+
+	/** an index of one slot per key, filled in off to the side */
+	frozen = *aarray;
+	frozen.size = (perfect->nKeys > 0) ? perfect->nKeys : 1;
+	frozen.indexWidth = aaIndexWidthForSize(frozen.size);
+	frozen.index = NULL;
+	if (built > 0)
+		frozen.index = aaAllocIndex(aarray, (size_t) frozen.size * frozen.indexWidth);
+
+	if (frozen.index == NULL) {
+		fprintf(stderr, "Cannot build a perfect hash of %d keys\n", perfect->nKeys);
+		aaFree(aarray, perfect->seeds);
+		aaFree(aarray, perfect->remap);
+		aaFree(aarray, perfect);
+		aaFree(aarray, hashes);
+		aaFree(aarray, taken);
+		return -1;
+	}
+
+	buildRemap(perfect, taken);
+	for (i = 0; i < perfect->nKeys; i++)
+		aaIndexSet(&frozen, perfectSlot(perfect, hashes[i]), i);
+	aaFree(aarray, hashes);
+	aaFree(aarray, taken);
+
+	oldIndex = aarray->index;
+	aarray->index = frozen.index;
+	aarray->indexWidth = frozen.indexWidth;
+	aarray->size = frozen.size;
+	aarray->perfect = perfect;
+	aarray->generation++;
+	aaFreeIndex(aarray, oldIndex);
+
+	/** a frozen table's lookups never probe, so have nothing to filter */
+	aaFreeIndex(aarray, aarray->bloom);
+	aarray->bloom = NULL;
+	aarray->bloomBitsPerKey = 0;
+	aaFreeIndex(aarray, aarray->cuckoo);
+	aarray->cuckoo = NULL;
+	aarray->cuckooBits = 0;
+	aaFreeIndex(aarray, aarray->front);
+	aarray->front = NULL;
+
+	return 1;
+}
+
+/**
+ * The pair holding the key in a frozen table, found in the one slot
+ * the key can be in, or NULL if it is not there.  A frozen table is
+ * read-only, so an expired entry is passed over rather than reaped.
+ */
+KeyDataPair *aaPerfectFindPair(AssociativeArray *aarray, AAKeyType key, size_t keylen)
+{
+	PerfectHash *perfect = aarray->perfect;
+	KeyDataPair *pair;
+
+	if (perfect->nKeys == 0)
+		return NULL;
+
+	aarray->searchCost++;
+	pair = aaSlotPair(aarray,
+			perfectSlot(perfect, aaKeyHash64(key, keylen, perfect->salt)));
+	if (pair == NULL || ! doKeysMatch(pair->key, pair->keylen, key, keylen)
+			|| aaPairExpired(aarray, pair))
+		return NULL;
+	return pair;
+}
+
+/**
+ * aaLookup() for a frozen table
+ */
+void *aaPerfectLookup(AssociativeArray *aarray, AAKeyType key, size_t keylen)
+{
+	KeyDataPair *pair = aaPerfectFindPair(aarray, key, keylen);
+
+	if (pair == NULL)
+		return NULL;
+	return aaPairValue(aarray, pair);
+}
+
+/**
+ * Free the perfect hash of a frozen table; called when it is deleted
+ */
+void aaFreePerfect(AssociativeArray *aarray)
+{
+	PerfectHash *perfect = aarray->perfect;
+
+	if (perfect == NULL)
+		return;
+
+	aaFree(aarray, perfect->seeds);
+	aaFree(aarray, perfect->remap);
+	aaFree(aarray, perfect);
+	aarray->perfect = NULL;
+}
@@ -0,0 +1,997 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "hashtools.h"
+
+/**
+ * A table created with the "art" strategy keeps its keys in an adaptive
+ * radix tree (Leis et al.) rather than hashing them.  Each inner node
+ * branches on one byte of the key, and comes in four sizes -- for up to
+ * 4, 16, 48 or 256 children -- growing and shrinking as children come
+ * and go, so that the memory taken follows how the keys spread out
+ * rather than how many slots were asked for.
+ *
+ * Runs of bytes shared by every key below a node are kept in the node
+ * as its prefix, rather than as a chain of one-child nodes.  Only the
+ * first RADIX_MAX_PREFIX bytes are stored; a lookup skips over the rest
+ * unchecked, and the leaf it reaches is compared whole at the end.  A
+ * key with a single key below it is kept as a leaf in its parent, with
+ * no nodes for the bytes that tell it apart.
+ *
+ * Keys are arbitrary bytes, so one key may begin another.  A key which
+ * ends at a node is kept as the node's terminal leaf, rather than
+ * under a child: it is the smallest key below that node.
+ *
+ * Walking the children in byte order visits the keys in order, which
+ * aaIterateAction(), aaRangeScan() and aaPrefixScan() all do.  A radix
+ * tree table is private to one thread, and has none of the features
+ * which work on the hash slots or dense entries.
+ */
+#define	RADIX_MAX_PREFIX	8
+
+#define	RADIX_NODE4		1
+#define	RADIX_NODE16	2
+#define	RADIX_NODE48	3
+#define	RADIX_NODE256	4
+
+/** children are nodes or leaves; leaves have the low bit of the pointer set */
+#define	IS_LEAF(child)		(((uintptr_t) (child)) & 1)
+#define	AS_LEAF(child)		((RadixLeaf *) ((uintptr_t) (child) & ~(uintptr_t) 1))
+#define	TAG_LEAF(leaf)		((void *) ((uintptr_t) (leaf) | 1))
+
+typedef struct RadixLeaf {
+	size_t keylen;
+	void *value;
+	unsigned char data[];	/* any inline value, padded, then the key */
+} RadixLeaf;
+
+typedef struct RadixNode {
+	uint8_t type;
+	uint16_t nChildren;
+	uint32_t prefixLen;
+	unsigned char prefix[RADIX_MAX_PREFIX];
+	RadixLeaf *terminal;
+} RadixNode;
+
+typedef struct RadixNode4 {
+	RadixNode node;
+	unsigned char keys[4];
+	void *children[4];
+} RadixNode4;
+
+typedef struct RadixNode16 {
+	RadixNode node;
+	unsigned char keys[16];
+	void *children[16];
+} RadixNode16;
+
+/** childIndex holds 1 more than the child's position, or 0 for none */
+typedef struct RadixNode48 {
+	RadixNode node;
+	unsigned char childIndex[256];
+	void *children[48];
+} RadixNode48;
+
+typedef struct RadixNode256 {
+	RadixNode node;
+	void *children[256];
+} RadixNode256;
+
+typedef struct RadixTree {
+	void *root;
+	RadixLeaf *deleted;	/* the last leaf deleted, whose value was handed back */
+	int nNodes;
+	size_t nBytes;
+} RadixTree;
+
+/** a scan's test of whether a key is still within what it was asked for */
+typedef int (*RadixInRange)(AAKeyType key, size_t keylen, AAKeyType bound, size_t boundlen);
+
+typedef struct RadixScan {
+	RadixInRange inRange;
+	AAKeyType bound;
+	size_t boundlen;
+	int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *userdata);
+	void *userdata;
+	AssociativeArray *aarray;
+} RadixScan;
+
+/** what a walk tells its caller: carry on, or stop, and why */
+#define	WALK_MORE		0
+#define	WALK_DONE		1
+#define	WALK_STOPPED	(-1)
+
+
+static size_t nodeBytes(int type)
+{
+	switch (type) {
+	case RADIX_NODE4:	return sizeof(RadixNode4);
+	case RADIX_NODE16:	return sizeof(RadixNode16);
+	case RADIX_NODE48:	return sizeof(RadixNode48);
+	}
+	return sizeof(RadixNode256);
+}
+
+/** bytes of a leaf's data taken by an inline value, kept pointer aligned */
+static size_t valueBytes(const AssociativeArray *aarray)
+{
+	return (aarray->valueSize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+}
+
+static unsigned char *leafKey(const AssociativeArray *aarray, RadixLeaf *leaf)
+{
+	return leaf->data + valueBytes(aarray);
+}
+
+static void *leafValue(const AssociativeArray *aarray, RadixLeaf *leaf)
+{
+	if (aarray->valueSize == 0) return leaf->value;
+	return (void *) leaf->data;
+}
+
+static int leafMatches(const AssociativeArray *aarray, RadixLeaf *leaf,
+		AAKeyType key, size_t keylen)
+{
+	return doKeysMatch(leafKey(aarray, leaf), leaf->keylen, key, keylen);
+}
+
+static RadixNode *newNode(AssociativeArray *aarray, int type)
+{
+	RadixTree *tree = aarray->radix;
+	RadixNode *node;
+
+	node = (RadixNode *) aaMalloc(aarray, nodeBytes(type));
+	if (node == NULL)
+		return NULL;
+	memset(node, 0, nodeBytes(type));
+	node->type = type;
+	tree->nNodes++;
+	tree->nBytes += nodeBytes(type);
+	return node;
+}
+
+static void freeNode(AssociativeArray *aarray, RadixNode *node)
+{
+	RadixTree *tree = aarray->radix;
+
+	tree->nNodes--;
+	tree->nBytes -= nodeBytes(node->type);
+	aaFree(aarray, node);
+}
+
+static RadixLeaf *newLeaf(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+		void *value)
+{
+	size_t bytes = sizeof(RadixLeaf) + valueBytes(aarray) + keylen;
+	RadixLeaf *leaf;
+
+	leaf = (RadixLeaf *) aaMalloc(aarray, bytes);
+	if (leaf == NULL)
+		return NULL;
+	leaf->keylen = keylen;
+	if (aarray->valueSize == 0) {
+		leaf->value = value;
+	} else {
+		leaf->value = NULL;
+		memcpy(leaf->data, value, aarray->valueSize);
+	}
+	memcpy(leafKey(aarray, leaf), key, keylen);
+	aarray->radix->nBytes += bytes;
+	return leaf;
+}
+
+static void freeLeaf(AssociativeArray *aarray, RadixLeaf *leaf)
+{
+	aarray->radix->nBytes -= sizeof(RadixLeaf) + valueBytes(aarray) + leaf->keylen;
+	aaFree(aarray, leaf);
+}
+
+/** the slot holding the child for the given byte, or NULL if there is none */
+static void **findChild(RadixNode *node, unsigned char byte)
+{
+	RadixNode4 *node4;
+	RadixNode16 *node16;
+	RadixNode48 *node48;
+	int i;
+
+	switch (node->type) {
+	case RADIX_NODE4:
+		node4 = (RadixNode4 *) node;
+		for (i = 0; i < node->nChildren; i++) {
+			if (node4->keys[i] == byte)
+				return &node4->children[i];
+		}
+		return NULL;
+	case RADIX_NODE16:
+		node16 = (RadixNode16 *) node;
+		for (i = 0; i < node->nChildren; i++) {
+			if (node16->keys[i] == byte)
+				return &node16->children[i];
+		}
+		return NULL;
+	case RADIX_NODE48:
+		node48 = (RadixNode48 *) node;
+		if (node48->childIndex[byte] == 0)
+			return NULL;
+		return &node48->children[node48->childIndex[byte] - 1];
+	}
+	if (((RadixNode256 *) node)->children[byte] == NULL)
+		return NULL;
+	return &((RadixNode256 *) node)->children[byte];
+}
+
+/** the smallest key below a node (or the leaf itself) */
+static RadixLeaf *minimumLeaf(void *child)
+{
+	RadixNode *node;
+	int i;
+
+	while (child != NULL && ! IS_LEAF(child)) {
+		node = (RadixNode *) child;
+		if (node->terminal != NULL)
+			return node->terminal;
+		switch (node->type) {
+		case RADIX_NODE4:
+			child = ((RadixNode4 *) node)->children[0];
+			break;
+		case RADIX_NODE16:
+			child = ((RadixNode16 *) node)->children[0];
+			break;
+		case RADIX_NODE48:
+			for (i = 0; ((RadixNode48 *) node)->childIndex[i] == 0; i++)
+				;
+			child = ((RadixNode48 *) node)->children[
+					((RadixNode48 *) node)->childIndex[i] - 1];
+			break;
+		default:
+			for (i = 0; ((RadixNode256 *) node)->children[i] == NULL; i++)
+				;
+			child = ((RadixNode256 *) node)->children[i];
+			break;
+		}
+	}
+	return (child == NULL) ? NULL : AS_LEAF(child);
+}
+
+/** copy the header of one node into another of a different size */
+static void copyHeader(RadixNode *to, RadixNode *from)
+{
+	to->nChildren = from->nChildren;
+	to->prefixLen = from->prefixLen;
+	memcpy(to->prefix, from->prefix, RADIX_MAX_PREFIX);
+	to->terminal = from->terminal;
+}
+
+/**
+ * Add a child to the node in *ref, which is replaced by a larger node
+ * if it is full
+ *
+ *  @return      1 on success, or -1 if there was no memory
+ */
+static int addChild(AssociativeArray *aarray, void **ref, unsigned char byte, void *child)
+{
+	RadixNode *node = (RadixNode *) *ref, *grown;
+	unsigned char *keys;
+	void **children;
+	int capacity, i;
+
+	if (node->type == RADIX_NODE48) {
+		RadixNode48 *node48 = (RadixNode48 *) node;
+
+		if (node->nChildren < 48) {
+			for (i = 0; node48->children[i] != NULL; i++)
+				;
+			node48->children[i] = child;
+			node48->childIndex[byte] = i + 1;
+			node->nChildren++;
+			return 1;
+		}
+		grown = newNode(aarray, RADIX_NODE256);
+		if (grown == NULL)
+			return -1;
+		copyHeader(grown, node);
+		for (i = 0; i < 256; i++) {
+			if (node48->childIndex[i] != 0)
+				((RadixNode256 *) grown)->children[i] =
+						node48->children[node48->childIndex[i] - 1];
+		}
+		freeNode(aarray, node);
+		*ref = grown;
+		node = grown;
+	}
+
+	if (node->type == RADIX_NODE256) {
+		((RadixNode256 *) node)->children[byte] = child;
+		node->nChildren++;
+		return 1;
+	}
+
+	/** the two small sizes keep their bytes in order */
+	if (node->type == RADIX_NODE4) {
+		keys = ((RadixNode4 *) node)->keys;
+		children = ((RadixNode4 *) node)->children;
+		capacity = 4;
+	} else {
+		keys = ((RadixNode16 *) node)->keys;
+		children = ((RadixNode16 *) node)->children;
+		capacity = 16;
+	}
+
+	if (node->nChildren == capacity) {
+		grown = newNode(aarray, (capacity == 4) ? RADIX_NODE16 : RADIX_NODE48);
+		if (grown == NULL)
+			return -1;
+		copyHeader(grown, node);
+		if (capacity == 4) {
+			memcpy(((RadixNode16 *) grown)->keys, keys, capacity);
+			memcpy(((RadixNode16 *) grown)->children, children,
+					capacity * sizeof(void *));
+		} else {
+			for (i = 0; i < capacity; i++) {
+				((RadixNode48 *) grown)->children[i] = children[i];
+				((RadixNode48 *) grown)->childIndex[keys[i]] = i + 1;
+			}
+		}
+		freeNode(aarray, node);
+		*ref = grown;
+		return addChild(aarray, ref, byte, child);
+	}
+
+	for (i = node->nChildren; i > 0 && keys[i - 1] > byte; i--) {
+		keys[i] = keys[i - 1];
+		children[i] = children[i - 1];
+	}
+	keys[i] = byte;
+	children[i] = child;
+	node->nChildren++;
+	return 1;
+}
+
+/**
+ * Take the child for the given byte out of the node in *ref, which is
+ * replaced by a smaller node once it is sparse enough.  A node left
+ * with a single key below it is replaced by what is below it.
+ */
+static void removeChild(AssociativeArray *aarray, void **ref, unsigned char byte)
+{
+	RadixNode *node = (RadixNode *) *ref, *shrunk;
+	unsigned char *keys;
+	void **children;
+	int i, n;
+
+	switch (node->type) {
+	case RADIX_NODE256: {
+		RadixNode256 *node256 = (RadixNode256 *) node;
+
+		node256->children[byte] = NULL;
+		if (--node->nChildren > 37)
+			return;
+		shrunk = newNode(aarray, RADIX_NODE48);
+		if (shrunk == NULL)
+			return;
+		copyHeader(shrunk, node);
+		for (i = 0, n = 0; i < 256; i++) {
+			if (node256->children[i] != NULL) {
+				((RadixNode48 *) shrunk)->children[n] = node256->children[i];
+				((RadixNode48 *) shrunk)->childIndex[i] = ++n;
+			}
+		}
+		break;
+	}
+	case RADIX_NODE48: {
+		RadixNode48 *node48 = (RadixNode48 *) node;
+
+		node48->children[node48->childIndex[byte] - 1] = NULL;
+		node48->childIndex[byte] = 0;
+		if (--node->nChildren > 12)
+			return;
+		shrunk = newNode(aarray, RADIX_NODE16);
+		if (shrunk == NULL)
+			return;
+		copyHeader(shrunk, node);
+		for (i = 0, n = 0; i < 256; i++) {
+			if (node48->childIndex[i] != 0) {
+				((RadixNode16 *) shrunk)->keys[n] = i;
+				((RadixNode16 *) shrunk)->children[n++] =
+						node48->children[node48->childIndex[i] - 1];
+			}
+		}
+		break;
+	}
+	default:
+		if (node->type == RADIX_NODE4) {
+			keys = ((RadixNode4 *) node)->keys;
+			children = ((RadixNode4 *) node)->children;
+		} else {
+			keys = ((RadixNode16 *) node)->keys;
+			children = ((RadixNode16 *) node)->children;
+		}
+		for (i = 0; keys[i] != byte; i++)
+			;
+		memmove(keys + i, keys + i + 1, node->nChildren - i - 1);
+		memmove(children + i, children + i + 1,
+				(node->nChildren - i - 1) * sizeof(void *));
+		node->nChildren--;
+
+		if (node->type == RADIX_NODE4 || node->nChildren > 3)
+			return;
+		shrunk = newNode(aarray, RADIX_NODE4);
+		if (shrunk == NULL)
+			return;
+		copyHeader(shrunk, node);
+		memcpy(((RadixNode4 *) shrunk)->keys, keys, node->nChildren);
+		memcpy(((RadixNode4 *) shrunk)->children, children,
+				node->nChildren * sizeof(void *));
+		break;
+	}
+
+	freeNode(aarray, node);
+	*ref = shrunk;
+}
+
+/**
+ * Replace the node in *ref by what is below it, if that is now a single
+ * key or a single child: a leaf moves up in its place, while a child
+ * node takes over the node's prefix and byte ahead of its own prefix.
+ */
+static void collapse(AssociativeArray *aarray, void **ref)
+{
+	RadixNode *node = (RadixNode *) *ref, *below;
+	unsigned char prefix[RADIX_MAX_PREFIX];
+	void *child;
+	int n, i;
+
+	if (node->type != RADIX_NODE4)
+		return;
+
+	if (node->nChildren == 0) {
+		*ref = TAG_LEAF(node->terminal);
+	} else if (node->nChildren == 1 && node->terminal == NULL) {
+		child = ((RadixNode4 *) node)->children[0];
+		if ( ! IS_LEAF(child)) {
+			below = (RadixNode *) child;
+			n = (node->prefixLen < RADIX_MAX_PREFIX) ? node->prefixLen : RADIX_MAX_PREFIX;
+			memcpy(prefix, node->prefix, n);
+			if (n < RADIX_MAX_PREFIX)
+				prefix[n++] = ((RadixNode4 *) node)->keys[0];
+			for (i = 0; n < RADIX_MAX_PREFIX && i < (int) below->prefixLen; i++)
+				prefix[n++] = below->prefix[i];
+			below->prefixLen += node->prefixLen + 1;
+			memcpy(below->prefix, prefix, n);
+		}
+		*ref = child;
+	} else {
+		return;
+	}
+	freeNode(aarray, node);
+}
+
+/**
+ * How many bytes of a node's prefix the key has from depth on.  Beyond
+ * the bytes the node keeps, the rest of the prefix is read from a key
+ * below it.
+ */
+static size_t prefixMismatch(AssociativeArray *aarray, RadixNode *node,
+		AAKeyType key, size_t keylen, size_t depth)
+{
+	size_t limit = keylen - depth, i;
+	RadixLeaf *leaf;
+	unsigned char *leafBytes;
+
+	if (limit > node->prefixLen)
+		limit = node->prefixLen;
+	for (i = 0; i < limit && i < RADIX_MAX_PREFIX; i++) {
+		if (node->prefix[i] != key[depth + i])
+			return i;
+	}
+	if (i < limit) {
+		leaf = minimumLeaf(node);
+		leafBytes = leafKey(aarray, leaf);
+		for (; i < limit; i++) {
+			if (leafBytes[depth + i] != key[depth + i])
+				return i;
+		}
+	}
+	return i;
+}
+
+/**
+ * Put a new leaf where *ref is, at the given depth of its key
+ *
+ *  @return      1 on success, 0 if the key is already there, or -1 if
+ *				 there was no memory
+ */
+static int insertAt(AssociativeArray *aarray, void **ref, RadixLeaf *adding,
+		size_t depth)
+{
+	AAKeyType key = leafKey(aarray, adding);
+	size_t keylen = adding->keylen;
+	RadixNode *node, *split;
+	RadixLeaf *leaf;
+	unsigned char *leafBytes;
+	size_t common, n;
+	void **slot;
+
+	for (;;) {
+		aarray->insertCost++;
+
+		if (*ref == NULL) {
+			*ref = TAG_LEAF(adding);
+			return 1;
+		}
+
+		/** a leaf in the way: both go under a node of what they share */
+		if (IS_LEAF(*ref)) {
+			leaf = AS_LEAF(*ref);
+			if (leafMatches(aarray, leaf, key, keylen))
+				return 0;
+			leafBytes = leafKey(aarray, leaf);
+			for (common = depth; common < keylen && common < leaf->keylen
+					&& key[common] == leafBytes[common]; common++)
+				;
+
+			split = newNode(aarray, RADIX_NODE4);
+			if (split == NULL)
+				return -1;
+			split->prefixLen = common - depth;
+			n = (split->prefixLen < RADIX_MAX_PREFIX) ? split->prefixLen : RADIX_MAX_PREFIX;
+			memcpy(split->prefix, key + depth, n);
+
+			if (leaf->keylen == common)
+				split->terminal = leaf;
+			else
+				addChild(aarray, (void **) &split, leafBytes[common], *ref);
+			if (keylen == common)
+				split->terminal = adding;
+			else
+				addChild(aarray, (void **) &split, key[common], TAG_LEAF(adding));
+			*ref = split;
+			return 1;
+		}
+
+		/** a node whose prefix the key leaves part way: split the prefix */
+		node = (RadixNode *) *ref;
+		if (node->prefixLen > 0) {
+			common = prefixMismatch(aarray, node, key, keylen, depth);
+			if (common < node->prefixLen) {
+				split = newNode(aarray, RADIX_NODE4);
+				if (split == NULL)
+					return -1;
+				split->prefixLen = common;
+				memcpy(split->prefix, node->prefix,
+						(common < RADIX_MAX_PREFIX) ? common : RADIX_MAX_PREFIX);
+
+				/** the old node keeps what follows the byte it now hangs by */
+				if (node->prefixLen <= RADIX_MAX_PREFIX) {
+					addChild(aarray, (void **) &split, node->prefix[common], node);
+					node->prefixLen -= common + 1;
+					memmove(node->prefix, node->prefix + common + 1, node->prefixLen);
+				} else {
+					leafBytes = leafKey(aarray, minimumLeaf(node));
+					addChild(aarray, (void **) &split, leafBytes[depth + common], node);
+					node->prefixLen -= common + 1;
+					n = (node->prefixLen < RADIX_MAX_PREFIX)
+							? node->prefixLen : RADIX_MAX_PREFIX;
+					memcpy(node->prefix, leafBytes + depth + common + 1, n);
+				}
+
+				if (keylen == depth + common)
+					split->terminal = adding;
+				else
+					addChild(aarray, (void **) &split, key[depth + common],
+							TAG_LEAF(adding));
+				*ref = split;
+				return 1;
+			}
+			depth += node->prefixLen;
+		}
+
+		/** the key ends here, or goes on down one of the children */
+		if (depth == keylen) {
+			if (node->terminal != NULL)
+				return 0;
+			node->terminal = adding;
+			return 1;
+		}
+		slot = findChild(node, key[depth]);
+		if (slot == NULL)
+			return addChild(aarray, ref, key[depth], TAG_LEAF(adding));
+		ref = slot;
+		depth++;
+	}
+}
+
+/** do as many of a node's prefix bytes as it keeps match the key? */
+static int prefixMatches(RadixNode *node, AAKeyType key, size_t keylen, size_t depth)
+{
+	size_t n = (node->prefixLen < RADIX_MAX_PREFIX) ? node->prefixLen : RADIX_MAX_PREFIX;
+
+	if (keylen < depth + n)
+		return 0;
+	return memcmp(node->prefix, key + depth, n) == 0;
+}
+
+/**
+ * Take the key out of the tree below *ref, at the given depth
+ *
+ *  @return      the leaf taken out, or NULL if the key was not there
+ */
+static RadixLeaf *deleteAt(AssociativeArray *aarray, void **ref,
+		AAKeyType key, size_t keylen, size_t depth)
+{
+	RadixNode *node;
+	RadixLeaf *leaf;
+	void **slot;
+
+	aarray->deleteCost++;
+	if (*ref == NULL)
+		return NULL;
+
+	if (IS_LEAF(*ref)) {
+		leaf = AS_LEAF(*ref);
+		if ( ! leafMatches(aarray, leaf, key, keylen))
+			return NULL;
+		*ref = NULL;
+		return leaf;
+	}
+
+	node = (RadixNode *) *ref;
+	if ( ! prefixMatches(node, key, keylen, depth))
+		return NULL;
+	depth += node->prefixLen;
+	if (depth > keylen)
+		return NULL;
+
+	if (depth == keylen) {
+		leaf = node->terminal;
+		if (leaf == NULL || ! leafMatches(aarray, leaf, key, keylen))
+			return NULL;
+		node->terminal = NULL;
+		collapse(aarray, ref);
+		return leaf;
+	}
+
+	slot = findChild(node, key[depth]);
+	if (slot == NULL)
+		return NULL;
+	if ( ! IS_LEAF(*slot))
+		return deleteAt(aarray, slot, key, keylen, depth + 1);
+
+	leaf = AS_LEAF(*slot);
+	if ( ! leafMatches(aarray, leaf, key, keylen))
+		return NULL;
+	removeChild(aarray, ref, key[depth]);
+	collapse(aarray, ref);
+	return leaf;
+}
+
+/**
+ * The next of a node's children in byte order, from *cursor on (which
+ * starts at 0), or NULL once there are no more
+ */
+static void *nextChild(RadixNode *node, int *cursor, unsigned char *byte)
+{
+	RadixNode48 *node48;
+	void *child;
+
+	switch (node->type) {
+	case RADIX_NODE4:
+		if (*cursor >= node->nChildren)
+			return NULL;
+		*byte = ((RadixNode4 *) node)->keys[*cursor];
+		return ((RadixNode4 *) node)->children[(*cursor)++];
+	case RADIX_NODE16:
+		if (*cursor >= node->nChildren)
+			return NULL;
+		*byte = ((RadixNode16 *) node)->keys[*cursor];
+		return ((RadixNode16 *) node)->children[(*cursor)++];
+	case RADIX_NODE48:
+		node48 = (RadixNode48 *) node;
+		for (; *cursor < 256; (*cursor)++) {
+			if (node48->childIndex[*cursor] != 0) {
+				*byte = *cursor;
+				return node48->children[node48->childIndex[(*cursor)++] - 1];
+			}
+		}
+		return NULL;
+	}
+	for (; *cursor < 256; (*cursor)++) {
+		child = ((RadixNode256 *) node)->children[*cursor];
+		if (child != NULL) {
+			*byte = (*cursor)++;
+			return child;
+		}
+	}
+	return NULL;
+}
+
+/** hand one key to a scan's user function, if it is still in range */
+static int visitLeaf(RadixScan *scan, RadixLeaf *leaf)
+{
+	AAKeyType key = leafKey(scan->aarray, leaf);
+
+	if (scan->inRange != NULL
+			&& ! (*scan->inRange)(key, leaf->keylen, scan->bound, scan->boundlen))
+		return WALK_DONE;
+	if ((*scan->userfunction)(key, leaf->keylen,
+			leafValue(scan->aarray, leaf), scan->userdata) < 0)
+		return WALK_STOPPED;
+	return WALK_MORE;
+}
+
+/**
+ * Walk the keys below child in order, from the first at or after from
+ * (or all of them, if from is NULL), until the scan says to stop.  Only
+ * the one path down which from runs has to be compared against it; the
+ * subtrees either side are wholly before or after it.
+ */
+static int walk(RadixScan *scan, void *child, size_t depth,
+		AAKeyType from, size_t fromlen)
+{
+	RadixNode *node;
+	RadixLeaf *leaf;
+	unsigned char *prefix, byte;
+	size_t n;
+	int cursor = 0, order, result;
+
+	if (IS_LEAF(child)) {
+		leaf = AS_LEAF(child);
+		if (from != NULL && aaCompareKeys(leafKey(scan->aarray, leaf),
+					leaf->keylen, from, fromlen) < 0)
+			return WALK_MORE;
+		return visitLeaf(scan, leaf);
+	}
+
+	node = (RadixNode *) child;
+	if (from != NULL && node->prefixLen > 0) {
+		prefix = (node->prefixLen <= RADIX_MAX_PREFIX) ? node->prefix
+				: leafKey(scan->aarray, minimumLeaf(node)) + depth;
+		n = (fromlen - depth < node->prefixLen) ? fromlen - depth : node->prefixLen;
+		order = memcmp(prefix, from + depth, n);
+		if (order < 0)
+			return WALK_MORE;
+		if (order > 0 || n < node->prefixLen)
+			from = NULL;
+	}
+	depth += node->prefixLen;
+
+	if (node->terminal != NULL && (from == NULL || depth == fromlen)) {
+		result = visitLeaf(scan, node->terminal);
+		if (result != WALK_MORE)
+			return result;
+	}
+	if (from != NULL && depth == fromlen)
+		from = NULL;
+
+	while ((child = nextChild(node, &cursor, &byte)) != NULL) {
+		if (from != NULL && byte < from[depth])
+			continue;
+		result = walk(scan, child, depth + 1,
+				(from != NULL && byte == from[depth]) ? from : NULL, fromlen);
+		if (result != WALK_MORE)
+			return result;
+		if (from != NULL && byte >= from[depth])
+			from = NULL;
+	}
+	return WALK_MORE;
+}
+
+static void freeTree(AssociativeArray *aarray, void *child)
+{
+	RadixNode *node;
+	unsigned char byte;
+	int cursor = 0;
+	void *below;
+
+	if (child == NULL)
+		return;
+	if (IS_LEAF(child)) {
+		freeLeaf(aarray, AS_LEAF(child));
+		return;
+	}
+
+	node = (RadixNode *) child;
+	if (node->terminal != NULL)
+		freeLeaf(aarray, node->terminal);
+	while ((below = nextChild(node, &cursor, &byte)) != NULL)
+		freeTree(aarray, below);
+	freeNode(aarray, node);
+}
+
+
+/** free the leaf last deleted, now that its value is no longer wanted */
+static void forgetDeleted(AssociativeArray *aarray)
+{
+	RadixTree *tree = aarray->radix;
+
+	if (tree->deleted != NULL) {
+		freeLeaf(aarray, tree->deleted);
+		tree->deleted = NULL;
+	}
+}
+
+/**
+ * Make the table a radix tree; called as it is created
+ *
+ *  @return      1 on success, or -1 if there was no memory for it
+ */
+int aaRadixCreate(AssociativeArray *aarray)
+{
+	RadixTree *tree;
+
+	tree = (RadixTree *) aaMalloc(aarray, sizeof(RadixTree));
+	if (tree == NULL)
+		return -1;
+	memset(tree, 0, sizeof(RadixTree));
+	tree->nBytes = sizeof(RadixTree);
+	aarray->radix = tree;
+	return 1;
+}
+
+/**
+ * aaInsert() for a radix tree table
+ *
+ *  @return      1 on success, or -1 if the key is already there or
+ *				 there was no memory
+ */
+int aaRadixInsert(AssociativeArray *aarray, AAKeyType key, size_t keylen, void *value)
+{
+	RadixLeaf *leaf;
+	int result;
+
+	forgetDeleted(aarray);
+	leaf = newLeaf(aarray, key, keylen, value);
+	if (leaf == NULL)
+		return -1;
+
+	result = insertAt(aarray, &aarray->radix->root, leaf, 0);
+	if (result <= 0) {
+		freeLeaf(aarray, leaf);
+		return -1;
+	}
+	aarray->nEntries++;
+	return 1;
+}
+
+/**
+ * aaLookup() for a radix tree table: follow the key's bytes down, then
+ * compare the one key found
+ */
+void *aaRadixLookup(AssociativeArray *aarray, AAKeyType key, size_t keylen)
+{
+	void *child = aarray->radix->root;
+	RadixNode *node;
+	RadixLeaf *leaf = NULL;
+	size_t depth = 0;
+	void **slot;
+
+	while (child != NULL) {
+		aarray->searchCost++;
+		if (IS_LEAF(child)) {
+			leaf = AS_LEAF(child);
+			break;
+		}
+
+		node = (RadixNode *) child;
+		if ( ! prefixMatches(node, key, keylen, depth))
+			return NULL;
+		depth += node->prefixLen;
+		if (depth >= keylen) {
+			leaf = (depth == keylen) ? node->terminal : NULL;
+			break;
+		}
+
+		slot = findChild(node, key[depth++]);
+		child = (slot == NULL) ? NULL : *slot;
+	}
+
+	if (leaf == NULL || ! leafMatches(aarray, leaf, key, keylen))
+		return NULL;
+	return leafValue(aarray, leaf);
+}
+
+/**
+ * aaDelete() for a radix tree table.  The leaf is kept until the next
+ * insert or delete, so that, as for a hash table, a value copied into
+ * the table can be read from where it was.
+ */
+void *aaRadixDelete(AssociativeArray *aarray, AAKeyType key, size_t keylen)
+{
+	RadixTree *tree = aarray->radix;
+	RadixLeaf *leaf;
+
+	forgetDeleted(aarray);
+	leaf = deleteAt(aarray, &tree->root, key, keylen, 0);
+	if (leaf == NULL)
+		return NULL;
+	aarray->nEntries--;
+
+	tree->deleted = leaf;
+	return leafValue(aarray, leaf);
+}
+
+/**
+ * Call userfunction, in key order, on the keys from the first at or
+ * after from (or the first of all, if from is NULL), for as long as
+ * inRange (if not NULL) says they are in range
+ *
+ *  @return      1 on success, or -1 if userfunction ended the scan
+ */
+int aaRadixScan(AssociativeArray *aarray, AAKeyType from, size_t fromlen,
+		int (*inRange)(AAKeyType key, size_t keylen, AAKeyType bound, size_t boundlen),
+		AAKeyType bound, size_t boundlen,
+		int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *userdata),
+		void *userdata)
+{
+	RadixScan scan;
+
+	if (aarray->radix->root == NULL)
+		return 1;
+
+	scan.inRange = inRange;
+	scan.bound = bound;
+	scan.boundlen = boundlen;
+	scan.userfunction = userfunction;
+	scan.userdata = userdata;
+	scan.aarray = aarray;
+
+	if (walk(&scan, aarray->radix->root, 0, from, fromlen) == WALK_STOPPED)
+		return -1;
+	return 1;
+}
+
+/** what aaRadixPrint() prints to */
+typedef struct RadixPrint {
+	FILE *fp;
+	char *tag;
+} RadixPrint;
+
+static int printLeaf(AAKeyType key, size_t keylen, void *value, void *userdata)
+{
+	RadixPrint *print = (RadixPrint *) userdata;
+	char keybuffer[128];
+
+	printableKey(keybuffer, 128, key, keylen);
+	fprintf(print->fp, "%s  '%s'\n", print->tag, keybuffer);
+	return 0;
+}
+
+/**
+ * aaPrintContents() for a radix tree table: the keys, in order
+ */
+void aaRadixPrint(FILE *fp, AssociativeArray *aarray, char *tag)
+{
+	RadixPrint print;
+
+	print.fp = fp;
+	print.tag = tag;
+	fprintf(fp, "%sDumping radix tree of %d entries:\n", tag, aarray->nEntries);
+	aaRadixScan(aarray, NULL, 0, NULL, NULL, 0, printLeaf, &print);
+}
+
+/**
+ * The first line of aaPrintSummary() for a radix tree table, which has
+ * nodes and bytes in use rather than a size
+ */
+void aaRadixSummary(FILE *fp, AssociativeArray *aarray)
+{
+	fprintf(fp, "Associative array contains %d entries in a radix tree of %d nodes (%lu bytes)\n",
+			aarray->nEntries, aarray->radix->nNodes,
+			(unsigned long) aarray->radix->nBytes);
+}
+
+/**
+ * Free a radix tree, keys and all; called when the table is deleted
+ */
+void aaFreeRadix(AssociativeArray *aarray)
+{
+	if (aarray->radix == NULL)
+		return;
+
+	forgetDeleted(aarray);
+	freeTree(aarray, aarray->radix->root);
+	aaFree(aarray, aarray->radix);
+	aarray->radix = NULL;
+}
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "hashtools.h"
+
+/**
+ * One shard: an ordinary table behind its own lock.  Shards are padded
+ * out to a cache line so that the locks of neighbouring shards do not
+ * share one.
+ */
+typedef struct AAShard {
+	AssociativeArray *aarray;
+	pthread_rwlock_t lock;
+} __attribute__((aligned(64))) AAShard;
+
+struct AAShardedArray {
+	int nShards;
+	AAShard *shards;
+};
+
+
+/**
+ * Route a key to its shard.  The table's own hash algorithms are used
+ * to place the key within the shard, so routing uses a separate
+ * (FNV-1a) hash, keeping the two independent, and takes the shard from
+ * its high bits.
+ */
+static int shardForKey(AAShardedArray *sharded, AAKeyType key, size_t keylen)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < keylen; i++) {
+		hash ^= key[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return (int) (((hash >> 32) * (uint64_t) sharded->nShards) >> 32);
+}
+
+/**
+ * Create a table made up of nShards independent tables, splitting the
+ * given size between them.  Each shard has its own lock, grows on its
+ * own when it fills, and keeps its own statistics, so threads working
+ * on different shards never wait for one another.
+ *
+ *  @return      the new table, or NULL if any shard cannot be created
+ */
+AAShardedArray *
+aaCreateSharded(
+		int nShards,
+		size_t size,
+		char *probingStrategy,
+		char *hashPrimary,
+		char *hashSecondary
+	)
+{
+	AAShardedArray *sharded;
+	int i;
+
+	if (nShards < 1) {
+		fprintf(stderr, "Cannot create table of %d shards\n", nShards);
+		return NULL;
+	}
+
+	sharded = (AAShardedArray *) malloc(sizeof(AAShardedArray));
+	if (sharded == NULL)
+		return NULL;
+
+	if (posix_memalign((void **) &sharded->shards, sizeof(AAShard),
+				nShards * sizeof(AAShard)) != 0) {
+		free(sharded);
+		return NULL;
+	}
+
+	sharded->nShards = 0;
+	for (i = 0; i < nShards; i++) {
+		sharded->shards[i].aarray = aaCreateAssociativeArray(
+				(size + nShards - 1) / nShards, 0,
+				probingStrategy, hashPrimary, hashSecondary);
+		if (sharded->shards[i].aarray == NULL) {
+			aaDeleteSharded(sharded);
+			return NULL;
+		}
+		pthread_rwlock_init(&sharded->shards[i].lock, NULL);
+		sharded->nShards++;
+	}
+
+	/** only now that all shards exist can keys be routed */
+	return sharded;
+}
+
+void aaDeleteSharded(AAShardedArray *sharded)
+{
+	int i;
+
+	if (sharded == NULL)
+		return;
+
+	for (i = 0; i < sharded->nShards; i++) {
+		pthread_rwlock_destroy(&sharded->shards[i].lock);
+		aaDeleteAssociativeArray(sharded->shards[i].aarray);
+	}
+	free(sharded->shards);
+	free(sharded);
+}
+
+/**
+ * Insert into the key's shard, doubling the shard first if it is full
+ */
+int aaShardedInsert(AAShardedArray *sharded, AAKeyType key, size_t keylen, void *value)
+{
+	AAShard *shard = &sharded->shards[shardForKey(sharded, key, keylen)];
+	int result;
+
+	pthread_rwlock_wrlock(&shard->lock);
+	if (shard->aarray->nEntries >= shard->aarray->size)
+		aaResize(shard->aarray, shard->aarray->size * 2);
+	result = aaInsert(shard->aarray, key, keylen, value);
+	pthread_rwlock_unlock(&shard->lock);
+
+	return result;
+}
+
+void *aaShardedLookup(AAShardedArray *sharded, AAKeyType key, size_t keylen)
+{
+	AAShard *shard = &sharded->shards[shardForKey(sharded, key, keylen)];
+	AssociativeArray header;
+	KeyDataPair *pair;
+	void *value = NULL;
+
+	/**
+	 * any number of readers may share the shard, so search a copy of
+	 * its header: the search costs tallied there are not ours to update
+	 * under a shared lock.  Shards that do not hash their keys have
+	 * lookups of their own, none of which change the table.
+	 */
+	pthread_rwlock_rdlock(&shard->lock);
+	header = *shard->aarray;
+	if (header.radix != NULL) {
+		value = aaRadixLookup(&header, key, keylen);
+	} else if (header.mapped != NULL) {
+		value = aaMappedLookup(&header, key, keylen);
+	} else if (header.perfect != NULL) {
+		value = aaPerfectLookup(&header, key, keylen);
+	} else {
+		pair = aaFindPair(&header, key, keylen);
+		if (pair != NULL && ! aaPairExpired(&header, pair))
+			value = aaPairValue(&header, pair);
+	}
+	pthread_rwlock_unlock(&shard->lock);
+
+	return value;
+}
+
+void *aaShardedDelete(AAShardedArray *sharded, AAKeyType key, size_t keylen)
+{
+	AAShard *shard = &sharded->shards[shardForKey(sharded, key, keylen)];
+	void *value;
+
+	pthread_rwlock_wrlock(&shard->lock);
+	value = aaDelete(shard->aarray, key, keylen);
+	pthread_rwlock_unlock(&shard->lock);
+
+	return value;
+}
+
+/**
+ * Iterate over each shard in turn; each is read-locked while it is
+ * visited, so the others stay available to writers
+ */
+int aaShardedIterateAction(
+		AAShardedArray *sharded,
+		int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *userdata),
+		void *userdata
+	)
+{
+	int i, result = 1;
+
+	for (i = 0; i < sharded->nShards && result > 0; i++) {
+		pthread_rwlock_rdlock(&sharded->shards[i].lock);
+		result = aaIterateAction(sharded->shards[i].aarray, userfunction, userdata);
+		pthread_rwlock_unlock(&sharded->shards[i].lock);
+	}
+	return result;
+}
+
+/**
+ * Print out a summary of the whole table, followed by each shard's own
+ */
+void aaShardedPrintSummary(FILE *fp, AAShardedArray *sharded)
+{
+	int i, nEntries = 0, size = 0;
+
+	for (i = 0; i < sharded->nShards; i++) {
+		pthread_rwlock_rdlock(&sharded->shards[i].lock);
+		nEntries += sharded->shards[i].aarray->nEntries;
+		size += sharded->shards[i].aarray->size;
+		pthread_rwlock_unlock(&sharded->shards[i].lock);
+	}
+
+	fprintf(fp, "Sharded associative array contains %d entries in %d shards of %d total size\n",
+			nEntries, sharded->nShards, size);
+	for (i = 0; i < sharded->nShards; i++) {
+		fprintf(fp, "Shard %d:\n", i);
+		pthread_rwlock_rdlock(&sharded->shards[i].lock);
+		aaPrintSummary(fp, sharded->shards[i].aarray);
+		pthread_rwlock_unlock(&sharded->shards[i].lock);
+	}
+}
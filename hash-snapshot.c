@@ -0,0 +1,469 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "hashtools.h"
+
+/**
+ * A snapshot is written in the byte order and word size of the machine
+ * that wrote it, and is only meant to be read back by the same build.
+ * After the header come the strategy names, then the index exactly as
+ * it is in memory, then one SnapshotEntry for each of the dense entries
+ * (deleted ones included, as the index refers to them by position),
+ * then all of the keys end to end, and then all of the values.  A table
+ * with entries given a time to live sets SNAPSHOT_EXPIRY, and ends with
+ * the deadline of each entry (see aaDeadlineToFile()).
+ */
+#define	SNAPSHOT_MAGIC	"AASNAP01"
+
+/** flags of the header */
+#define	SNAPSHOT_EXPIRY	0x01
+
+/** stdio buffer used while reading or writing a snapshot */
+#define	SNAPSHOT_BUFFER	(1 << 20)
+
+/** length recorded for a NULL value pointer */
+#define	SNAPSHOT_NULL_VALUE	UINT64_MAX
+
+typedef struct SnapshotHeader {
+	char magic[8];
+	uint64_t size;
+	uint64_t valueSize;
+	uint64_t indexWidth;
+	uint64_t nUsed;
+	uint64_t nEntries;
+	uint32_t nameLength[3];
+	uint32_t flags;
+} SnapshotHeader;
+
+typedef struct SnapshotEntry {
+	uint32_t validity;
+	uint32_t keylen;
+	uint64_t valuelen;
+} SnapshotEntry;
+
+
+/**
+ * the bytes saved for a value: inline bytes, or a string's characters.
+ * The value of a deleted (or expired) entry may have been freed by its
+ * owner, so it is saved as NULL
+ */
+static uint64_t savedValueLength(AssociativeArray *aarray, KeyDataPair *pair)
+{
+	if (aarray->valueSize != 0)
+		return aarray->valueSize;
+	if (pair->value == NULL || ! aaPairLive(aarray, pair))
+		return SNAPSHOT_NULL_VALUE;
+	return strlen((char *) pair->value) + 1;
+}
+
+/**
+ * Write a snapshot of the table to an open file.  The caller holds the
+ * table locked, so that no entry changes while it is being written.
+ *
+ *  @return      1 on success, or 0 if a write failed
+ */
+int aaWriteSnapshot(AssociativeArray *aarray, FILE *fp)
+{
+	char *names[3];
+	SnapshotHeader header;
+	SnapshotEntry record;
+	int i, ok;
+
+	names[0] = aarray->probeName;
+	names[1] = aarray->hashNamePrimary;
+	names[2] = aarray->hashNameSecondary;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.size = aarray->size;
+	header.valueSize = aarray->valueSize;
+	header.indexWidth = aarray->indexWidth;
+	header.nUsed = aarray->nUsed;
+	header.nEntries = 0;
+	for (i = 0; i < aarray->nUsed; i++)
+		header.nEntries += aaPairLive(aarray, aaEntry(aarray, i));
+	for (i = 0; i < 3; i++)
+		header.nameLength[i] = strlen(names[i]);
+	if (aarray->expiry != NULL)
+		header.flags |= SNAPSHOT_EXPIRY;
+
+	ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	for (i = 0; ok && i < 3; i++)
+		ok = fwrite(names[i], 1, header.nameLength[i], fp) == header.nameLength[i];
+
+	if (ok)
+		ok = fwrite(aarray->index, aarray->indexWidth, aarray->size, fp)
+				== (size_t) aarray->size;
+
+	for (i = 0; ok && i < aarray->nUsed; i++) {
+		KeyDataPair *pair = aaEntry(aarray, i);
+
+		/** an expired entry is saved as the deleted one it will become */
+		record.validity = aaPairLive(aarray, pair) ? HASH_USED : HASH_DELETED;
+		record.keylen = pair->keylen;
+		record.valuelen = savedValueLength(aarray, pair);
+		ok = fwrite(&record, sizeof(record), 1, fp) == 1;
+	}
+
+	for (i = 0; ok && i < aarray->nUsed; i++) {
+		KeyDataPair *pair = aaEntry(aarray, i);
+
+		ok = fwrite(pair->key, 1, pair->keylen, fp) == pair->keylen;
+	}
+
+	for (i = 0; ok && i < aarray->nUsed; i++) {
+		KeyDataPair *pair = aaEntry(aarray, i);
+		uint64_t length = savedValueLength(aarray, pair);
+
+		if (length != SNAPSHOT_NULL_VALUE)
+			ok = fwrite(aaPairValue(aarray, pair), 1, length, fp) == length;
+	}
+
+	for (i = 0; ok && (header.flags & SNAPSHOT_EXPIRY) && i < aarray->nUsed; i++) {
+		uint64_t stored = aaDeadlineToFile(aarray->expiry[i]);
+
+		ok = fwrite(&stored, sizeof(stored), 1, fp) == 1;
+	}
+
+	return ok;
+}
+
+/**
+ * Write the table to the named file, to be read back with aaLoad().
+ *
+ * Values copied into the table (a non-zero valueSize) are saved as
+ * they are.  The value pointers of any other table can only be saved
+ * if they point at NUL-terminated strings, as a3 stores; they are
+ * saved as the strings they point to.
+ *
+ *  @return      1 on success, or -1 if the file could not be written
+ */
+int aaSave(AssociativeArray *aarray, const char *path)
+{
+	FILE *fp;
+	int ok;
+
+	if (aaRefuseReadOnly(aarray) || aaRefuseRadix(aarray) || aaRefuseMultimap(aarray))
+		return -1;
+
+	fp = fopen(path, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "Cannot open snapshot '%s' : %s\n",
+				path, strerror(errno));
+		return -1;
+	}
+	setvbuf(fp, NULL, _IOFBF, SNAPSHOT_BUFFER);
+
+	aaLockTable(aarray);
+	ok = aaWriteSnapshot(aarray, fp);
+	aaUnlockTable(aarray);
+
+	if (fclose(fp) != 0)
+		ok = 0;
+	if ( ! ok) {
+		fprintf(stderr, "Failed writing snapshot '%s' : %s\n",
+				path, strerror(errno));
+		return -1;
+	}
+	return 1;
+}
+
+/**
+ * The work of the child forked by aaSnapshotAsync(): write the snapshot
+ * beside its final name, rename it into place, and report on the pipe.
+ * The child has only the one thread, and its copy of the table is not
+ * changed by anyone, so nothing here needs a lock.
+ */
+static void writeSnapshotChild(AssociativeArray *aarray, const char *path, int reportFd)
+{
+	char partial[4096];
+	char result = 0;
+	FILE *fp;
+
+	if (snprintf(partial, sizeof(partial), "%s.partial", path) < (int) sizeof(partial)
+			&& (fp = fopen(partial, "wb")) != NULL) {
+		setvbuf(fp, NULL, _IOFBF, SNAPSHOT_BUFFER);
+		result = aaWriteSnapshot(aarray, fp)
+				&& fflush(fp) == 0
+				&& fsync(fileno(fp)) == 0;
+		if (fclose(fp) != 0)
+			result = 0;
+		if (result)
+			result = rename(partial, path) == 0;
+		else
+			unlink(partial);
+	}
+
+	if (write(reportFd, &result, 1) != 1)
+		result = 0;
+	_exit(result ? 0 : 1);
+}
+
+/**
+ * Start writing a snapshot, as aaSave() would, without making the
+ * caller wait for it.  The table is locked only for as long as it takes
+ * to fork(2); the child then writes out its copy of the table while the
+ * parent goes on changing its own, the kernel copying each page the
+ * parent writes to so that the child still sees it as it was.
+ *
+ * The descriptor returned becomes readable once the child is done, so
+ * it can be given to poll(2) or select(2) alongside others; call
+ * aaSnapshotWait() to learn how it went.  A table has at most one
+ * snapshot being written at a time.
+ *
+ *  @return      the descriptor, or -1 if the snapshot could not be started
+ */
+int aaSnapshotAsync(AssociativeArray *aarray, const char *path)
+{
+	int report[2];
+	pid_t pid;
+
+	if (aaRefuseReadOnly(aarray) || aaRefuseRadix(aarray) || aaRefuseMultimap(aarray))
+		return -1;
+	if (aarray->snapshotPid != 0) {
+		fprintf(stderr, "A snapshot of this table is already being written\n");
+		return -1;
+	}
+
+	if (pipe(report) < 0) {
+		fprintf(stderr, "Cannot start snapshot '%s' : %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	/** hold off the writers, so the child's copy is consistent */
+	aaLockTable(aarray);
+	fflush(NULL);
+	pid = fork();
+	if (pid == 0) {
+		close(report[0]);
+		writeSnapshotChild(aarray, path, report[1]);
+	}
+	aaUnlockTable(aarray);
+
+	close(report[1]);
+	if (pid < 0) {
+		fprintf(stderr, "Cannot start snapshot '%s' : %s\n", path, strerror(errno));
+		close(report[0]);
+		return -1;
+	}
+
+	aarray->snapshotPid = pid;
+	aarray->snapshotFd = report[0];
+	return report[0];
+}
+
+/**
+ * Wait for the snapshot started by aaSnapshotAsync() to be written, and
+ * close its descriptor
+ *
+ *  @return      1 if the snapshot was written, or -1 if it was not
+ */
+int aaSnapshotWait(AssociativeArray *aarray)
+{
+	char result = 0;
+	int status;
+	ssize_t n;
+
+	if (aarray->snapshotPid == 0)
+		return -1;
+
+	do {
+		n = read(aarray->snapshotFd, &result, 1);
+	} while (n < 0 && errno == EINTR);
+	close(aarray->snapshotFd);
+
+	while (waitpid(aarray->snapshotPid, &status, 0) < 0 && errno == EINTR)
+		;
+	aarray->snapshotPid = 0;
+	aarray->snapshotFd = -1;
+
+	if (n != 1 || ! result) {
+		fprintf(stderr, "Failed writing snapshot in the background\n");
+		return -1;
+	}
+	return 1;
+}
+
+/** read one of the strategy names into a fresh string */
+static char *readName(FILE *fp, uint32_t length)
+{
+	char *name = (char *) malloc(length + 1);
+
+	if (name == NULL)
+		return NULL;
+	if (fread(name, 1, length, fp) != length) {
+		free(name);
+		return NULL;
+	}
+	name[length] = 0;
+	return name;
+}
+
+/**
+ * Read the keys and values of a snapshot into the entries of a table
+ * created to match it.  The index and entry records have already been
+ * read, so the dense entries only need their keys and values.
+ */
+static int readKeysAndValues(AssociativeArray *aarray, FILE *fp,
+		SnapshotEntry *records, int nUsed)
+{
+	int i;
+
+	for (i = 0; i < nUsed; i++) {
+		KeyDataPair *pair = aaEntry(aarray, i);
+
+		pair->keylen = records[i].keylen;
+		pair->validity = records[i].validity;
+		pair->value = NULL;
+		pair->key = (AAKeyType) aaMalloc(aarray, pair->keylen);
+		if (pair->key == NULL)
+			return -1;
+		aarray->nUsed = i + 1;
+		if (fread(pair->key, 1, pair->keylen, fp) != pair->keylen)
+			return -1;
+	}
+
+	for (i = 0; i < nUsed; i++) {
+		KeyDataPair *pair = aaEntry(aarray, i);
+		uint64_t length = records[i].valuelen;
+
+		if (length == SNAPSHOT_NULL_VALUE)
+			continue;
+
+		if (aarray->valueSize != 0) {
+			if (length != aarray->valueSize)
+				return -1;
+		} else {
+			/** the caller owns the values, as for aaInsert() */
+			pair->value = malloc(length);
+			if (pair->value == NULL)
+				return -1;
+		}
+		if (fread(aaPairValue(aarray, pair), 1, length, fp) != length)
+			return -1;
+	}
+	return 1;
+}
+
+/**
+ * Read the deadlines saved after the values, for a table whose entries
+ * have already been read
+ */
+static int readDeadlines(AssociativeArray *aarray, FILE *fp, int nUsed)
+{
+	uint64_t stored;
+	int i;
+
+	if (aaEnableExpiry(aarray) < 0)
+		return -1;
+	for (i = 0; i < nUsed; i++) {
+		if (fread(&stored, sizeof(stored), 1, fp) != 1)
+			return -1;
+		aarray->expiry[i] = aaDeadlineFromFile(stored);
+	}
+	return 1;
+}
+
+/**
+ * Recreate a table from a file written by aaSave().  The new table is
+ * not shared between threads, whatever the saved one was.
+ *
+ * The index and entries are read back exactly as they were saved, so
+ * nothing is rehashed.  For a table of value pointers, each value is
+ * given its own malloc(3)ed copy, which the caller is responsible for
+ * freeing, just as for values it had inserted itself.
+ *
+ *  @return      the table, or NULL if the file could not be read
+ */
+AssociativeArray *aaLoad(const char *path)
+{
+	AssociativeArray *aarray = NULL;
+	SnapshotEntry *records = NULL;
+	SnapshotHeader header;
+	char *names[3] = { NULL, NULL, NULL };
+	KeyDataPair *table;
+	FILE *fp;
+	int i, ok;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "Cannot open snapshot '%s' : %s\n",
+				path, strerror(errno));
+		return NULL;
+	}
+	setvbuf(fp, NULL, _IOFBF, SNAPSHOT_BUFFER);
+
+	ok = fread(&header, sizeof(header), 1, fp) == 1
+			&& memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0
+			&& header.nUsed <= header.size;
+	for (i = 0; ok && i < 3; i++)
+		ok = (names[i] = readName(fp, header.nameLength[i])) != NULL;
+
+	if (ok) {
+		aarray = aaCreateAssociativeArray(header.size, header.valueSize,
+				names[0], names[1], names[2]);
+		ok = aarray != NULL
+				&& aarray->size == header.size
+				&& aarray->indexWidth == header.indexWidth;
+	}
+
+	/** make room for all of the saved entries at once */
+	if (ok && header.nUsed > aarray->nAllocated) {
+		table = (KeyDataPair *) aaRealloc(aarray, aarray->table,
+				header.nUsed * aarray->entrySize);
+		if (table == NULL) {
+			ok = 0;
+		} else {
+			aarray->table = table;
+			aarray->nAllocated = header.nUsed;
+		}
+	}
+
+	if (ok)
+		ok = fread(aarray->index, aarray->indexWidth, aarray->size, fp)
+				== (size_t) aarray->size;
+
+	if (ok) {
+		records = (SnapshotEntry *) malloc((header.nUsed + 1) * sizeof(SnapshotEntry));
+		ok = records != NULL
+				&& fread(records, sizeof(SnapshotEntry), header.nUsed, fp)
+						== header.nUsed;
+	}
+
+	/** every slot must refer to one of the saved entries */
+	for (i = 0; ok && i < aarray->size; i++)
+		ok = aaIndexGet(aarray, i) < (int) header.nUsed;
+
+	if (ok)
+		ok = readKeysAndValues(aarray, fp, records, header.nUsed) > 0;
+
+	if (ok && (header.flags & SNAPSHOT_EXPIRY))
+		ok = readDeadlines(aarray, fp, header.nUsed) > 0;
+
+	if (ok)
+		aarray->nEntries = header.nEntries;
+
+	fclose(fp);
+	free(records);
+	for (i = 0; i < 3; i++)
+		free(names[i]);
+
+	if ( ! ok) {
+		fprintf(stderr, "Failed reading snapshot '%s'\n", path);
+		if (aarray != NULL) {
+			/** values already read are ours to free */
+			if (aarray->valueSize == 0) {
+				for (i = 0; i < aarray->nUsed; i++)
+					free(aaEntry(aarray, i)->value);
+			}
+			aaDeleteAssociativeArray(aarray);
+		}
+		return NULL;
+	}
+	return aarray;
+}
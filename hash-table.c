@@ -6,9 +6,21 @@
 
 #include "hashtools.h"
 
+/** number of dense entries allocated when a table is created */
+#define	INITIAL_ENTRIES	16
+
+/** internal result of insertPair(), asking aaInsert() to make room */
+#define	INSERT_NEEDS_ROOM	(-2)
+
 /** forward declaration */
 static HashAlgorithm lookupNamedHashStrategy(const char *name);
 static HashProbe lookupNamedProbingStrategy(const char *name);
+static int makeRoomForEntry(AssociativeArray *aarray);
+static int insertPair(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+        void *value, uint64_t deadline);
+static void abandonPair(AssociativeArray *aarray, KeyDataPair *pair);
+static void *deletePair(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+        int *removed);
 
 /**
  * Create a hash table of the given size,
@@ -20,45 +32,123 @@ static HashProbe lookupNamedProbingStrategy(const char *name);
  *				collisions
  *  @param  newHashSize  the size of the table (will be rounded up
  *				to the next-nearest larger prime, but see exception)
+ *  @param  valueSize  0 to store the value pointers given to aaInsert,
+ *				or the number of bytes of each value to copy into
+ *				the table alongside its key
  *  @see         HashAlgorithm
  *  @see         HashProbe
  *  @see         Primes
  *
  *  @throws java.lang.IndexOutOfBoundsException if no prime number larger
- *				than newHashSize can be found (currently only primes
- *				less than 5000 are known)
+ *				than newHashSize fits in an int
  */
 AssociativeArray *
 aaCreateAssociativeArray(
 		size_t size,
+		size_t valueSize,
 		char *probingStrategy,
 		char *hashPrimary,
 		char *hashSecondary
 	)
+{
+	return aaCreateAssociativeArrayEx(size, valueSize,
+			probingStrategy, hashPrimary, hashSecondary, NULL);
+}
+
+/**
+ * As aaCreateAssociativeArray(), but taking all of the table's memory
+ * -- the table itself, its entries, copies of the keys and names, and
+ * any bookkeeping -- from the given allocator.  A NULL allocator means
+ * the C library's malloc(3) family.  Indexes mapped with mmap(2) for
+ * their memoryFlags (see hash-memory.c) are the one exception.
+ *
+ *  @return      the new table, or NULL if it cannot be created
+ */
+AssociativeArray *
+aaCreateAssociativeArrayEx(
+		size_t size,
+		size_t valueSize,
+		char *probingStrategy,
+		char *hashPrimary,
+		char *hashSecondary,
+		const AAAllocator *allocator
+	)
 {
 	AssociativeArray *newTable;
+	int primeSize;
+
+	if (allocator == NULL)
+		allocator = &aaDefaultAllocator;
+
+	primeSize = getLargerPrime(size);
+	if (primeSize < 1) {
+		fprintf(stderr, "Cannot create table of size %ld\n", size);
+		return NULL;
+	}
 
-	newTable = (AssociativeArray *) malloc(sizeof(AssociativeArray));
+	newTable = (AssociativeArray *) (*allocator->allocate)(
+			sizeof(AssociativeArray), allocator->context);
+	if (newTable == NULL)
+		return NULL;
+	memset(newTable, 0, sizeof(AssociativeArray));
+	newTable->allocator = *allocator;
 
 	newTable->hashAlgorithmPrimary = lookupNamedHashStrategy(hashPrimary);
-	newTable->hashNamePrimary = strdup(hashPrimary);
+	newTable->hashNamePrimary = aaStrdup(newTable, hashPrimary);
 	newTable->hashAlgorithmSecondary = lookupNamedHashStrategy(hashSecondary);
-	newTable->hashNameSecondary = strdup(hashSecondary);
+	newTable->hashNameSecondary = aaStrdup(newTable, hashSecondary);
+	newTable->probeName = aaStrdup(newTable, probingStrategy);
+	newTable->size = primeSize;
+
+	/** the "art" strategy keeps the keys in a radix tree, not hashed */
+	if (strncmp(probingStrategy, "art", 3) == 0) {
+		newTable->valueSize = valueSize;
+		newTable->entrySize = sizeof(KeyDataPair);
+		newTable->hashProbe = linearProbe;
+		if (newTable->hashNamePrimary == NULL || newTable->hashNameSecondary == NULL
+				|| newTable->probeName == NULL || aaRadixCreate(newTable) < 0) {
+			aaDeleteAssociativeArray(newTable);
+			return NULL;
+		}
+		newTable->concurrency = AA_CONCURRENCY_NONE;
+		return newTable;
+	}
 	newTable->hashProbe = lookupNamedProbingStrategy(probingStrategy);
-	newTable->probeName = strdup(probingStrategy);
 
-	newTable->size = getLargerPrime(size);
+	/** the index starts with every slot empty */
+	newTable->indexWidth = aaIndexWidthForSize(newTable->size);
+	newTable->memoryFlags = AA_MEMORY_DEFAULT;
+	newTable->index = aaAllocIndex(newTable,
+			(size_t) newTable->size * newTable->indexWidth);
 
-	if (newTable->size < 1) {
-		fprintf(stderr, "Cannot create table of size %ld\n", size);
-		free(newTable);
+	/** inline values follow their pair, padded to keep pairs aligned */
+	newTable->valueSize = valueSize;
+	newTable->entrySize = sizeof(KeyDataPair)
+			+ ((valueSize + sizeof(void *) - 1) & ~(sizeof(void *) - 1));
+
+	/** the dense entries grow on demand, up to one per slot */
+	newTable->nAllocated = newTable->size < INITIAL_ENTRIES
+			? newTable->size : INITIAL_ENTRIES;
+	newTable->table = (KeyDataPair *)
+			aaMalloc(newTable, newTable->nAllocated * newTable->entrySize);
+	newTable->nUsed = 0;
+	newTable->generation = 0;
+
+	if (newTable->hashNamePrimary == NULL || newTable->hashNameSecondary == NULL
+			|| newTable->probeName == NULL
+			|| newTable->index == NULL || newTable->table == NULL) {
+		aaDeleteAssociativeArray(newTable);
 		return NULL;
 	}
 
-	newTable->table = (KeyDataPair *) malloc(newTable->size * sizeof(KeyDataPair));
-
-	/** initialize everything with zeros */
-	memset(newTable->table, 0, newTable->size * sizeof(KeyDataPair));
+	/** tables are private to one thread until aaSetConcurrency() */
+	newTable->concurrency = AA_CONCURRENCY_NONE;
+	newTable->nSegments = 0;
+	newTable->segmentSeq = NULL;
+	newTable->structureSeq = 0;
+	newTable->stripeLocks = NULL;
+	newTable->retired = NULL;
+	newTable->nRetired = 0;
 
 	newTable->nEntries = 0;
 
@@ -75,19 +165,52 @@ aaCreateAssociativeArray(
 void
 aaDeleteAssociativeArray(AssociativeArray *aarray)
 {
+	int i;
 
 	if(aarray == NULL){  //nothing to delete 
 		return;
 	}
+	if (aarray->mapped != NULL) {
+		aaCloseMapped(aarray);
+	}
+	aaFreePerfect(aarray);
+	aaFreeRadix(aarray);
+	aaFreeCache(aarray);
+	aaFreeOrdered(aarray, aarray->ordered);
+	aaCloseLog(aarray);
+	if (aarray->snapshotPid != 0) {
+		aaSnapshotWait(aarray);
+	}
 
-	free(aarray->table);  //free values in table
-	free(aarray);        //free space used by table
+	for (i = 0; i < aarray->nUsed; i++) {
+		aaFree(aarray, aaEntry(aarray, i)->key);  //free keys, live or deleted
+		if (aarray->multimap) {
+			aaFree(aarray, aaEntry(aarray, i)->value);  //and their lists of values
+		}
+	}
+	aaFreeConcurrency(aarray);
+	aaFree(aarray, aarray->table);  //free values in table
+	aaFree(aarray, aarray->expiry);
+	aaFree(aarray, aarray->scanMap);
+	aaFreeIndex(aarray, aarray->index);
+	aaFreeIndex(aarray, aarray->bloom);
+	aaFreeIndex(aarray, aarray->cuckoo);
+	aaFreeIndex(aarray, aarray->front);
+	aaFree(aarray, aarray->hashNamePrimary);
+	aaFree(aarray, aarray->hashNameSecondary);
+	aaFree(aarray, aarray->probeName);
+	aaFree(aarray, aarray);        //free space used by table
 
 	}
 
 
 /**
- * iterate over the array, calling the user function on each valid value
+ * iterate over the array, calling the user function on each valid value.
+ * As the entries are stored densely, this visits them in the order in
+ * which they were inserted, and never looks at an empty slot.
+ *
+ * Writers are held off while this runs on a shared table, so the user
+ * function must not itself insert or delete.
  */
 int aaIterateAction(
 		AssociativeArray *aarray,
@@ -95,22 +218,452 @@ int aaIterateAction(
 		void *userdata
 	)
 {
-	int i;
+	int i, result = 1;
 
-	for (i = 0; i < aarray->size; i++) {
-		if (aarray->table[i].validity == HASH_USED) {
+	if (aarray->mapped != NULL)
+		return aaMappedIterate(aarray, userfunction, userdata);
+	if (aarray->radix != NULL)
+		return aaRadixScan(aarray, NULL, 0, NULL, NULL, 0, userfunction, userdata);
+
+	aaLockTable(aarray);
+	for (i = 0; i < aarray->nUsed; i++) {
+		KeyDataPair *pair = aaEntry(aarray, i);
+
+		if (aaPairLive(aarray, pair)) {
 			if ((*userfunction)(
-					aarray->table[i].key,
-					aarray->table[i].keylen,
-					aarray->table[i].value,
+					pair->key,
+					pair->keylen,
+					aaPairValue(aarray, pair),
 					userdata) < 0) {
+				result = -1;
+				break;
+			}
+		}
+	}
+	aaUnlockTable(aarray);
+	return result;
+}
+
+/**
+ * A scan cursor holds a position in the dense entries in its low bits,
+ * and the generation of the table it was issued against above that
+ */
+#define	SCAN_POSITION_BITS	40
+#define	SCAN_POSITION_MASK	((((size_t) 1) << SCAN_POSITION_BITS) - 1)
+#define	SCAN_GENERATION_MASK	((size_t) 0xffffff)
+
+/**
+ * What a rebuild did with the dense entries, so that a scan cursor
+ * issued before it still finds its place.  A rebuild keeps the live
+ * entries in order and drops the rest, so an old position maps to the
+ * number of live entries ahead of it: live has a bit for each old entry
+ * that was kept, and before the number kept ahead of each word of live.
+ */
+typedef struct ScanMap {
+	int fromGeneration;
+	int oldUsed;
+	int *before;
+	uint64_t live[];
+} ScanMap;
+
+/**
+ * Note which of the old entries a rebuild keeps
+ *
+ *  @return      the map, or NULL if there was no memory for it, in
+ *				 which case scans in progress start again
+ */
+static ScanMap *buildScanMap(AssociativeArray *aarray, char *oldTable, int oldUsed)
+{
+	int nWords = oldUsed / 64 + 1;
+	int i, nKept = 0;
+	ScanMap *map;
+
+	map = (ScanMap *) aaMalloc(aarray, sizeof(ScanMap)
+			+ nWords * (sizeof(uint64_t) + sizeof(int)));
+	if (map == NULL)
+		return NULL;
+	map->fromGeneration = aarray->generation;
+	map->oldUsed = oldUsed;
+	map->before = (int *) (map->live + nWords);
+	memset(map->live, 0, nWords * sizeof(uint64_t));
+
+	for (i = 0; i < oldUsed; i++) {
+		KeyDataPair *pair = (KeyDataPair *) (oldTable + i * aarray->entrySize);
+
+		if (i % 64 == 0)
+			map->before[i / 64] = nKept;
+		if (pair->validity == HASH_USED) {
+			map->live[i / 64] |= ((uint64_t) 1) << (i % 64);
+			nKept++;
+		}
+	}
+	if (oldUsed % 64 == 0)
+		map->before[oldUsed / 64] = nKept;
+	return map;
+}
+
+/** where the entry at an old position is now (or would be, if kept) */
+static size_t mapScanPosition(ScanMap *map, size_t position)
+{
+	uint64_t below = (((uint64_t) 1) << (position % 64)) - 1;
+
+	return map->before[position / 64]
+			+ __builtin_popcountll(map->live[position / 64] & below);
+}
+
+/**
+ * Return a batch of up to count valid entries, starting from the given
+ * cursor, so that a large table can be walked a slice at a time with
+ * other work (including inserts and deletes) done in between.
+ *
+ * New entries are appended to the dense entries, so a scan in progress
+ * sees them without skipping anything.  Should the table be rebuilt
+ * between calls, the cursor is carried to where its entries moved.
+ * Only the last rebuild is remembered, so after two, or a rebuild that
+ * had no memory to spare, the scan restarts from the beginning: entries
+ * may then be returned more than once, but none are ever missed.
+ *
+ *  @param  cursor  0 to start a scan, else a value returned previously
+ *  @param  out     room for at least count entries
+ *  @param  nFound  set to the number of entries placed in out
+ *  @return      the cursor for the next call, or 0 once the scan is done
+ */
+size_t aaScan(AssociativeArray *aarray, size_t cursor, int count,
+		AAScanEntry *out, int *nFound)
+{
+	size_t position = cursor & SCAN_POSITION_MASK;
+	size_t generation;
+	int found = 0;
+
+	if (aaRefuseRadix(aarray)) {
+		*nFound = 0;
+		return 0;
+	}
+
+	aaLockTable(aarray);
+	generation = (size_t) aarray->generation & SCAN_GENERATION_MASK;
+	if (cursor != 0
+			&& (cursor >> SCAN_POSITION_BITS) != generation) {
+		ScanMap *map = aarray->scanMap;
+
+		if (map != NULL && position <= (size_t) map->oldUsed
+				&& (cursor >> SCAN_POSITION_BITS)
+					== ((size_t) map->fromGeneration & SCAN_GENERATION_MASK))
+			position = mapScanPosition(map, position);
+		else
+			position = 0;
+	}
+
+	while (position < aarray->nUsed && found < count) {
+		KeyDataPair *pair = aaEntry(aarray, position++);
+
+		if (aaPairLive(aarray, pair)) {
+			out[found].key = pair->key;
+			out[found].keylen = pair->keylen;
+			out[found].value = aaPairValue(aarray, pair);
+			found++;
+		}
+	}
+	*nFound = found;
+
+	if (position >= aarray->nUsed)
+		position = 0;
+	aaUnlockTable(aarray);
+
+	if (position == 0)
+		return 0;
+	return (generation << SCAN_POSITION_BITS) | position;
+}
+
+/**
+ * Check, for a call which would change the table, that the table can
+ * be changed: those mapped from a file, or frozen, cannot
+ *
+ *  @return      1 (having said so) if the table is read-only, else 0
+ */
+int aaRefuseReadOnly(AssociativeArray *aarray)
+{
+	if (aarray->mapped != NULL) {
+		fprintf(stderr, "Tables mapped from a file are read-only\n");
+		return 1;
+	}
+	if (aarray->perfect != NULL) {
+		fprintf(stderr, "Frozen tables are read-only\n");
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Check, for a call which works on the hash slots or dense entries,
+ * that the table has them: one kept as a radix tree does not
+ *
+ *  @return      1 (having said so) if the table is a radix tree, else 0
+ */
+int aaRefuseRadix(AssociativeArray *aarray)
+{
+	if (aarray->radix != NULL) {
+		fprintf(stderr, "Radix tree tables have no hash slots to work on\n");
+		return 1;
+	}
+	return 0;
+}
+
+/** bytes needed in each index slot to address "size" entries */
+int aaIndexWidthForSize(int size)
+{
+	if (size <= 127) return 1;
+	if (size <= 32767) return 2;
+	return 4;
+}
+
+/**
+ * Rebuild the index and the dense entries for a table of newSize slots,
+ * dropping the deleted entries (and their keys) along the way.  The
+ * surviving entries keep their insertion order.
+ *
+ * The new arrays are filled in off to the side, using a copy of the
+ * table header, and only then swapped in, so that lock-free readers
+ * are held off for as short a time as possible.  A large shared table
+ * is filled in by every thread waiting on it, not by us alone.
+ *
+ *  @return      1 on success, or -1 if memory could not be found, in
+ *				 which case the table is left as it was
+ */
+static int rebuildTable(AssociativeArray *aarray, int newSize)
+{
+	AssociativeArray rebuilt = *aarray;
+	char *oldTable = (char *) aarray->table;
+	void *oldIndex = aarray->index;
+	uint64_t *oldBloom = aarray->bloom;
+	struct CuckooFilter *oldCuckoo = aarray->cuckoo;
+	uint64_t *oldExpiry = aarray->expiry;
+	ScanMap *scanMap, *oldScanMap;
+	int oldUsed = aarray->nUsed;
+	int i, moved;
+
+	rebuilt.nAllocated = aarray->nEntries + (aarray->nEntries / 2) + INITIAL_ENTRIES;
+	if (rebuilt.nAllocated > newSize)
+		rebuilt.nAllocated = newSize;
+	rebuilt.indexWidth = aaIndexWidthForSize(newSize);
+	rebuilt.size = newSize;
+	rebuilt.nUsed = 0;
+
+	rebuilt.table = (KeyDataPair *) aaMalloc(aarray,
+			rebuilt.nAllocated * aarray->entrySize);
+	rebuilt.index = aaAllocIndex(aarray, (size_t) newSize * rebuilt.indexWidth);
+	if (rebuilt.table == NULL || rebuilt.index == NULL
+			|| aaExpiryRebuilt(aarray, &rebuilt, 1) < 0) {
+		aaFree(aarray, rebuilt.table);
+		aaFreeIndex(aarray, rebuilt.index);
+		return -1;
+	}
+
+	/**
+	 * probing the copy means that moving the entries is not charged
+	 * to the cost of any insertion
+	 */
+	moved = aaMigrateEntries(aarray, &rebuilt, oldTable, oldUsed);
+	if (moved == -2) {
+		fprintf(stderr, "Cannot place every entry in a table of size %d\n",
+				newSize);
+		aaFree(aarray, rebuilt.table);
+		aaFreeIndex(aarray, rebuilt.index);
+		aaFree(aarray, rebuilt.expiry);
+		return -1;
+	}
+	if (moved < 0) {
+		for (i = 0; i < oldUsed; i++) {
+			KeyDataPair *pair = (KeyDataPair *) (oldTable + i * aarray->entrySize);
+			HashIndex slot;
+
+			if (pair->validity != HASH_USED)
+				continue;
+
+			slot = rebuilt.hashAlgorithmPrimary(pair->key, pair->keylen, newSize);
+			if (aaSlotValidity(&rebuilt, slot) == HASH_USED) {
+				slot = rebuilt.hashProbe(&rebuilt, pair->key, pair->keylen,
+						slot, 0, NULL);
+			}
+
+			/** a probe that came back round found nowhere to put it */
+			if (aaSlotValidity(&rebuilt, slot) == HASH_USED) {
+				fprintf(stderr, "Cannot place every entry in a table of size %d\n",
+						newSize);
+				aaFree(aarray, rebuilt.table);
+				aaFreeIndex(aarray, rebuilt.index);
+				aaFree(aarray, rebuilt.expiry);
 				return -1;
 			}
+			memcpy(aaEntry(&rebuilt, rebuilt.nUsed), pair, aarray->entrySize);
+			aaIndexSet(&rebuilt, slot, rebuilt.nUsed);
+			rebuilt.nUsed++;
+		}
+	}
+
+	/** the ordered index names entries by offset, so must follow them */
+	if (aaOrderedRebuilt(aarray, &rebuilt, oldTable, oldUsed) < 0) {
+		aaFree(aarray, rebuilt.table);
+		aaFreeIndex(aarray, rebuilt.index);
+		aaFree(aarray, rebuilt.expiry);
+		return -1;
+	}
+
+	/** scans in progress follow their entries to where they now are */
+	scanMap = buildScanMap(aarray, oldTable, oldUsed);
+
+	/** without memory for a new filter, the old one still answers rightly */
+	if (aaBloomBuild(&rebuilt) < 0)
+		oldBloom = NULL;
+	if (aaCuckooBuild(&rebuilt) < 0)
+		oldCuckoo = NULL;
+
+	aaStructureBegin(aarray);
+	aarray->table = rebuilt.table;
+	aarray->nAllocated = rebuilt.nAllocated;
+	aarray->nUsed = rebuilt.nUsed;
+	aarray->index = rebuilt.index;
+	aarray->indexWidth = rebuilt.indexWidth;
+	aarray->size = rebuilt.size;
+	aarray->bloom = rebuilt.bloom;
+	aarray->bloomBlocks = rebuilt.bloomBlocks;
+	aarray->bloomHashes = rebuilt.bloomHashes;
+	aarray->cuckoo = rebuilt.cuckoo;
+	aarray->expiry = rebuilt.expiry;
+	aarray->expirySweep = 0;
+	oldScanMap = aarray->scanMap;
+	aarray->scanMap = scanMap;
+	aaFrontClear(aarray);
+	aaCacheRebuilt(aarray, oldTable, oldUsed);
+	aarray->generation++;
+	aaStructureEnd(aarray);
+
+	/** only the deleted keys are left behind, the rest moved with us */
+	for (i = 0; i < oldUsed; i++) {
+		KeyDataPair *pair = (KeyDataPair *) (oldTable + i * aarray->entrySize);
+
+		if (pair->validity != HASH_USED) {
+			aaRetireMemory(aarray, pair->key);
+			if (aarray->multimap)
+				aaRetireMemory(aarray, pair->value);
 		}
 	}
+	aaRetireMemory(aarray, oldTable);
+	aaRetireMemory(aarray, oldExpiry);
+	aaFree(aarray, oldScanMap);
+	aaRetireIndex(aarray, oldIndex);
+	aaRetireIndex(aarray, oldBloom);
+	aaRetireIndex(aarray, oldCuckoo);
+	return 1;
+}
+
+/**
+ * Make sure there is space at the end of the dense entries for one more
+ * pair, either by growing the entries or, once they have reached one
+ * per slot, by squeezing out the deleted ones.
+ */
+static int makeRoomForEntry(AssociativeArray *aarray)
+{
+	KeyDataPair *grown, *oldTable = aarray->table;
+	AssociativeArray sized = *aarray;
+	uint64_t *oldExpiry = aarray->expiry;
+	int newAllocated;
+
+	if (aarray->nUsed < aarray->nAllocated)
+		return 1;
+
+	if (aarray->nAllocated >= aarray->size)
+		return rebuildTable(aarray, aarray->size);
+
+	newAllocated = aarray->nAllocated * 2;
+	if (newAllocated > aarray->size)
+		newAllocated = aarray->size;
+
+	/** the deadlines of expiring entries grow alongside them */
+	sized.nAllocated = newAllocated;
+	if (aaExpiryRebuilt(aarray, &sized, 0) < 0)
+		return -1;
+
+	/** lock-free readers may still be looking at the old entries */
+	if (aarray->concurrency == AA_CONCURRENCY_SEQLOCK) {
+		grown = (KeyDataPair *) aaMalloc(aarray, newAllocated * aarray->entrySize);
+		if (grown != NULL)
+			memcpy(grown, oldTable, aarray->nUsed * aarray->entrySize);
+	} else {
+		grown = (KeyDataPair *) aaRealloc(aarray, aarray->table,
+				newAllocated * aarray->entrySize);
+		oldTable = NULL;
+	}
+	if (grown == NULL) {
+		aaFree(aarray, sized.expiry);
+		return -1;
+	}
+
+	aaStructureBegin(aarray);
+	aarray->table = grown;
+	aarray->nAllocated = newAllocated;
+	aarray->expiry = sized.expiry;
+	aaStructureEnd(aarray);
+
+	if (oldTable != NULL)
+		aaRetireMemory(aarray, oldTable);
+	aaRetireMemory(aarray, oldExpiry);
 	return 1;
 }
 
+/**
+ * How many slots a table must have for its probe to be sure of placing
+ * this many entries.  Quadratic steps reach only half the slots of a
+ * prime-sized table, so it needs twice as many; the others reach every
+ * slot in turn.
+ */
+static int slotsToPlace(AssociativeArray *aarray, int nEntries)
+{
+	if (aarray->hashProbe == quadraticProbe)
+		return 2 * nEntries;
+	return nEntries;
+}
+
+/**
+ * Change the number of slots in the table, rehashing every entry.
+ * On a shared table this holds off all other threads while it runs.
+ *
+ *  @param  newSize  the new size (rounded up to a prime, as for
+ *				aaCreateAssociativeArray); it must leave room for
+ *				all of the entries presently in the table, and for
+ *				quadratic probing, twice that
+ *  @return      1 on success, or -1 if the table could not be resized
+ */
+int aaResize(AssociativeArray *aarray, size_t newSize)
+{
+	int primeSize, result;
+
+	if (aaRefuseReadOnly(aarray))
+		return -1;
+
+	/** a radix tree has no slots, and grows as it needs */
+	if (aarray->radix != NULL)
+		return 1;
+
+	primeSize = getLargerPrime(newSize);
+	if (primeSize < 1) {
+		fprintf(stderr, "Cannot resize table to size %ld\n", newSize);
+		return -1;
+	}
+
+	aaLockTable(aarray);
+	if (primeSize < slotsToPlace(aarray, aarray->nEntries)) {
+		fprintf(stderr, "Cannot resize table of %d entries to size %d\n",
+				aarray->nEntries, primeSize);
+		result = -1;
+	} else {
+		result = rebuildTable(aarray, primeSize);
+	}
+	aaUnlockTable(aarray);
+
+	return result;
+}
+
 /** utilities to change names into functions, used in the function above */
 static HashAlgorithm lookupNamedHashStrategy(const char *name)
 {
@@ -145,21 +698,129 @@ static HashProbe lookupNamedProbingStrategy(const char *name)
  * Add another key and data value to the table, provided there is room.
  *
  *  @param  key  a string value used for searching later
- *  @param  value a data value associated with the key
+ *  @param  value a data value associated with the key, or for a table
+ *				 with a fixed value size, the address of the
+ *				 valueSize bytes to copy in
  *  @return      the location the data is placed within the hash table,
  *				 or a negative number if no place can be found
  */
 int aaInsert(AssociativeArray *aarray, AAKeyType key, size_t keylen, void *value)
 {
+    if (aaRefuseReadOnly(aarray))
+    {
+        return -1;
+    }
+
+    if (aarray->radix != NULL)
+    {
+        return aaRadixInsert(aarray, key, keylen, value);
+    }
+
+    return aaInsertExpiring(aarray, key, keylen, value, 0);
+}
+
+/**
+ * The work of aaInsert() and aaInsertWithTTL(): insert an entry which
+ * expires at the given deadline of aaNowMs(), or never if it is 0
+ */
+int aaInsertExpiring(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+        void *value, uint64_t deadline)
+{
+    int segment, result;
+
+    // A full cache evicts something rather than refuse the insert
+    if (aarray->cache != NULL)
+    {
+        aaCacheMakeRoom(aarray, keylen);
+    }
+
+    do {
+        segment = aaLockKey(aarray, key, keylen);
+        result = insertPair(aarray, key, keylen, value, deadline);
+        if (result >= 0 && aarray->log != NULL)
+        {
+            aaLogChange(aarray, 1, key, keylen, value, deadline);
+        }
+        aaExpireStep(aarray);
+        aaUnlockKey(aarray, segment);
+
+        // The dense entries are full: grow or squeeze them with all
+        // the writers held off, then try again
+        if (result == INSERT_NEEDS_ROOM)
+        {
+            aaLockTable(aarray);
+            if (makeRoomForEntry(aarray) < 0)
+            {
+                result = -1;
+            }
+            aaUnlockTable(aarray);
+        }
+    } while (result == INSERT_NEEDS_ROOM);
+
+    return result;
+}
+
+/**
+ * Count one more entry into the table, unless it is already full.
+ * Writers on other stripes may be doing the same, hence the CAS.
+ */
+static int reserveEntry(AssociativeArray *aarray)
+{
+    int nEntries = __atomic_load_n(&aarray->nEntries, __ATOMIC_RELAXED);
+
+    do {
+        if (nEntries >= aarray->size)
+        {
+            return -1;
+        }
+    } while ( ! __atomic_compare_exchange_n(&aarray->nEntries,
+                &nEntries, nEntries + 1, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return 1;
+}
+
+/**
+ * Claim the next of the dense entries, returning its offset, or -1 if
+ * they are all handed out and makeRoomForEntry() is needed
+ */
+static int claimEntry(AssociativeArray *aarray)
+{
+    int offset = __atomic_load_n(&aarray->nUsed, __ATOMIC_RELAXED);
+
+    do {
+        if (offset >= aarray->nAllocated)
+        {
+            return -1;
+        }
+    } while ( ! __atomic_compare_exchange_n(&aarray->nUsed,
+                &offset, offset + 1, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return offset;
+}
+
+/**
+ * The work of aaInsert(), done with the key's lock held
+ */
+static int insertPair(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+        void *value, uint64_t deadline)
+{
+    KeyDataPair *pair = NULL;
+    void *list = NULL;
+    int offset = -1;
+    int expected;
+
     // Check if the table is full
-    if (aarray->nEntries >= aarray->size)
+    if (reserveEntry(aarray) < 0)
     {
         // The table is full, cannot insert more entries
         printf("Reason for Error: Array too small/full to Accomodate for another insertion.\n");
         return -1;
     }
 
-
+retry:
+    ;
     // Calculate the initial hash index using the primary hash algorithm
     HashIndex index = aarray->hashAlgorithmPrimary(key, keylen, aarray->size);
 
@@ -167,14 +828,34 @@ int aaInsert(AssociativeArray *aarray, AAKeyType key, size_t keylen, void *value
     int originalIndex = index;
     int cost = 0;
 
-    // Loop to find an empty slot or a slot marked as deleted
-    while (aarray->table[index].validity == HASH_USED)
+    // Loop to find the key, or the empty slot that ends its probe sequence
+    while (aaSlotValidity(aarray, index) != HASH_EMPTY)
     {
         // Check if the key matches (including length)
-        if (doKeysMatch(aarray->table[index].key, aarray->table[index].keylen, key, keylen))
+        if (aaSlotValidity(aarray, index) == HASH_USED
+                && doKeysMatch(aaSlotPair(aarray, index)->key, aaSlotPair(aarray, index)->keylen, key, keylen)
+                && aaPairExpired(aarray, aaSlotPair(aarray, index)))
+        {
+            // The key is here but has expired, so reap it and carry on
+            aaExpirePair(aarray, aaSlotPair(aarray, index));
+        }
+        else if (aarray->multimap && aaSlotValidity(aarray, index) == HASH_USED
+                && doKeysMatch(aaSlotPair(aarray, index)->key, aaSlotPair(aarray, index)->keylen, key, keylen))
+        {
+            // A multimap adds the value to those the key already has
+            abandonPair(aarray, pair);
+            if (aaMultiAppend(aarray, aaSlotPair(aarray, index), value) < 0)
+            {
+                return -1;
+            }
+            return index;
+        }
+        else if (aaSlotValidity(aarray, index) == HASH_USED
+                && doKeysMatch(aaSlotPair(aarray, index)->key, aaSlotPair(aarray, index)->keylen, key, keylen))
         {
             // Key already exists, cannot insert
             printf("Key already exists");
+            abandonPair(aarray, pair);
             return -1;
         }
 
@@ -184,26 +865,128 @@ int aaInsert(AssociativeArray *aarray, AAKeyType key, size_t keylen, void *value
         // Use the probing strategy to find the next slot
         index = aarray->hashProbe(aarray, key, keylen, originalIndex, 0, &cost);
 
-        // If we've visited all slots, return an error
+        // If we've visited all slots, there is no empty one
         if (index == originalIndex)
         {
+            break;
+        }
+    }
+
+    // The key is not here, so a slot marked as deleted along the way
+    // may be reused; there can only be one if some entry is deleted
+    if (aaSlotValidity(aarray, originalIndex) != HASH_USED)
+    {
+        index = originalIndex;
+    }
+    else if (aaSlotValidity(aarray, index) != HASH_EMPTY
+            || __atomic_load_n(&aarray->nUsed, __ATOMIC_RELAXED)
+                >= __atomic_load_n(&aarray->nEntries, __ATOMIC_RELAXED))
+    {
+        index = aarray->hashProbe(aarray, key, keylen, originalIndex, 1, &cost);
+    }
+
+    // If every slot is in use, return an error
+    if (aaSlotValidity(aarray, index) == HASH_USED)
+    {
+        abandonPair(aarray, pair);
+        return -1;
+    }
+
+    // Note what the slot holds now, in case another writer takes it
+    expected = aaIndexGet(aarray, index);
+    if (expected >= 0 && __atomic_load_n(&aaEntry(aarray, expected)->validity,
+                __ATOMIC_ACQUIRE) == HASH_USED)
+    {
+        goto retry;
+    }
+
+    // Found an empty slot or a deleted slot, append the new key and data
+    // to the dense entries (if a lost race has not already done so)
+    if (pair == NULL)
+    {
+        // The values of a multimap key live in a list of their own
+        if (aarray->multimap && (list = aaMultiCreate(aarray, value)) == NULL)
+        {
+            abandonPair(aarray, NULL);
             return -1;
         }
+
+        offset = claimEntry(aarray);
+        if (offset < 0)
+        {
+            aaFree(aarray, list);
+            __atomic_fetch_sub(&aarray->nEntries, 1, __ATOMIC_RELAXED);
+            return INSERT_NEEDS_ROOM;
+        }
+
+        pair = aaEntry(aarray, offset);
+        // Keys may be binary (e.g. an int), so copy exactly keylen bytes
+        pair->key = (AAKeyType)aaMalloc(aarray, keylen);
+        if (pair->key == NULL)
+        {
+            // The entry is ours, so leave it deleted, holding nothing
+            pair->keylen = 0;
+            pair->value = NULL;
+            aaFree(aarray, list);
+            abandonPair(aarray, pair);
+            return -1;
+        }
+        memcpy(pair->key, key, keylen);
+        pair->keylen = keylen;
+        pair->referenced = 0;
+        if (aarray->expiry != NULL)
+        {
+            aarray->expiry[offset] = deadline;
+        }
+        if (aarray->multimap)
+        {
+            pair->value = list;
+        }
+        else if (aarray->valueSize == 0)
+        {
+            pair->value = value;
+        }
+        else
+        {
+            // Copy the value into the table, just after the pair
+            pair->value = NULL;
+            memcpy(pair + 1, value, aarray->valueSize);
+        }
+        pair->validity = HASH_USED;
     }
 
-    // Found an empty slot or a deleted slot, insert the new key and data
-    aarray->table[index].key = (AAKeyType)strdup((char*) key);
-    aarray->table[index].keylen = keylen;
-    aarray->table[index].value = value;
-    aarray->table[index].validity = HASH_USED;
+    // Its bits must be in the filter before any reader can find it
+    aaBloomAdd(aarray, key, keylen);
 
-    // Increment the number of entries
-    aarray->nEntries++;
+    // Point the slot at the new entry, unless a writer on another
+    // stripe got there first, in which case look again
+    if ( ! aaIndexReplace(aarray, index, expected, offset))
+    {
+        goto retry;
+    }
+
+    // Only now, so that a lost race does not add the key twice
+    aaCuckooAdd(aarray, key, keylen);
+    aaOrderedAdd(aarray, key, keylen, offset);
+    aaCacheCharge(aarray, keylen, 1);
 
     // Return the index where the data was inserted
     return index;
 }
 
+/**
+ * Give up on an insertion that had already filled in a dense entry:
+ * the entry is left as a deleted one, to be squeezed out later
+ */
+static void abandonPair(AssociativeArray *aarray, KeyDataPair *pair)
+{
+    __atomic_fetch_sub(&aarray->nEntries, 1, __ATOMIC_RELAXED);
+    if (pair != NULL)
+    {
+        pair->validity = HASH_DELETED;
+    }
+}
+
 
 
 /**
@@ -212,11 +995,86 @@ int aaInsert(AssociativeArray *aarray, AAKeyType key, size_t keylen, void *value
  *
  *  @param  key  the key to search for
  *  @return      the KeyDataPair containing the key, if the key
- *				 was present in the table, or NULL, if it was not
+ *				 was present in the table, or NULL, if it was not.
+ *				 For a table with a fixed value size this points at
+ *				 the value inside the table, and is only good until
+ *				 the next call to aaInsert()
  *  @see         KeyDataPair
  */
 void *aaLookup(AssociativeArray *aarray, AAKeyType key, size_t keylen)
 {
+    KeyDataPair *pair;
+    void *value = NULL;
+    int segment;
+
+    // Readers of a single-writer table do not lock at all
+    if (aarray->concurrency == AA_CONCURRENCY_SEQLOCK)
+    {
+        return aaSeqlockLookup(aarray, key, keylen);
+    }
+
+    // Nor do readers of a (read-only) table mapped from a file
+    if (aarray->mapped != NULL)
+    {
+        return aaMappedLookup(aarray, key, keylen);
+    }
+
+    // A frozen table finds the key's slot without probing
+    if (aarray->perfect != NULL)
+    {
+        return aaPerfectLookup(aarray, key, keylen);
+    }
+
+    // A radix tree follows the key's bytes instead of hashing them
+    if (aarray->radix != NULL)
+    {
+        return aaRadixLookup(aarray, key, keylen);
+    }
+
+    segment = aaLockKey(aarray, key, keylen);
+    pair = aaFindPair(aarray, key, keylen);
+    if (pair != NULL && aaPairExpired(aarray, pair))
+    {
+        // Holding the key's lock, we may reap it as we go
+        aaExpirePair(aarray, pair);
+        pair = NULL;
+    }
+    if (pair != NULL)
+    {
+        value = aaPairValue(aarray, pair);
+    }
+    aaUnlockKey(aarray, segment);
+
+    return value;
+}
+
+/**
+ * The probing done by aaLookup(): find the live pair holding the key,
+ * or NULL if there is none
+ */
+KeyDataPair *aaFindPair(AssociativeArray *aarray, AAKeyType key, size_t keylen)
+{
+    KeyDataPair *pair;
+    uint64_t frontHash = 0;
+
+    // Hot keys are found in the front cache, without probing
+    if (aarray->front != NULL)
+    {
+        pair = aaFrontFind(aarray, key, keylen, &frontHash);
+        if (pair != NULL)
+        {
+            aaReferencePair(aarray, pair);
+            return pair;
+        }
+    }
+
+    // Most keys that are not here stop at the filter, without probing
+    if ( ! aaBloomMayContain(aarray, key, keylen)
+            || ! aaCuckooMayContain(aarray, key, keylen))
+    {
+        return NULL;
+    }
+
     // Calculate the initial hash index using the primary hash algorithm
     HashIndex index = aarray->hashAlgorithmPrimary(key, keylen, aarray->size);
 
@@ -224,15 +1082,23 @@ void *aaLookup(AssociativeArray *aarray, AAKeyType key, size_t keylen)
     int originalIndex = index;
     int cost = 0;
 
-    // Loop to search for the key
-    while (aarray->table[index].validity == HASH_USED)
+    // Loop to search for the key, passing over deleted slots, as the
+    // key may have been inserted past them
+    while (aaSlotValidity(aarray, index) != HASH_EMPTY)
     {
         aarray -> searchCost++;
         // Check if the key matches (including length)
-        if (doKeysMatch(aarray->table[index].key, aarray->table[index].keylen, key, keylen))
+        if (aaSlotValidity(aarray, index) == HASH_USED
+                && doKeysMatch(aaSlotPair(aarray, index)->key, aaSlotPair(aarray, index)->keylen, key, keylen))
         {
-            // Key found, return the associated value
-            return aarray->table[index].value;
+            // Key found, so a cache should keep it a while longer
+            pair = aaSlotPair(aarray, index);
+            aaReferencePair(aarray, pair);
+            if (aarray->front != NULL)
+            {
+                aaFrontRemember(aarray, frontHash, pair);
+            }
+            return pair;
         }
 
         
@@ -267,6 +1133,46 @@ void *aaLookup(AssociativeArray *aarray, AAKeyType key, size_t keylen)
  */
 void *aaDelete(AssociativeArray *aarray, AAKeyType key, size_t keylen)
 {
+    void *value;
+    int segment, removed = 0;
+
+    if (aaRefuseReadOnly(aarray))
+    {
+        return NULL;
+    }
+
+    if (aarray->radix != NULL)
+    {
+        return aaRadixDelete(aarray, key, keylen);
+    }
+
+    segment = aaLockKey(aarray, key, keylen);
+    value = deletePair(aarray, key, keylen, &removed);
+
+    // A key that was not here changes nothing, so has nothing to log
+    if (removed && aarray->log != NULL)
+    {
+        aaLogChange(aarray, 0, key, keylen, NULL, 0);
+    }
+    aaExpireStep(aarray);
+    aaUnlockKey(aarray, segment);
+
+    return value;
+}
+
+/**
+ * The work of aaDelete(), done with the key's lock held; removed is
+ * set if a live pair was taken out
+ */
+static void *deletePair(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+        int *removed)
+{
+    if ( ! aaBloomMayContain(aarray, key, keylen)
+            || ! aaCuckooMayContain(aarray, key, keylen))
+    {
+        return NULL;
+    }
+
     // Calculate the initial hash index using the primary hash algorithm
     HashIndex index = aarray->hashAlgorithmPrimary(key, keylen, aarray->size);
 
@@ -274,17 +1180,28 @@ void *aaDelete(AssociativeArray *aarray, AAKeyType key, size_t keylen)
     int originalIndex = index;
     int cost = 0;
 
-    // Loop to search for the key
-    while (aarray->table[index].validity == HASH_USED)
+    // Loop to search for the key, passing over deleted slots
+    while (aaSlotValidity(aarray, index) != HASH_EMPTY)
     {
         // Check if the key matches (including length)
         aarray -> deleteCost++;
-        if (doKeysMatch(aarray->table[index].key, aarray->table[index].keylen, key, keylen))
+        if (aaSlotValidity(aarray, index) == HASH_USED
+                && doKeysMatch(aaSlotPair(aarray, index)->key, aaSlotPair(aarray, index)->keylen, key, keylen))
         {
+            KeyDataPair *pair = aaSlotPair(aarray, index);
+
+            // An expired key is reaped, as though it were already gone
+            if (aaPairExpired(aarray, pair))
+            {
+                aaExpirePair(aarray, pair);
+                return NULL;
+            }
+
             // Key found, mark the slot as deleted (tombstone)
-            aarray->table[index].validity = HASH_DELETED;
+            aaRemovePair(aarray, pair);
+            *removed = 1;
             // Return the associated value
-            return aarray->table[index].value;
+            return aaPairValue(aarray, pair);
         }
 
         
@@ -306,6 +1223,21 @@ void *aaDelete(AssociativeArray *aarray, AAKeyType key, size_t keylen)
     return NULL;
 }
 
+/**
+ * Mark a live pair as deleted, and take it out of everything that
+ * counts or filters the live pairs.  The caller holds the key's lock,
+ * or the table's.
+ */
+void aaRemovePair(AssociativeArray *aarray, KeyDataPair *pair)
+{
+	aaFrontForget(aarray, pair);
+	aaOrderedRemove(aarray, pair);
+	__atomic_store_n(&pair->validity, HASH_DELETED, __ATOMIC_RELEASE);
+	__atomic_fetch_sub(&aarray->nEntries, 1, __ATOMIC_RELAXED);
+	aaCuckooRemove(aarray, pair->key, pair->keylen);
+	aaCacheCharge(aarray, pair->keylen, -1);
+}
+
 
 /**
  * Print out the entire aarray contents
@@ -315,28 +1247,37 @@ void aaPrintContents(FILE *fp, AssociativeArray *aarray, char * tag)
 	char keybuffer[128];
 	int i;
 
+	if (aarray->radix != NULL) {
+		aaRadixPrint(fp, aarray, tag);
+		return;
+	}
+
+	aaLockTable(aarray);
 	fprintf(fp, "%sDumping aarray of %d entries:\n", tag, aarray->size);
 	for (i = 0; i < aarray->size; i++) {
+		KeyDataPair *pair = aaSlotPair(aarray, i);
+
 		fprintf(fp, "%s  ", tag);
-		if (aarray->table[i].validity == HASH_USED) {
+		if (aaSlotValidity(aarray, i) == HASH_USED) {
 			printableKey(keybuffer, 128,
-					aarray->table[i].key,
-					aarray->table[i].keylen);
+					pair->key,
+					pair->keylen);
 			fprintf(fp, "%d : in use : '%s'\n", i, keybuffer);
 		} else {
-			if (aarray->table[i].validity == HASH_EMPTY) {
+			if (aaSlotValidity(aarray, i) == HASH_EMPTY) {
 				fprintf(fp, "%d : empty (NULL)\n", i);
-			} else if ( aarray->table[i].validity == HASH_DELETED) {
+			} else if (aaSlotValidity(aarray, i) == HASH_DELETED) {
 				printableKey(keybuffer, 128,
-						aarray->table[i].key,
-						aarray->table[i].keylen);
+						pair->key,
+						pair->keylen);
 				fprintf(fp, "%d : empty (deleted - was '%s')\n", i, keybuffer);
 			} else {
 				fprintf(fp, "%d : invalid validity state %d\n", i,
-						aarray->table[i].validity);
+						aaSlotValidity(aarray, i));
 			}
 		}
 	}
+	aaUnlockTable(aarray);
 }
 
 
@@ -346,10 +1287,14 @@ void aaPrintContents(FILE *fp, AssociativeArray *aarray, char * tag)
  */
 void aaPrintSummary(FILE *fp, AssociativeArray *aarray)
 {
-	fprintf(fp, "Associative array contains %d entries in a table of %d size\n",
-			aarray->nEntries, aarray->size);
-	fprintf(fp, "Strategies used: '%s' hash, '%s' secondary hash and '%s' probing\n",
-			aarray->hashNamePrimary, aarray->hashNameSecondary, aarray->probeName);
+	if (aarray->radix != NULL) {
+		aaRadixSummary(fp, aarray);
+	} else {
+		fprintf(fp, "Associative array contains %d entries in a table of %d size\n",
+				aarray->nEntries, aarray->size);
+		fprintf(fp, "Strategies used: '%s' hash, '%s' secondary hash and '%s' probing\n",
+				aarray->hashNamePrimary, aarray->hashNameSecondary, aarray->probeName);
+	}
 	fprintf(fp, "Costs accrued due to probing:\n");
 	fprintf(fp, "  Insertion : %d\n", aarray->insertCost);
 	fprintf(fp, "  Search    : %d\n", aarray->searchCost);
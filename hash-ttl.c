@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hashtools.h"
+
+/**
+ * Entries given a time to live carry a deadline, in milliseconds of the
+ * monotonic clock, in an array running alongside the dense entries: one
+ * deadline per entry, 0 for none.  Tables which never use a TTL never
+ * allocate it, and so pay nothing but the NULL check.
+ *
+ * An expired entry is reaped (deleted, and handed to the expire
+ * function) in one of three ways:
+ *
+ *   - lazily, by the operation that trips over it: a lookup or delete
+ *     of its key, or an insert of the same key again;
+ *   - incrementally, by every insert and delete, which looks at the
+ *     next EXPIRE_STEP entries of a sweep round the dense entries;
+ *   - or by aaExpireSweep(), for a timer to call.
+ *
+ * Only the first and last work on a striped table, as the incremental
+ * step could otherwise reap an entry under another writer's lock.
+ * Lock-free readers of a seqlock table just see expired entries as
+ * missing, leaving the writer to reap them.
+ */
+#define	EXPIRE_STEP		4
+
+
+/** the monotonic clock, in milliseconds */
+uint64_t aaNowMs(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Has an entry's deadline passed?  Called only for entries that have
+ * one, so that tables without expiring entries never read the clock.
+ */
+int aaDeadlinePassed(uint64_t deadline)
+{
+	return deadline != 0 && deadline <= aaNowMs();
+}
+
+/** the real-time clock, in milliseconds */
+static uint64_t wallNowMs(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * The monotonic clock means nothing to another process, so logs and
+ * snapshots hold deadlines in milliseconds of the real-time clock
+ * instead, still 0 for none.  One already passed is written as now,
+ * and so reads back as passed.
+ */
+uint64_t aaDeadlineToFile(uint64_t deadline)
+{
+	uint64_t now;
+
+	if (deadline == 0)
+		return 0;
+	now = aaNowMs();
+	return wallNowMs() + (deadline > now ? deadline - now : 0);
+}
+
+uint64_t aaDeadlineFromFile(uint64_t stored)
+{
+	uint64_t now, deadline;
+
+	if (stored == 0)
+		return 0;
+	now = wallNowMs();
+	deadline = aaNowMs() + (stored > now ? stored - now : 0);
+	return deadline != 0 ? deadline : 1;
+}
+
+/**
+ * Give the table its array of deadlines, if it has none yet
+ *
+ *  @return      1 on success, or -1 if there was no memory for it
+ */
+int aaEnableExpiry(AssociativeArray *aarray)
+{
+	uint64_t *expiry;
+	int result = 1;
+
+	aaLockTable(aarray);
+	if (aarray->expiry == NULL) {
+		expiry = (uint64_t *) aaMalloc(aarray, aarray->nAllocated * sizeof(uint64_t));
+		if (expiry == NULL) {
+			result = -1;
+		} else {
+			memset(expiry, 0, aarray->nAllocated * sizeof(uint64_t));
+			aaStructureBegin(aarray);
+			aarray->expiry = expiry;
+			aaStructureEnd(aarray);
+		}
+	}
+	aaUnlockTable(aarray);
+
+	return result;
+}
+
+/**
+ * Make the deadlines for a header whose entries are about to be grown
+ * or rebuilt.  The entries kept, and so their deadlines, stay in the
+ * same order: a rebuild keeps only the live ones, while growing the
+ * entries keeps them all.
+ *
+ *  @param  rebuilt  the new header, with nAllocated set; its expiry is
+ *				 set on success
+ *  @return      1 on success, or -1 if there was no memory for it
+ */
+int aaExpiryRebuilt(AssociativeArray *aarray, AssociativeArray *rebuilt,
+		int liveOnly)
+{
+	int i, n = 0;
+
+	rebuilt->expiry = NULL;
+	if (aarray->expiry == NULL)
+		return 1;
+
+	rebuilt->expiry = (uint64_t *) aaMalloc(aarray,
+			rebuilt->nAllocated * sizeof(uint64_t));
+	if (rebuilt->expiry == NULL)
+		return -1;
+	memset(rebuilt->expiry, 0, rebuilt->nAllocated * sizeof(uint64_t));
+
+	for (i = 0; i < aarray->nUsed; i++) {
+		if (liveOnly && aaEntry(aarray, i)->validity != HASH_USED)
+			continue;
+		rebuilt->expiry[n++] = aarray->expiry[i];
+	}
+	return 1;
+}
+
+/**
+ * Reap an expired entry, with the key's lock (or the table's) held
+ */
+void aaExpirePair(AssociativeArray *aarray, KeyDataPair *pair)
+{
+	aaRemovePair(aarray, pair);
+
+	/** replaying the log must not bring the entry back */
+	if (aarray->log != NULL)
+		aaLogChange(aarray, 0, pair->key, pair->keylen, NULL, 0);
+
+	if (aarray->expireFunction != NULL)
+		(*aarray->expireFunction)(pair->key, pair->keylen,
+				aaPairValue(aarray, pair), aarray->expireUserdata);
+}
+
+/**
+ * Look at the next count entries of the sweep, reaping those expired
+ *
+ *  @return      the number reaped
+ */
+static int sweep(AssociativeArray *aarray, int count)
+{
+	uint64_t now = aaNowMs();
+	int nReaped = 0;
+
+	if (count > aarray->nUsed)
+		count = aarray->nUsed;
+
+	while (count-- > 0) {
+		int i = aarray->expirySweep++;
+		uint64_t deadline;
+
+		if (aarray->expirySweep >= aarray->nUsed)
+			aarray->expirySweep = 0;
+
+		deadline = aarray->expiry[i];
+		if (deadline != 0 && deadline <= now
+				&& aaEntry(aarray, i)->validity == HASH_USED) {
+			aaExpirePair(aarray, aaEntry(aarray, i));
+			nReaped++;
+		}
+	}
+	return nReaped;
+}
+
+/**
+ * The incremental step run by each insert and delete, with the key's
+ * lock held
+ */
+void aaExpireStep(AssociativeArray *aarray)
+{
+	if (aarray->expiry != NULL && aarray->concurrency != AA_CONCURRENCY_STRIPED)
+		sweep(aarray, EXPIRE_STEP);
+}
+
+/**
+ * Reap expired entries among the next maxEntries entries of the sweep
+ * round the table, so that a timer calling this now and then keeps the
+ * table clear of expired entries nobody asks for, a bounded amount of
+ * work at a time.  A maxEntries of 0 sweeps the whole table.
+ *
+ *  @return      the number of entries reaped
+ */
+int aaExpireSweep(AssociativeArray *aarray, int maxEntries)
+{
+	int nReaped = 0;
+
+	/** a frozen table only passes its expired entries over */
+	if (aarray->expiry == NULL || aarray->perfect != NULL)
+		return 0;
+
+	aaLockTable(aarray);
+	nReaped = sweep(aarray, (maxEntries > 0) ? maxEntries : aarray->nUsed);
+	aaUnlockTable(aarray);
+
+	return nReaped;
+}
+
+/**
+ * As aaInsert(), but the entry expires ttlMs milliseconds from now,
+ * after which it is looked up as though it had been deleted.  A ttlMs
+ * of 0 or less never expires.
+ */
+int aaInsertWithTTL(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+		void *value, long ttlMs)
+{
+	if (aaRefuseReadOnly(aarray))
+		return -1;
+	if (ttlMs <= 0)
+		return aaInsert(aarray, key, keylen, value);
+	if (aaRefuseRadix(aarray) || aaRefuseMultimap(aarray))
+		return -1;
+
+	if (aaEnableExpiry(aarray) < 0)
+		return -1;
+	return aaInsertExpiring(aarray, key, keylen, value, aaNowMs() + ttlMs);
+}
+
+/**
+ * Have expired entries, when reaped, passed to expire along with
+ * userdata, so that their values can be freed
+ */
+void aaSetExpireFunction(AssociativeArray *aarray, AAEvictFunction expire, void *userdata)
+{
+	aaLockTable(aarray);
+	aarray->expireFunction = expire;
+	aarray->expireUserdata = userdata;
+	aaUnlockTable(aarray);
+}
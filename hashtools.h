@@ -2,6 +2,9 @@
 #define	__HASHING_TOOLS_HEADER__
 
 #include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
 
 #include <aarray.h>
 
@@ -12,17 +15,71 @@ typedef size_t HashIndex;
 typedef struct AssociativeArray AssociativeArray;
 
 typedef HashIndex (*HashAlgorithm)(AAKeyType key, size_t keyLength, HashIndex tableSize);
+typedef HashIndex (*HashProbeStep)(HashIndex index, int attempt, HashIndex tableSize);
 typedef HashIndex (*HashProbe)(struct AssociativeArray *table, AAKeyType key, size_t keyLength, int startIndex, int, int *cost);
 
+/**
+ * A rebuild of a shared table in progress.  The old entries are split
+ * into chunks, which any thread waiting on the table claims and helps
+ * to move; see hash-migrate.c
+ */
+typedef struct AAMigration {
+	int round;
+	int nChunks;
+	int nextChunk;
+	int doneChunks;
+	int helpers;
+	char *oldTable;
+	int oldUsed;
+	int *chunkStart;
+	int failed;
+	struct AssociativeArray *rebuilt;
+} AAMigration;
+
 typedef struct KeyDataPair {
 	AAKeyType key;
 	size_t keylen;
 	void *value;
 	int validity;
+	int referenced;		/* CLOCK reference bit; see hash-cache.c */
 } KeyDataPair;
 
+/**
+ * The table is kept in two parts, in the style of the "compact dict":
+ * the KeyDataPair entries live in a dense array in insertion order, and
+ * the hash slots are a sparse index holding only the offset of the
+ * entry that lives there.  The index uses the narrowest of 8, 16 or 32
+ * bit offsets that can address "size" entries, so an empty slot costs
+ * at most 4 bytes rather than a whole KeyDataPair.  Offsets are stored
+ * plus one, so that an index of all zero bytes is empty, and a fresh
+ * index needs no filling in (see hash-memory.c).
+ *
+ * A slot whose entry has been deleted keeps pointing at it, so the
+ * entry's validity of HASH_DELETED acts as the tombstone.  Rebuilding
+ * the table moves the entries, and bumps the generation to say so.
+ *
+ * If the table was created with a fixed valueSize, each value is copied
+ * into the bytes directly following its KeyDataPair, so the entries are
+ * entrySize bytes apart rather than sizeof(KeyDataPair).
+ */
 struct AssociativeArray {
 	KeyDataPair *table;
+	size_t valueSize;
+	size_t entrySize;
+	int nUsed;
+	int nAllocated;
+	void *index;
+	int indexWidth;
+	int memoryFlags;
+	uint64_t *bloom;
+	int bloomBlocks;
+	int bloomHashes;
+	int bloomBitsPerKey;
+	struct CuckooFilter *cuckoo;
+	int cuckooBits;
+	struct FrontCache *front;
+	AAAllocator allocator;
+	int generation;
 	int size;
 	int nEntries;
 	HashProbe hashProbe;
@@ -34,6 +91,51 @@ struct AssociativeArray {
 	int searchCost;
 	int insertCost;
 	int deleteCost;
+
+	/** sharing between threads; see hash-concurrency.c */
+	int concurrency;
+	int nSegments;
+	unsigned int *segmentSeq;
+	unsigned int structureSeq;
+	pthread_mutex_t writerLock;
+	pthread_mutex_t *stripeLocks;
+	struct RetiredMemory *retired;
+	int nRetired;
+	AAMigration migration;
+
+	/** set for a read-only table mapped from a file; see hash-mapped.c */
+	struct MappedImage *mapped;
+
+	/** set for a table frozen by aaFreezePerfect(); see hash-perfect.c */
+	struct PerfectHash *perfect;
+
+	/** set for a table whose changes are logged; see hash-log.c */
+	struct AALog *log;
+
+	/** set for a table used as a bounded cache; see hash-cache.c */
+	struct AACache *cache;
+
+	/** set for a table whose keys hold lists of values; see hash-multi.c */
+	int multimap;
+
+	/** set for a table kept as a radix tree, not hashed; see hash-radix.c */
+	struct RadixTree *radix;
+
+	/** set for a table whose keys are also kept in order; see hash-ordered.c */
+	struct OrderedIndex *ordered;
+
+	/** where the entries went at the last rebuild; see aaScan() */
+	struct ScanMap *scanMap;
+
+	/** deadlines of entries given a time to live; see hash-ttl.c */
+	uint64_t *expiry;
+	int expirySweep;
+	AAEvictFunction expireFunction;
+	void *expireUserdata;
+
+	/** a snapshot being written by a child process; see hash-snapshot.c */
+	pid_t snapshotPid;
+	int snapshotFd;
 };
 
 
@@ -41,17 +143,283 @@ struct AssociativeArray {
 #define	HASH_USED		1
 #define	HASH_DELETED	2
 
+/** index value for a slot which has never held an entry */
+#define	HASH_INDEX_EMPTY	(-1)
+
+/**
+ * all memory belonging to a table is taken from, and given back to, the
+ * allocator it was created with
+ */
+extern const AAAllocator aaDefaultAllocator;
+
+static inline void *
+aaMalloc(const AssociativeArray *aarray, size_t size)
+{
+	return (*aarray->allocator.allocate)(size, aarray->allocator.context);
+}
+
+static inline void *
+aaRealloc(const AssociativeArray *aarray, void *memory, size_t size)
+{
+	return (*aarray->allocator.reallocate)(memory, size, aarray->allocator.context);
+}
+
+static inline void
+aaFree(const AssociativeArray *aarray, void *memory)
+{
+	if (memory != NULL)
+		(*aarray->allocator.release)(memory, aarray->allocator.context);
+}
+
+char *aaStrdup(const AssociativeArray *aarray, const char *string);
+
+void *aaMultiFirst(const AssociativeArray *aarray, const KeyDataPair *pair);
+
+/** the dense entry at the given offset */
+static inline KeyDataPair *
+aaEntry(const AssociativeArray *aarray, int offset)
+{
+	return (KeyDataPair *) ((char *) aarray->table
+			+ (size_t) offset * aarray->entrySize);
+}
+
+/**
+ * the value of a pair as the user sees it: the pointer that was stored,
+ * or the address of the inline copy for a fixed value size table, or
+ * the first of the values of a multimap
+ */
+static inline void *
+aaPairValue(const AssociativeArray *aarray, KeyDataPair *pair)
+{
+	if (aarray->multimap) return aaMultiFirst(aarray, pair);
+	if (aarray->valueSize == 0) return pair->value;
+	return (void *) (pair + 1);
+}
+
+/** expiring entries, in hash-ttl.c */
+uint64_t aaNowMs(void);
+int aaDeadlinePassed(uint64_t deadline);
+uint64_t aaDeadlineToFile(uint64_t deadline);
+uint64_t aaDeadlineFromFile(uint64_t stored);
+int aaEnableExpiry(AssociativeArray *aarray);
+
+/** has the entry a deadline (see hash-ttl.c), now passed? */
+static inline int
+aaPairExpired(const AssociativeArray *aarray, const KeyDataPair *pair)
+{
+	if (aarray->expiry == NULL) return 0;
+	return aaDeadlinePassed(aarray->expiry[((const char *) pair
+			- (const char *) aarray->table) / aarray->entrySize]);
+}
+
+/** is the entry one a user should see: in use, and not expired? */
+static inline int
+aaPairLive(const AssociativeArray *aarray, const KeyDataPair *pair)
+{
+	return pair->validity == HASH_USED && ! aaPairExpired(aarray, pair);
+}
+
+/** note a lookup of the pair, so that a cache (see hash-cache.c) keeps it */
+static inline void
+aaReferencePair(const AssociativeArray *aarray, KeyDataPair *pair)
+{
+	if (aarray->cache != NULL
+			&& ! __atomic_load_n(&pair->referenced, __ATOMIC_RELAXED))
+		__atomic_store_n(&pair->referenced, 1, __ATOMIC_RELAXED);
+}
+
+/** return the entry offset stored in the given slot of the index */
+static inline int
+aaIndexGet(const AssociativeArray *aarray, HashIndex slot)
+{
+	switch (aarray->indexWidth) {
+	case 1:	return __atomic_load_n(&((signed char *) aarray->index)[slot], __ATOMIC_ACQUIRE) - 1;
+	case 2:	return __atomic_load_n(&((short *) aarray->index)[slot], __ATOMIC_ACQUIRE) - 1;
+	}
+	return __atomic_load_n(&((int *) aarray->index)[slot], __ATOMIC_ACQUIRE) - 1;
+}
+
+/** store an entry offset (or HASH_INDEX_EMPTY) into a slot of the index */
+static inline void
+aaIndexSet(AssociativeArray *aarray, HashIndex slot, int offset)
+{
+	switch (aarray->indexWidth) {
+	case 1:	__atomic_store_n(&((signed char *) aarray->index)[slot], (signed char) (offset + 1), __ATOMIC_RELEASE); return;
+	case 2:	__atomic_store_n(&((short *) aarray->index)[slot], (short) (offset + 1), __ATOMIC_RELEASE); return;
+	}
+	__atomic_store_n(&((int *) aarray->index)[slot], offset + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * point a slot at a new entry offset, provided it still holds the
+ * expected one; returns false if another writer changed it first
+ */
+static inline int
+aaIndexReplace(AssociativeArray *aarray, HashIndex slot, int expected, int offset)
+{
+	expected++;
+	offset++;
+	switch (aarray->indexWidth) {
+	case 1: {
+		signed char old = (signed char) expected;
+		return __atomic_compare_exchange_n(&((signed char *) aarray->index)[slot],
+				&old, (signed char) offset, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	}
+	case 2: {
+		short old = (short) expected;
+		return __atomic_compare_exchange_n(&((short *) aarray->index)[slot],
+				&old, (short) offset, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	}
+	}
+	return __atomic_compare_exchange_n(&((int *) aarray->index)[slot],
+			&expected, offset, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+/**
+ * the KeyDataPair a slot refers to, or NULL if the slot is empty.  A
+ * lock-free reader holding a stale copy of the header can find offsets
+ * past the entries it knows of; it will retry, so treat them as empty.
+ */
+static inline KeyDataPair *
+aaSlotPair(const AssociativeArray *aarray, HashIndex slot)
+{
+	int offset = aaIndexGet(aarray, slot);
+
+	if (offset < 0 || offset >= aarray->nAllocated) return NULL;
+	return aaEntry(aarray, offset);
+}
+
+/** the validity (HASH_EMPTY, HASH_USED or HASH_DELETED) of a slot */
+static inline int
+aaSlotValidity(const AssociativeArray *aarray, HashIndex slot)
+{
+	KeyDataPair *pair = aaSlotPair(aarray, slot);
+
+	if (pair == NULL) return HASH_EMPTY;
+	return __atomic_load_n(&pair->validity, __ATOMIC_ACQUIRE);
+}
+
 /** prototypes */
 HashIndex hashByWeightSum(AAKeyType key, size_t keyLength, HashIndex size);
 HashIndex hashByLength(AAKeyType key, size_t keyLength, HashIndex size);
 HashIndex hashBySum(AAKeyType key, size_t keyLength, HashIndex tableSize);
+uint64_t aaMix64(uint64_t x);
+uint64_t aaKeyHash64(AAKeyType key, size_t keyLength, uint64_t seed);
 HashIndex linearProbe(AssociativeArray *table, AAKeyType key, size_t keyLength, int index, int stopOnInvalid, int *cost);
 HashIndex  quadraticProbe(AssociativeArray *table, AAKeyType key, size_t keyLength, int index, int stopOnInvalid, int *cost);
+HashIndex linearProbeStep(HashIndex index, int attempt, HashIndex size);
+HashIndex quadraticProbeStep(HashIndex index, int attempt, HashIndex size);
 HashIndex  doubleHashProbe(AssociativeArray *table, AAKeyType key, size_t keyLength, int index, int stopOnInvalid, int *cost);
 
 int getLargerPrime(int value);
 
+KeyDataPair *aaFindPair(AssociativeArray *aarray, AAKeyType key, size_t keylen);
+
+/** concurrency support, in hash-concurrency.c */
+int aaLockKey(AssociativeArray *aarray, AAKeyType key, size_t keylen);
+void aaUnlockKey(AssociativeArray *aarray, int segment);
+void aaLockTable(AssociativeArray *aarray);
+void aaUnlockTable(AssociativeArray *aarray);
+void aaStructureBegin(AssociativeArray *aarray);
+void aaStructureEnd(AssociativeArray *aarray);
+void aaRetireMemory(AssociativeArray *aarray, void *memory);
+void aaRetireIndex(AssociativeArray *aarray, void *index);
+void *aaSeqlockLookup(AssociativeArray *aarray, AAKeyType key, size_t keylen);
+void aaFreeConcurrency(AssociativeArray *aarray);
+
+/** allocation of the index, in hash-memory.c */
+void *aaAllocIndex(AssociativeArray *aarray, size_t bytes);
+void aaFreeIndex(AssociativeArray *aarray, void *index);
+
+/** the Bloom filter in front of lookups, in hash-bloom.c */
+void aaBloomAdd(AssociativeArray *aarray, AAKeyType key, size_t keylen);
+int aaBloomMayContain(const AssociativeArray *aarray, AAKeyType key, size_t keylen);
+int aaBloomBuild(AssociativeArray *aarray);
+
+/** the cuckoo filter, which keys leave as they are deleted, in hash-cuckoo.c */
+void aaCuckooAdd(AssociativeArray *aarray, AAKeyType key, size_t keylen);
+void aaCuckooRemove(AssociativeArray *aarray, AAKeyType key, size_t keylen);
+int aaCuckooMayContain(const AssociativeArray *aarray, AAKeyType key, size_t keylen);
+int aaCuckooBuild(AssociativeArray *aarray);
+
+/** the front cache of keys lately found, in hash-front.c */
+KeyDataPair *aaFrontFind(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+		uint64_t *hash);
+void aaFrontRemember(AssociativeArray *aarray, uint64_t hash, KeyDataPair *pair);
+void aaFrontForget(AssociativeArray *aarray, KeyDataPair *pair);
+void aaFrontClear(AssociativeArray *aarray);
+
+/** the ordered index of the keys, in hash-ordered.c */
+void aaOrderedAdd(AssociativeArray *aarray, AAKeyType key, size_t keylen, int offset);
+void aaOrderedRemove(AssociativeArray *aarray, KeyDataPair *pair);
+int aaOrderedRebuilt(AssociativeArray *aarray, AssociativeArray *rebuilt,
+		char *oldTable, int oldUsed);
+void aaFreeOrdered(AssociativeArray *aarray, struct OrderedIndex *index);
+
+/** tables kept as an adaptive radix tree, in hash-radix.c */
+int aaRadixCreate(AssociativeArray *aarray);
+int aaRadixInsert(AssociativeArray *aarray, AAKeyType key, size_t keylen, void *value);
+void *aaRadixLookup(AssociativeArray *aarray, AAKeyType key, size_t keylen);
+void *aaRadixDelete(AssociativeArray *aarray, AAKeyType key, size_t keylen);
+int aaRadixScan(AssociativeArray *aarray, AAKeyType from, size_t fromlen,
+		int (*inRange)(AAKeyType key, size_t keylen, AAKeyType bound, size_t boundlen),
+		AAKeyType bound, size_t boundlen,
+		int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *userdata),
+		void *userdata);
+void aaRadixPrint(FILE *fp, AssociativeArray *aarray, char *tag);
+void aaRadixSummary(FILE *fp, AssociativeArray *aarray);
+void aaFreeRadix(AssociativeArray *aarray);
+int aaRefuseRadix(AssociativeArray *aarray);
+
+/** keys holding lists of values, in hash-multi.c */
+void *aaMultiCreate(AssociativeArray *aarray, void *value);
+int aaMultiAppend(AssociativeArray *aarray, KeyDataPair *pair, void *value);
+int aaRefuseMultimap(AssociativeArray *aarray);
+
+/** removing a live pair, as aaDelete() does, in hash-table.c */
+void aaRemovePair(AssociativeArray *aarray, KeyDataPair *pair);
+int aaInsertExpiring(AssociativeArray *aarray, AAKeyType key, size_t keylen,
+		void *value, uint64_t deadline);
+
+/** reaping expired entries, in hash-ttl.c */
+int aaExpiryRebuilt(AssociativeArray *aarray, AssociativeArray *rebuilt, int liveOnly);
+void aaExpirePair(AssociativeArray *aarray, KeyDataPair *pair);
+void aaExpireStep(AssociativeArray *aarray);
+
+/** eviction from a table used as a cache, in hash-cache.c */
+void aaCacheMakeRoom(AssociativeArray *aarray, size_t keylen);
+void aaCacheCharge(AssociativeArray *aarray, size_t keylen, int direction);
+void aaCacheRebuilt(AssociativeArray *aarray, char *oldTable, int oldUsed);
+void aaFreeCache(AssociativeArray *aarray);
+
+/** read-only tables mapped from a file, in hash-mapped.c */
+void *aaMappedLookup(AssociativeArray *aarray, AAKeyType key, size_t keylen);
+int aaMappedIterate(AssociativeArray *aarray,
+		int (*userfunction)(AAKeyType key, size_t keylen, void *datavalue, void *userdata),
+		void *userdata);
+void aaCloseMapped(AssociativeArray *aarray);
+
+/** read-only tables indexed by a perfect hash, in hash-perfect.c */
+void *aaPerfectLookup(AssociativeArray *aarray, AAKeyType key, size_t keylen);
+KeyDataPair *aaPerfectFindPair(AssociativeArray *aarray, AAKeyType key, size_t keylen);
+void aaFreePerfect(AssociativeArray *aarray);
+
+int aaRefuseReadOnly(AssociativeArray *aarray);
+int aaIndexWidthForSize(int size);
+
+/** snapshots and the change log, in hash-snapshot.c and hash-log.c */
+int aaWriteSnapshot(AssociativeArray *aarray, FILE *fp);
+void aaLogChange(AssociativeArray *aarray, int insert,
+		AAKeyType key, size_t keylen, void *value, uint64_t deadline);
+void aaCloseLog(AssociativeArray *aarray);
+
+/** cooperative rebuilding of shared tables, in hash-migrate.c */
+int aaMigrateEntries(AssociativeArray *aarray, AssociativeArray *rebuilt,
+		char *oldTable, int oldUsed);
+int aaHelpMigration(AssociativeArray *aarray);
+
 int doKeysMatch(AAKeyType key1, size_t key1len, AAKeyType key2, size_t key2len);
+int aaCompareKeys(AAKeyType key1, size_t key1len, AAKeyType key2, size_t key2len);
 int printableKey(char *buffer, int bufferlen, AAKeyType key, size_t keylen);
 
 #endif
@@ -56,15 +56,33 @@ loadAssociativeArray(AssociativeArray *assocArray, char *filename, int useIntKey
 	return nEntries;
 }
 
+/**
+ * Look up every value of the key: all of those it has in a multimap,
+ * otherwise the one, which is put in *single and returned as an array
+ * of that one value
+ */
+static char **
+lookupValues(AssociativeArray *assocArray, AAKeyType key, size_t keylen,
+		int multimap, char **single, int *nValues)
+{
+	if (multimap)
+		return (char **) aaLookupAll(assocArray, key, keylen, nValues);
+
+	*single = aaLookup(assocArray, key, keylen);
+	*nValues = (*single != NULL);
+	return single;
+}
+
 /**
  * Query the array with all the values in the given file
  */
 static int
-queryAssociativeArray(AssociativeArray *assocArray, char *filename, int useIntKey)
+queryAssociativeArray(AssociativeArray *assocArray, char *filename, int useIntKey,
+		int multimap)
 {
 	char linebuffer[LINE_MAX];
-	char *strkey = NULL, *value = NULL;
-	int intkey;
+	char *strkey = NULL, *single = NULL, **values = NULL;
+	int intkey, nValues, i;
 	FILE *fp = NULL;
 
 	fp = fopen(filename, "r");
@@ -81,19 +99,23 @@ queryAssociativeArray(AssociativeArray *assocArray, char *filename, int useIntKe
 				return -1;
 			}
 
-			value = aaLookup(assocArray, (AAKeyType) &intkey, sizeof(int));
-			if (value == NULL) {
+			values = lookupValues(assocArray, (AAKeyType) &intkey, sizeof(int),
+					multimap, &single, &nValues);
+			if (nValues == 0) {
 				printf("LOOKUP: key (%d) produced no value\n", intkey);
-			} else {
-				printf("LOOKUP: key (%d) produced value '%s'\n", intkey, value);
+			}
+			for (i = 0; i < nValues; i++) {
+				printf("LOOKUP: key (%d) produced value '%s'\n", intkey, values[i]);
 			}
 
 		} else {
-			value = aaLookup(assocArray, (AAKeyType) strkey, strlen(strkey));
-			if (value == NULL) {
+			values = lookupValues(assocArray, (AAKeyType) strkey, strlen(strkey),
+					multimap, &single, &nValues);
+			if (nValues == 0) {
 				printf("LOOKUP: key '%s' produced no value\n", strkey);
-			} else {
-				printf("LOOKUP: key '%s' produced value '%s'\n", strkey, value);
+			}
+			for (i = 0; i < nValues; i++) {
+				printf("LOOKUP: key '%s' produced value '%s'\n", strkey, values[i]);
 			}
 		}
 	}
@@ -105,14 +127,16 @@ queryAssociativeArray(AssociativeArray *assocArray, char *filename, int useIntKe
 /**
  * Delete the selected values from the array.  Note that we free the values
  * as otherwise they are memory leaks as we are managing the memory for
- * these values outside of the library
+ * these values outside of the library.  aaDelete() hands back only the
+ * first value of a multimap key, so the others are freed beforehand
  */
 static int
-deleteFromAssociativeArray(AssociativeArray *assocArray, char *filename, int useIntKey)
+deleteFromAssociativeArray(AssociativeArray *assocArray, char *filename, int useIntKey,
+		int multimap)
 {
 	char linebuffer[LINE_MAX];
-	char *strkey = NULL, *value = NULL;
-	int intkey;
+	char *strkey = NULL, *value = NULL, *single = NULL, **values;
+	int intkey, nValues, i;
 	FILE *fp = NULL;
 
 	fp = fopen(filename, "r");
@@ -129,6 +153,11 @@ deleteFromAssociativeArray(AssociativeArray *assocArray, char *filename, int use
 				return -1;
 			}
 
+			values = lookupValues(assocArray, (AAKeyType) &intkey, sizeof(int),
+					multimap, &single, &nValues);
+			for (i = 1; i < nValues; i++) {
+				free(values[i]);
+			}
 			value = aaDelete(assocArray, (AAKeyType) &intkey, sizeof(int));
 			if (value == NULL) {
 				printf("DELETE: key (%d) produced no value\n", intkey);
@@ -138,6 +167,11 @@ deleteFromAssociativeArray(AssociativeArray *assocArray, char *filename, int use
 			}
 
 		} else {
+			values = lookupValues(assocArray, (AAKeyType) strkey, strlen(strkey),
+					multimap, &single, &nValues);
+			for (i = 1; i < nValues; i++) {
+				free(values[i]);
+			}
 			value = aaDelete(assocArray, (AAKeyType) strkey, strlen(strkey));
 			if (value == NULL) {
 				printf("DELETE: key '%s' produced no value\n", strkey);
@@ -153,6 +187,14 @@ deleteFromAssociativeArray(AssociativeArray *assocArray, char *filename, int use
 }
 
 
+static int
+printMatch(AAKeyType key, size_t keylen, void *value, void *userdata)
+{
+	printf("PREFIX: key '%.*s' has value '%s'\n", (int) keylen, (char *) key,
+			(char *) value);
+	return 0;
+}
+
 static int
 deleteValue(AAKeyType key, size_t keylen, void *value, void *userdata)
 {
@@ -160,6 +202,20 @@ deleteValue(AAKeyType key, size_t keylen, void *value, void *userdata)
 	return 0;
 }
 
+/** as deleteValue(), for every value of a key of the multimap in userdata */
+static int
+deleteValues(AAKeyType key, size_t keylen, void *value, void *userdata)
+{
+	char **values;
+	int nValues, i;
+
+	values = (char **) aaLookupAll((AssociativeArray *) userdata, key, keylen, &nValues);
+	for (i = 0; i < nValues; i++) {
+		free(values[i]);
+	}
+	return 0;
+}
+
 #define	DEFAULT_ARRAY_SIZE	100
 #define OPTIONLEN	10
 
@@ -167,6 +223,7 @@ deleteValue(AAKeyType key, size_t keylen, void *value, void *userdata)
 void usage(char *progname)
 {
 	fprintf(stderr, "%s [<OPTIONS>] <datafile> [ <datafile> ... ]\n", progname);
+	fprintf(stderr, "%s [<OPTIONS>] -l <snapshot> [ <datafile> ... ]\n", progname);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Creates an associative array and loads it with values from\n");
 	fprintf(stderr, "the data files given.\n");
@@ -184,14 +241,41 @@ void usage(char *progname)
 	fprintf(stderr, "%-*s: or your own algorithm.\n", OPTIONLEN, "");
 	fprintf(stderr, "%-*s: Probe using the given algorithm.  Choices are \"linear\", \"quadratic\",\n",
 			OPTIONLEN, "-P <ALG>");
-	fprintf(stderr, "%-*s: or \"doublehash\".\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: \"doublehash\", or \"art\" to keep the keys in an adaptive\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: radix tree instead of hashing them.\n", OPTIONLEN, "");
 	fprintf(stderr, "%-*s: Perform queries on all of the keys listed in <FILE> (one per line)\n",
 			OPTIONLEN, "-q <FILE>");
 	fprintf(stderr, "%-*s: Delete all of the keys listed in <FILE> (one per line)\n",
 			OPTIONLEN, "-d <FILE>");
+	fprintf(stderr, "%-*s: Start from the table saved in snapshot <FILE>, rather than\n",
+			OPTIONLEN, "-l <FILE>");
+	fprintf(stderr, "%-*s: an empty one (-n, -H, -2 and -P are then ignored)\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Save a snapshot of the table to <FILE> after processing\n",
+			OPTIONLEN, "-s <FILE>");
+	fprintf(stderr, "%-*s: Check a Bloom filter of <BITS> bits per slot before probing,\n",
+			OPTIONLEN, "-b <BITS>");
+	fprintf(stderr, "%-*s: so that most lookups of missing keys end early\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Check a cuckoo filter of <BITS>-bit fingerprints before probing,\n",
+			OPTIONLEN, "-c <BITS>");
+	fprintf(stderr, "%-*s: which, unlike -b, forgets keys as they are deleted\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Look up keys first in a cache of the <SLOTS> keys lately found,\n",
+			OPTIONLEN, "-k <SLOTS>");
+	fprintf(stderr, "%-*s: so that often repeated queries end without probing\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: List, in key order, the keys beginning with <PREFIX>, after\n",
+			OPTIONLEN, "-r <PREFIX>");
+	fprintf(stderr, "%-*s: any queries, using an ordered index kept as the keys are loaded\n",
+			OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Let a key hold many values: those of a key loaded again are\n",
+			OPTIONLEN, "-m");
+	fprintf(stderr, "%-*s: added to it, and queries list all of them\n", OPTIONLEN, "");
+	fprintf(stderr, "%-*s: Freeze the table with a perfect hash before any queries\n",
+			OPTIONLEN, "-f");
+	fprintf(stderr, "%-*s: (a frozen table cannot then be saved)\n", OPTIONLEN, "");
 	fprintf(stderr, "\n");
-	fprintf(stderr, "The order of the operations controlled by -d, -q and -p are: deletion first,\n");
-	fprintf(stderr, "followed by any queries, and then finally printing (if indicated)\n");
+	fprintf(stderr, "The order of the operations controlled by -d, -f, -q, -r, -s and -p are: deletion\n");
+	fprintf(stderr, "first, then freezing, followed by any queries, then listing by prefix, then\n");
+	fprintf(stderr, "saving, and then finally printing\n");
+	fprintf(stderr, "(if indicated)\n");
 	fprintf(stderr, "\n");
 	exit (1);
 }
@@ -208,7 +292,14 @@ main(int argc, char **argv)
 	int arraySize = DEFAULT_ARRAY_SIZE;
 	int useIntKey = 0;
 	int printContents = 0;
+	int freeze = 0;
+	int bloomBits = 0;
+	int cuckooBits = 0;
+	int frontSlots = 0;
+	int multimap = 0;
 	char *queryfile = NULL, *deletefile = NULL;
+	char *loadfile = NULL, *savefile = NULL;
+	char *prefix = NULL;
 	int i, c;
 
 	AssociativeArray *assocArray;
@@ -218,11 +309,15 @@ main(int argc, char **argv)
 	programname = argv[0];
 
 	/** use getopt(3) to parse command line */
-	while ((c = getopt(argc, argv, "hpin:o:P:H:2:q:d:")) != -1) {
+	while ((c = getopt(argc, argv, "hpfimn:o:P:H:2:q:d:l:s:b:c:k:r:")) != -1) {
 		if (c == 'i') {
 			useIntKey = 1;
 		} else if (c == 'p') {
 			printContents = 1;
+		} else if (c == 'f') {
+			freeze = 1;
+		} else if (c == 'm') {
+			multimap = 1;
 		} else if (c == 'n') {
 			if (sscanf(optarg, "%d", &arraySize) != 1) {
 				fprintf(stderr,
@@ -231,6 +326,30 @@ main(int argc, char **argv)
 				usage(programname);
 			}
 
+		} else if (c == 'b') {
+			if (sscanf(optarg, "%d", &bloomBits) != 1) {
+				fprintf(stderr,
+						"Error: cannot parse Bloom filter bits from '%s'\n",
+						optarg);
+				usage(programname);
+			}
+
+		} else if (c == 'c') {
+			if (sscanf(optarg, "%d", &cuckooBits) != 1) {
+				fprintf(stderr,
+						"Error: cannot parse cuckoo filter bits from '%s'\n",
+						optarg);
+				usage(programname);
+			}
+
+		} else if (c == 'k') {
+			if (sscanf(optarg, "%d", &frontSlots) != 1) {
+				fprintf(stderr,
+						"Error: cannot parse front cache slots from '%s'\n",
+						optarg);
+				usage(programname);
+			}
+
 		} else if (c == 'H') {
 			hash1 = optarg;
 
@@ -246,6 +365,15 @@ main(int argc, char **argv)
 		} else if (c == 'd') {
 			deletefile = optarg;
 
+		} else if (c == 'l') {
+			loadfile = optarg;
+
+		} else if (c == 's') {
+			savefile = optarg;
+
+		} else if (c == 'r') {
+			prefix = optarg;
+
 		} else if (c == 'o') {
 			ofp = fopen(optarg, "w");
 			if (ofp == NULL) {
@@ -264,19 +392,40 @@ main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
-	if (argc < 1) {
+	if (argc < 1 && loadfile == NULL) {
 		fprintf(stderr, "Error: No data files listed to load!\n");
 		usage(programname);
 	}
 
-	/** allocate the array and fail out if we cannot */
-	assocArray = aaCreateAssociativeArray(arraySize, probe, hash1, hash2);
+	/** allocate the array (or read a saved one) and fail out if we cannot */
+	if (loadfile != NULL) {
+		assocArray = aaLoad(loadfile);
+	} else {
+		assocArray = aaCreateAssociativeArray(arraySize, 0, probe, hash1, hash2);
+	}
 	if (assocArray == NULL) {
 		fprintf(stderr, "Error: cannot allocate associative array - exitting\n");
 		return -1;
 	}
 
 
+	if (multimap && aaSetMultimap(assocArray, 1) < 0) {
+		fprintf(stderr, "Error: cannot make the associative array a multimap\n");
+		return -1;
+	}
+	if (bloomBits > 0) {
+		aaSetBloomFilter(assocArray, bloomBits);
+	}
+	if (cuckooBits > 0) {
+		aaSetCuckooFilter(assocArray, cuckooBits);
+	}
+	if (frontSlots > 0) {
+		aaSetFrontCache(assocArray, frontSlots);
+	}
+	if (prefix != NULL) {
+		aaSetOrderedIndex(assocArray, 1);
+	}
+
 	/** getopt leaves us only "file" arguments left in argv */
 	for (i = 0; i < argc; i++) {
 		if (loadAssociativeArray(assocArray, argv[i], useIntKey) < 0) {
@@ -289,12 +438,27 @@ main(int argc, char **argv)
 
 	/** delete anything that we were asked to */
 	if (deletefile != NULL) {
-		deleteFromAssociativeArray(assocArray, deletefile, useIntKey);
+		deleteFromAssociativeArray(assocArray, deletefile, useIntKey, multimap);
+	}
+
+	/** index what is left by a perfect hash, so each query is one probe */
+	if (freeze) {
+		aaFreezePerfect(assocArray);
 	}
 
 	/** perform any queries we were asked to */
 	if (queryfile != NULL) {
-		queryAssociativeArray(assocArray, queryfile, useIntKey);
+		queryAssociativeArray(assocArray, queryfile, useIntKey, multimap);
+	}
+
+	/** list, in order, the keys beginning with the prefix asked for */
+	if (prefix != NULL) {
+		aaPrefixScan(assocArray, (AAKeyType) prefix, strlen(prefix), printMatch, NULL);
+	}
+
+	/** save the table for a later run to start from */
+	if (savefile != NULL) {
+		aaSave(assocArray, savefile);
 	}
 
 	/* print out what we loaded */
@@ -304,7 +468,7 @@ main(int argc, char **argv)
 	}
 
 	/* clean up before exit */
-	aaIterateAction(assocArray, deleteValue, NULL);
+	aaIterateAction(assocArray, multimap ? deleteValues : deleteValue, assocArray);
 	aaDeleteAssociativeArray(assocArray);
 
 	/* exit with success if we get here */
@@ -3,6 +3,8 @@
  * A tool to find a good prime number for use as a table size.
  */
 
+#include <limits.h>
+
 /** a table of primes up to a moderately large size */
 static int sPrimes[] = {
 		   2,      3,      5,      7,     11,     13,     17,     19,     23,     29,
@@ -109,10 +111,23 @@ static int sPrimes[] = {
 	};
 
 
+/** true if the odd number value has no odd divisor */
+static int isOddPrime(int value)
+{
+	int divisor;
+
+	for (divisor = 3; divisor <= value / divisor; divisor += 2) {
+		if (value % divisor == 0)
+			return 0;
+	}
+	return 1;
+}
+
 /**
  * Locates the next largest prime.
  *  params  value  the value to start at
- *  returns the prime larger than the given value, if known
+ *  returns the prime larger than the given value, or -1 if none
+ *			fits in an int
  */
 int getLargerPrime(int value)
 {
@@ -120,10 +135,21 @@ int getLargerPrime(int value)
 	while (sPrimes[i] > 0 && sPrimes[i] < value)
 		i++;
 
-	/** if we walked off the table, return -1 */
-	if (sPrimes[i] < 0) return (-1);
+	if (sPrimes[i] > 0)
+		return sPrimes[i];
 
-	return sPrimes[i];
+	/**
+	 * past the end of the table, search by trial division; primes
+	 * are dense enough that only a few candidates are ever tried
+	 */
+	if (value % 2 == 0)
+		value++;
+	while ( ! isOddPrime(value)) {
+		if (value > INT_MAX - 2)
+			return (-1);
+		value += 2;
+	}
+	return value;
 }
 
 